@@ -9,6 +9,8 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | FUNC '(' expr ')'  # Function
+    | RANGE  # Range
     | CELL  # Cell
     | NUMBER  # Literal
     ;
@@ -26,5 +28,11 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// FUNC also matches the letters of a cell name, but the lexer takes the
+// longest match: A1 is a CELL, A1:B2 a RANGE and only a name without
+// digits, such as SUM, is a FUNC
+fragment CELL_NAME: [A-Z]+[0-9]+ ;
+CELL: CELL_NAME ;
+RANGE: CELL_NAME ':' CELL_NAME ;
+FUNC: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
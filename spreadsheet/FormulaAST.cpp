@@ -4,6 +4,7 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <memory>
@@ -70,17 +71,188 @@ namespace ASTImpl
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
+    // Собирает постфиксную программу при обходе дерева и следит за
+    // тем, насколько глубоким становится стек вычисления
+    class ProgramBuilder
+    {
+    public:
+        using Op = Instruction::Op;
+
+        ProgramBuilder(const std::vector<Position> &cells, const std::vector<CellRange> &ranges)
+            : cells_(cells), ranges_(ranges)
+        {
+        }
+
+        void PushNumber(double value)
+        {
+            Emit(Op::PushNumber);
+            program_.back().number = value;
+        }
+
+        void PushCell(Position cell)
+        {
+            auto it = std::lower_bound(cells_.begin(), cells_.end(), cell);
+            assert(it != cells_.end() && *it == cell);
+            Emit(Op::PushCell, static_cast<std::uint32_t>(it - cells_.begin()));
+        }
+
+        // op - одна из свёрток диапазона
+        void PushRange(Op op, CellRange range)
+        {
+            auto it = std::lower_bound(ranges_.begin(), ranges_.end(), range);
+            assert(it != ranges_.end() && *it == range);
+            Emit(op, static_cast<std::uint32_t>(it - ranges_.begin()));
+        }
+
+        void Emit(Op op, std::uint32_t operand = 0)
+        {
+            switch (op)
+            {
+            case Op::PushNumber:
+            case Op::PushCell:
+            case Op::SumRange:
+            case Op::MinRange:
+            case Op::MaxRange:
+                ++depth_;
+                max_depth_ = std::max(max_depth_, depth_);
+                break;
+            case Op::Add:
+            case Op::Subtract:
+            case Op::Multiply:
+            case Op::Divide:
+                --depth_;
+                // Если правый операнд только что положен на стек, его
+                // загрузка сливается с операцией
+                if (program_.back().op == Op::PushNumber || program_.back().op == Op::PushCell)
+                {
+                    program_.back().op = Fuse(op, program_.back().op);
+                    return;
+                }
+                break;
+            default:
+                break;
+            }
+            program_.push_back({op, operand, 0});
+        }
+
+        std::vector<Instruction> MoveProgram()
+        {
+            return std::move(program_);
+        }
+
+        size_t GetMaxDepth() const
+        {
+            return max_depth_;
+        }
+
+    private:
+        static Op Fuse(Op op, Op push)
+        {
+            // Слитые операции идут в том же порядке, что и обычные
+            constexpr int OPS_COUNT = static_cast<int>(Op::Divide) - static_cast<int>(Op::Add) + 1;
+            static_assert(static_cast<int>(Op::AddCell) - static_cast<int>(Op::AddNumber) == OPS_COUNT);
+
+            int base = static_cast<int>(push == Op::PushNumber ? Op::AddNumber : Op::AddCell);
+            return static_cast<Op>(base + static_cast<int>(op) - static_cast<int>(Op::Add));
+        }
+
+        const std::vector<Position> &cells_;
+        const std::vector<CellRange> &ranges_;
+        std::vector<Instruction> program_;
+        size_t depth_ = 0;
+        size_t max_depth_ = 0;
+    };
+
+    namespace
+    {
+        // Сворачивает значения ячеек диапазона так же, как инструкция
+        // диапазона. Ячейки, которых свёртка не видит, считаются нулём
+        class RangeFold
+        {
+        public:
+            RangeFold(Instruction::Op op, CellRange range)
+                : op_(op), range_(range)
+            {
+            }
+
+            // Возвращает false, как только результат стал ошибкой
+            bool Add(const CellArg &value)
+            {
+                const double *number = std::get_if<double>(&value);
+                if (!number)
+                {
+                    error_ = std::get<FormulaError>(value);
+                    return false;
+                }
+                switch (op_)
+                {
+                case Instruction::Op::SumRange:
+                    result_ += *number;
+                    break;
+                case Instruction::Op::MinRange:
+                    result_ = count_ == 0 ? *number : std::min(result_, *number);
+                    break;
+                case Instruction::Op::MaxRange:
+                    result_ = count_ == 0 ? *number : std::max(result_, *number);
+                    break;
+                default:
+                    assert(false);
+                }
+                ++count_;
+                return true;
+            }
+
+            CellArg Finish()
+            {
+                if (error_)
+                {
+                    return *error_;
+                }
+                const std::uint64_t area = std::uint64_t(range_.last.row - range_.first.row + 1) *
+                                           std::uint64_t(range_.last.col - range_.first.col + 1);
+                if (count_ < area)
+                {
+                    Add(0.0);
+                }
+                return result_;
+            }
+
+        private:
+            Instruction::Op op_;
+            CellRange range_;
+            double result_ = 0;
+            std::uint64_t count_ = 0;
+            std::optional<FormulaError> error_;
+        };
+
+        CellArg FoldRange(Instruction::Op op, CellRange range, const RangeValues &values)
+        {
+            RangeFold fold(op, range);
+            values.ForEach(range, [&fold](const CellArg &value)
+                           { return fold.Add(value); });
+            return fold.Finish();
+        }
+    } // namespace
+
     class Expr
     {
     public:
         virtual ~Expr() = default;
         virtual void Print(std::ostream &out) const = 0;
         virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const SheetArgs &args) const = 0;
+        virtual CellArg Evaluate(const SheetArgs &args) const = 0;
+        // Дописывает инструкции, вычисляющие это подвыражение
+        virtual void Compile(ProgramBuilder &program) const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
+        // Диапазон, если выражение - просто диапазон
+        virtual const CellRange *GetRange() const
+        {
+            return nullptr;
+        }
+
         void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence,
                           bool right_child = false) const
         {
@@ -155,10 +327,23 @@ namespace ASTImpl
                 }
             }
 
-            double Evaluate(const SheetArgs &getVal) const override
+            CellArg Evaluate(const SheetArgs &getVal) const override
             {
-                double lhs_value = lhs_->Evaluate(getVal);
-                double rhs_value = rhs_->Evaluate(getVal);
+                // Побеждает ошибка левого операнда, как в скомпилированной программе
+                CellArg lhs = lhs_->Evaluate(getVal);
+                const double *lhs_number = std::get_if<double>(&lhs);
+                if (!lhs_number)
+                {
+                    return lhs;
+                }
+                CellArg rhs = rhs_->Evaluate(getVal);
+                const double *rhs_number = std::get_if<double>(&rhs);
+                if (!rhs_number)
+                {
+                    return rhs;
+                }
+                double lhs_value = *lhs_number;
+                double rhs_value = *rhs_number;
 
                 switch (type_)
                 {
@@ -171,12 +356,36 @@ namespace ASTImpl
                 case Divide:
                     if (rhs_value == 0)
                     {
-                        throw FormulaError(FormulaError::Category::Arithmetic);
+                        return FormulaError(FormulaError::Category::Arithmetic);
                     }
                     return lhs_value / rhs_value;
                 default:
                     assert(false);
-                    return 0;
+                    return 0.0;
+                }
+            }
+
+            void Compile(ProgramBuilder &program) const override
+            {
+                lhs_->Compile(program);
+                rhs_->Compile(program);
+
+                switch (type_)
+                {
+                case Add:
+                    program.Emit(Instruction::Op::Add);
+                    break;
+                case Subtract:
+                    program.Emit(Instruction::Op::Subtract);
+                    break;
+                case Multiply:
+                    program.Emit(Instruction::Op::Multiply);
+                    break;
+                case Divide:
+                    program.Emit(Instruction::Op::Divide);
+                    break;
+                default:
+                    assert(false);
                 }
             }
 
@@ -219,9 +428,15 @@ namespace ASTImpl
                 return EP_UNARY;
             }
 
-            double Evaluate(const SheetArgs &getVal) const override
+            CellArg Evaluate(const SheetArgs &getVal) const override
             {
-                double operand_value = operand_->Evaluate(getVal);
+                CellArg operand = operand_->Evaluate(getVal);
+                const double *operand_number = std::get_if<double>(&operand);
+                if (!operand_number)
+                {
+                    return operand;
+                }
+                double operand_value = *operand_number;
 
                 switch (type_)
                 {
@@ -231,7 +446,17 @@ namespace ASTImpl
                     return -operand_value;
                 default:
                     assert(false);
-                    return 0;
+                    return 0.0;
+                }
+            }
+
+            void Compile(ProgramBuilder &program) const override
+            {
+                operand_->Compile(program);
+                // Унарный плюс значения не меняет
+                if (type_ == UnaryMinus)
+                {
+                    program.Emit(Instruction::Op::Negate);
                 }
             }
 
@@ -270,15 +495,172 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetArgs &getVal) const override
+            CellArg Evaluate(const SheetArgs &getVal) const override
             {
                 return getVal(*cell_);
             }
 
+            void Compile(ProgramBuilder &program) const override
+            {
+                program.PushCell(*cell_);
+            }
+
         private:
             const Position *cell_;
         };
 
+        // Диапазон допустим только как аргумент функции; в любом другом месте
+        // его отвергает разбор, так что сам по себе он не вычисляется
+        class RangeExpr final : public Expr
+        {
+        public:
+            explicit RangeExpr(CellRange range)
+                : range_(range)
+            {
+            }
+
+            void Print(std::ostream &out) const override
+            {
+                out << range_.ToString();
+            }
+
+            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override
+            {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override
+            {
+                return EP_ATOM;
+            }
+
+            CellArg Evaluate(const SheetArgs & /* getVal */) const override
+            {
+                assert(false);
+                return FormulaError(FormulaError::Category::Value);
+            }
+
+            void Compile(ProgramBuilder & /* program */) const override
+            {
+                assert(false);
+            }
+
+            const CellRange *GetRange() const override
+            {
+                return &range_;
+            }
+
+        private:
+            CellRange range_;
+        };
+
+        // SUM, MIN или MAX диапазона, каждая ячейка которого учитывается,
+        // пустая - как ноль. От обычного выражения - само выражение
+        class FunctionExpr final : public Expr
+        {
+        public:
+            enum Type
+            {
+                Sum,
+                Min,
+                Max,
+            };
+
+        public:
+            explicit FunctionExpr(Type type, std::unique_ptr<Expr> arg)
+                : type_(type), arg_(std::move(arg))
+            {
+            }
+
+            static std::optional<Type> FromName(std::string_view name)
+            {
+                for (Type type : {Sum, Min, Max})
+                {
+                    if (name == GetName(type))
+                    {
+                        return type;
+                    }
+                }
+                return std::nullopt;
+            }
+
+            static std::string_view GetName(Type type)
+            {
+                switch (type)
+                {
+                case Sum:
+                    return "SUM";
+                case Min:
+                    return "MIN";
+                case Max:
+                    return "MAX";
+                default:
+                    assert(false);
+                    return "";
+                }
+            }
+
+            void Print(std::ostream &out) const override
+            {
+                out << '(' << GetName(type_) << ' ';
+                arg_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override
+            {
+                out << GetName(type_) << '(';
+                arg_->PrintFormula(out, precedence);
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override
+            {
+                return EP_ATOM;
+            }
+
+            CellArg Evaluate(const SheetArgs &getVal) const override
+            {
+                if (const CellRange *range = arg_->GetRange())
+                {
+                    return FoldRange(GetOp(), *range, SheetArgsRanges(getVal));
+                }
+                return arg_->Evaluate(getVal);
+            }
+
+            void Compile(ProgramBuilder &program) const override
+            {
+                if (const CellRange *range = arg_->GetRange())
+                {
+                    program.PushRange(GetOp(), *range);
+                }
+                else
+                {
+                    arg_->Compile(program);
+                }
+            }
+
+        private:
+            Instruction::Op GetOp() const
+            {
+                switch (type_)
+                {
+                case Sum:
+                    return Instruction::Op::SumRange;
+                case Min:
+                    return Instruction::Op::MinRange;
+                case Max:
+                    return Instruction::Op::MaxRange;
+                default:
+                    assert(false);
+                    return Instruction::Op::SumRange;
+                }
+            }
+
+            Type type_;
+            std::unique_ptr<Expr> arg_;
+        };
+
         class NumberExpr final : public Expr
         {
         public:
@@ -302,11 +684,16 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetArgs& getVal) const override
+            CellArg Evaluate(const SheetArgs& getVal) const override
             {
                 return value_;
             }
 
+            void Compile(ProgramBuilder &program) const override
+            {
+                program.PushNumber(value_);
+            }
+
         private:
             double value_;
         };
@@ -319,6 +706,7 @@ namespace ASTImpl
                 assert(args_.size() == 1);
                 auto root = std::move(args_.front());
                 args_.clear();
+                CheckOperand(*root);
 
                 return root;
             }
@@ -328,12 +716,18 @@ namespace ASTImpl
                 return std::move(cells_);
             }
 
+            std::vector<CellRange> MoveRanges()
+            {
+                return std::move(ranges_);
+            }
+
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override
             {
                 assert(args_.size() >= 1);
 
                 auto operand = std::move(args_.back());
+                CheckOperand(*operand);
 
                 UnaryOpExpr::Type type;
                 if (ctx->SUB())
@@ -387,6 +781,8 @@ namespace ASTImpl
                 args_.pop_back();
 
                 auto lhs = std::move(args_.back());
+                CheckOperand(*lhs);
+                CheckOperand(*rhs);
 
                 BinaryOpExpr::Type type;
                 if (ctx->ADD())
@@ -411,14 +807,53 @@ namespace ASTImpl
                 args_.back() = std::move(node);
             }
 
+            void exitRange(FormulaParser::RangeContext *ctx) override
+            {
+                auto value_str = ctx->RANGE()->getSymbol()->getText();
+                auto value = CellRange::FromString(value_str);
+                if (!value.IsValid())
+                {
+                    throw FormulaException("Invalid range: " + value_str);
+                }
+
+                ranges_.push_back(value);
+                auto node = std::make_unique<RangeExpr>(value);
+                args_.push_back(std::move(node));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext *ctx) override
+            {
+                assert(args_.size() >= 1);
+
+                auto name = ctx->FUNC()->getSymbol()->getText();
+                auto type = FunctionExpr::FromName(name);
+                if (!type)
+                {
+                    throw FormulaException("Unknown function: " + name);
+                }
+
+                auto node = std::make_unique<FunctionExpr>(*type, std::move(args_.back()));
+                args_.back() = std::move(node);
+            }
+
             void visitErrorNode(antlr4::tree::ErrorNode *node) override
             {
                 throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
 
         private:
+            // Диапазон не вычисляется сам по себе, его только сворачивает функция
+            static void CheckOperand(const Expr &expr)
+            {
+                if (expr.GetRange())
+                {
+                    throw FormulaException("A range can only be a function argument");
+                }
+            }
+
             std::vector<std::unique_ptr<Expr>> args_;
             std::forward_list<Position> cells_;
+            std::vector<CellRange> ranges_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener
@@ -458,7 +893,7 @@ FormulaAST ParseFormulaAST(std::istream &in)
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string &in_str)
@@ -480,6 +915,20 @@ FormulaAST ParseFormulaAST(const std::string &in_str)
     }
 } */
 
+void SheetArgsRanges::ForEach(CellRange range, const std::function<bool(const CellArg &)> &visit) const
+{
+    for (int row = range.first.row; row <= range.last.row; ++row)
+    {
+        for (int col = range.first.col; col <= range.last.col; ++col)
+        {
+            if (!visit(args_({row, col})))
+            {
+                return;
+            }
+        }
+    }
+}
+
 void FormulaAST::PrintCells(std::ostream &out) const
 {
     for (auto cell : cells_)
@@ -498,15 +947,309 @@ void FormulaAST::PrintFormula(std::ostream &out) const
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetArgs &getVal) const
+namespace ASTImpl
+{
+    namespace
+    {
+        // load переводит операнд инструкции ячейки, то есть номер среди
+        // различных ячеек формулы, в значение этой ячейки, а fold - инструкцию
+        // диапазона с операндом в свёрнутое значение диапазона. Программа
+        // останавливается на первой ошибке, будь то ошибка ячейки или деление
+        // на ноль, и возвращает её. Инструкции идут в порядке вычисления
+        // дерева, поэтому это та же ошибка
+        template <typename LoadCell, typename FoldRange>
+        CellArg Run(FormulaProgram program, const LoadCell &load, const FoldRange &fold, double *stack)
+        {
+            using Op = Instruction::Op;
+
+            // Верхнее значение хранится в локальной переменной, чтобы
+            // оставаться в регистре; top указывает на значение под ним
+            // (на фиктивное, пока стек пуст)
+            double value = 0;
+            double *top = stack;
+            for (const Instruction *it = program.code, *end = it + program.size; it != end; ++it)
+            {
+                const Instruction &instruction = *it;
+                switch (instruction.op)
+                {
+                case Op::PushNumber:
+                    *++top = value;
+                    value = instruction.number;
+                    break;
+                case Op::PushCell:
+                {
+                    const CellArg &arg = load(instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    *++top = value;
+                    value = *number;
+                    break;
+                }
+                case Op::Add:
+                    value = *top-- + value;
+                    break;
+                case Op::Subtract:
+                    value = *top-- - value;
+                    break;
+                case Op::Multiply:
+                    value = *top-- * value;
+                    break;
+                case Op::Divide:
+                    if (value == 0)
+                    {
+                        return FormulaError(FormulaError::Category::Arithmetic);
+                    }
+                    value = *top-- / value;
+                    break;
+                case Op::Negate:
+                    value = -value;
+                    break;
+                case Op::AddNumber:
+                    value += instruction.number;
+                    break;
+                case Op::SubtractNumber:
+                    value -= instruction.number;
+                    break;
+                case Op::MultiplyNumber:
+                    value *= instruction.number;
+                    break;
+                case Op::DivideNumber:
+                    if (instruction.number == 0)
+                    {
+                        return FormulaError(FormulaError::Category::Arithmetic);
+                    }
+                    value /= instruction.number;
+                    break;
+                case Op::AddCell:
+                {
+                    const CellArg &arg = load(instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    value += *number;
+                    break;
+                }
+                case Op::SubtractCell:
+                {
+                    const CellArg &arg = load(instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    value -= *number;
+                    break;
+                }
+                case Op::MultiplyCell:
+                {
+                    const CellArg &arg = load(instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    value *= *number;
+                    break;
+                }
+                case Op::DivideCell:
+                {
+                    const CellArg &arg = load(instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    double divisor = *number;
+                    if (divisor == 0)
+                    {
+                        return FormulaError(FormulaError::Category::Arithmetic);
+                    }
+                    value /= divisor;
+                    break;
+                }
+                case Op::SumRange:
+                case Op::MinRange:
+                case Op::MaxRange:
+                {
+                    const CellArg arg = fold(instruction.op, instruction.operand);
+                    const double *number = std::get_if<double>(&arg);
+                    if (!number)
+                    {
+                        return arg;
+                    }
+                    *++top = value;
+                    value = *number;
+                    break;
+                }
+                }
+            }
+            return value;
+        }
+
+        template <typename LoadCell>
+        CellArg RunProgram(FormulaProgram program, const LoadCell &load, const RangeValues &ranges)
+        {
+            auto fold = [program, &ranges](Instruction::Op op, std::uint32_t index)
+            {
+                return FoldRange(op, program.ranges[index], ranges);
+            };
+            // Набранные вручную формулы неглубоки, так что стеку почти
+            // никогда не нужна куча
+            constexpr size_t INLINE_STACK_SIZE = 32;
+            if (program.stack_size <= INLINE_STACK_SIZE)
+            {
+                double stack[INLINE_STACK_SIZE];
+                return Run(program, load, fold, stack);
+            }
+            std::vector<double> stack(program.stack_size);
+            return Run(program, load, fold, stack.data());
+        }
+    } // namespace
+} // namespace ASTImpl
+
+CellArg ExecuteProgram(FormulaProgram program, const CellArg *const *args, const RangeValues &ranges)
+{
+    return ASTImpl::RunProgram(
+        program, [args](std::uint32_t index) -> const CellArg &
+        { return *args[index]; },
+        ranges);
+}
+
+bool IsValidProgram(FormulaProgram program, size_t cell_count)
+{
+    using Op = ASTImpl::Instruction::Op;
+
+    // Значений на стеке не бывает больше, чем инструкций, что не даёт
+    // подделанному размеру стека исчерпать память
+    if (program.size == 0 || program.stack_size > program.size + 1)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < program.range_count; ++i)
+    {
+        if (!program.ranges[i].IsValid())
+        {
+            return false;
+        }
+    }
+    // depth - число значений на стеке вместе с регистром; загрузка
+    // на глубине d пишет в ячейку d + 1
+    size_t depth = 0;
+    for (const ASTImpl::Instruction *it = program.code, *end = it + program.size; it != end; ++it)
+    {
+        size_t needed = 1;
+        bool pushes = false;
+        bool reads_cell = false;
+        bool reads_range = false;
+        switch (it->op)
+        {
+        case Op::PushNumber:
+            needed = 0;
+            pushes = true;
+            break;
+        case Op::PushCell:
+            needed = 0;
+            pushes = true;
+            reads_cell = true;
+            break;
+        case Op::SumRange:
+        case Op::MinRange:
+        case Op::MaxRange:
+            needed = 0;
+            pushes = true;
+            reads_range = true;
+            break;
+        case Op::Add:
+        case Op::Subtract:
+        case Op::Multiply:
+        case Op::Divide:
+            needed = 2;
+            break;
+        case Op::Negate:
+        case Op::AddNumber:
+        case Op::SubtractNumber:
+        case Op::MultiplyNumber:
+        case Op::DivideNumber:
+            break;
+        case Op::AddCell:
+        case Op::SubtractCell:
+        case Op::MultiplyCell:
+        case Op::DivideCell:
+            reads_cell = true;
+            break;
+        default:
+            return false;
+        }
+        if (depth < needed || (reads_cell && it->operand >= cell_count) ||
+            (reads_range && it->operand >= program.range_count))
+        {
+            return false;
+        }
+        if (pushes)
+        {
+            if (depth + 2 > program.stack_size)
+            {
+                return false;
+            }
+            ++depth;
+        }
+        else if (needed == 2)
+        {
+            --depth;
+        }
+    }
+    return depth == 1;
+}
+
+FormulaProgram FormulaAST::GetProgram() const
+{
+    return {program_.data(), program_.size(), stack_size_, ranges_.data(), ranges_.size()};
+}
+
+CellArg FormulaAST::Execute(const SheetArgs &getVal) const
+{
+    return ASTImpl::RunProgram(
+        GetProgram(), [&getVal, this](std::uint32_t index)
+        { return getVal(unique_cells_[index]); },
+        SheetArgsRanges(getVal));
+}
+
+CellArg FormulaAST::Execute(const CellArg *const *args, const RangeValues &ranges) const
+{
+    return ExecuteProgram(GetProgram(), args, ranges);
+}
+
+CellArg FormulaAST::ExecuteTree(const SheetArgs &getVal) const
 {
     return root_expr_->Evaluate(getVal);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells))
+void FormulaAST::Compile()
+{
+    ASTImpl::ProgramBuilder builder(unique_cells_, ranges_);
+    root_expr_->Compile(builder);
+    program_ = builder.MoveProgram();
+    // Лишняя ячейка принимает фиктивное значение, вытесненное первой загрузкой
+    stack_size_ = builder.GetMaxDepth() + 1;
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::vector<CellRange> ranges)
+    : root_expr_(std::move(root_expr)), cells_(std::move(cells)), ranges_(std::move(ranges))
 {
     cells_.sort(); // to avoid sorting in GetReferencedCells
+    unique_cells_.assign(cells_.begin(), cells_.end());
+    unique_cells_.erase(std::unique(unique_cells_.begin(), unique_cells_.end()), unique_cells_.end());
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+    Compile();
 }
 
+FormulaAST::FormulaAST(FormulaAST &&) = default;
+FormulaAST &FormulaAST::operator=(FormulaAST &&) = default;
 FormulaAST::~FormulaAST() = default;
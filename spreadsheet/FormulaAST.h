@@ -2,10 +2,14 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula_program.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl
 {
@@ -17,18 +21,42 @@ class ParsingError : public std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
-using SheetArgs = std::function<double(Position)>;
+using SheetArgs = std::function<CellArg(Position)>;
+
+// Читает ячейки диапазона по одной через SheetArgs, включая пустые
+class SheetArgsRanges final : public RangeValues
+{
+public:
+    explicit SheetArgsRanges(const SheetArgs &args)
+        : args_(args)
+    {
+    }
+
+    void ForEach(CellRange range, const std::function<bool(const CellArg &)> &visit) const override;
+
+private:
+    const SheetArgs &args_;
+};
 
 class FormulaAST
 {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST &&) = default;
-    FormulaAST &operator=(FormulaAST &&) = default;
+                        std::forward_list<Position> cells,
+                        std::vector<CellRange> ranges);
+    FormulaAST(FormulaAST &&);
+    FormulaAST &operator=(FormulaAST &&);
     ~FormulaAST();
 
-    double Execute(const SheetArgs &) const;
+    // Выполняет скомпилированную программу
+    CellArg Execute(const SheetArgs &) const;
+    // Выполняет скомпилированную программу над заранее найденными
+    // значениями: args[i] указывает на значение i-й из GetUniqueCells(),
+    // ячейки диапазонов читаются через ranges
+    CellArg Execute(const CellArg *const *args, const RangeValues &ranges) const;
+    // Вычисляет обходом дерева выражения. Оставлено как эталон, с которым
+    // проверяется и сравнивается по скорости скомпилированная программа
+    CellArg ExecuteTree(const SheetArgs &) const;
     void PrintCells(std::ostream &out) const;
     void Print(std::ostream &out) const;
     void PrintFormula(std::ostream &out) const;
@@ -43,13 +71,37 @@ public:
         return cells_;
     }
 
+    // Отсортированы и без повторов
+    const std::vector<Position> &GetUniqueCells() const
+    {
+        return unique_cells_;
+    }
+
+    // Диапазоны, которые сворачивают функции; отсортированы и без повторов
+    const std::vector<CellRange> &GetUniqueRanges() const
+    {
+        return ranges_;
+    }
+
+    // Скомпилированная программа; действительна, пока жив FormulaAST
+    FormulaProgram GetProgram() const;
+
 private:
+    void Compile();
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::vector<Position> unique_cells_;
+    std::vector<CellRange> ranges_;
+
+    // Дерево, переложенное в постфиксный порядок; само дерево
+    // обходится только для печати формулы
+    std::vector<ASTImpl::Instruction> program_;
+    size_t stack_size_ = 0;
 };
 
 FormulaAST ParseFormulaAST(std::istream &in);
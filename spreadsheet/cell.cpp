@@ -1,120 +1,58 @@
 #include "cell.h"
 #include "common.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <new>
+#include <type_traits>
 
 class Cell::Impl
 {
 public:
-    Impl(Sheet &sheet) : sheet_(sheet) {} //, deps_(), refs_() {}
-    Impl(const Impl &other) : text_(other.text_),
-                              sheet_(other.sheet_)
-    {
-        if (!refs_.empty() && !deps_.empty())
-        {
-            refs_ = other.refs_;
-            deps_ = other.deps_;
-        }
-    }
+    Impl(Sheet &sheet) : sheet_(sheet) {}
     virtual CellInterface::Value GetValue() const = 0;
     virtual std::string GetText() const
     {
         return text_;
     }
-    // virtual void Set(std::string text) {}
     virtual std::vector<Position> GetReferencedCells() const
     {
-        if (refs_.empty())
-        {
-            return {};
-        }
-        std::vector<Position> refCells;
-        refCells.reserve(refs_.size());
-        for (auto ref : refs_)
-        {
-            refCells.push_back(ref.first);
-        }
-        return refCells;
+        return {};
     }
-    std::vector<Position> GetDependedCells() const
+
+    virtual bool Recalculate(const RangeValues & /* ranges */)
     {
-        if (deps_.empty())
-        {
-            return {};
-        }
-        std::vector<Position> depCells;
-        depCells.reserve(deps_.size());
-        for (auto dep : deps_)
-        {
-            depCells.push_back(dep.first);
-        }
-        return depCells;
+        return false;
     }
-    bool HasCycle() const
+    virtual bool IsEmpty() const
     {
-        std::unordered_set<const Impl *> visiting;
-        std::unordered_set<const Impl *> visited;
-
-        std::function<bool(const Impl *)> dfs = [&](const Impl *cell) -> bool
-        {
-            if (visiting.find(cell) != visiting.end())
-            {
-                return true; // Ячейка находится в процессе посещения, цикл обнаружен
-            }
-            if (visited.find(cell) != visited.end())
-            {
-                return false; // Ячейка уже была посещена и не является частью цикла
-            }
-
-            visiting.insert(cell);
-            for (const auto &dep : cell->refs_)
-            {
-                if (dep.second && dep.second->impl_.get())
-                {
-                    if (dfs(dep.second->impl_.get()))
-                    {
-                        return true;
-                    }
-                }
-            }
-            visiting.erase(cell);
-            visited.insert(cell);
-
-            return false;
-        };
-
-        return dfs(this);
+        return false;
     }
-    virtual void InvalidateCache() const = 0;
-    virtual std::unique_ptr<Impl> Clone(Sheet &sheet) const = 0;
-
-    void SetText(std::string text)
+    virtual bool IsFormula() const
     {
-        text_ = text;
+        return false;
     }
-    virtual ~Impl() = default;
-
-protected:
-    std::unordered_map<Position, Cell *> &GetRefs()
+    virtual const FormulaInterface *GetFormula() const
     {
-        return deps_;
+        return nullptr;
     }
-    std::unordered_map<Position, Cell *> &GetDeps()
+    // Запоминает адреса значений ячеек, на которые ссылается формула,
+    // в порядке GetReferencedCells()
+    virtual void Bind(std::vector<const FormulaInterface::Value *> /* args */) {}
+
+    void SetText(std::string text)
     {
-        return refs_;
+        text_ = std::move(text);
     }
+    virtual ~Impl() = default;
 
 public:
-    // std::unique_ptr<Impl> impl_;
     std::string text_;
     Sheet &sheet_;
-    std::unordered_map<Position, Cell *> refs_; // список ячеек, на которые ссылается текущая
-    std::unordered_map<Position, Cell *> deps_; // список ячеек, ссылающихся на эту
-
-    mutable std::optional<FormulaInterface::Value> cache_; // перенести в определения FormulaImpl и тд.
 };
 class Cell::EmptyImpl : public Cell::Impl
 {
@@ -126,27 +64,15 @@ public:
     CellInterface::Value GetValue() const override { return CellInterface::Value(); }
     std::string GetText() const override { return ""; }
     std::vector<Position> GetReferencedCells() const override { return {}; }
-    std::unique_ptr<Impl> Clone(Sheet &sheet) const override
-    {
-        auto clone = std::make_unique<EmptyImpl>(sheet);
-        clone->text_ = text_;
-        clone->refs_ = refs_;
-        clone->deps_ = deps_;
-        return clone;
-    }
-
-    void InvalidateCache() const override
-    {
-        return;
-    }
+    bool IsEmpty() const override { return true; }
 };
 
 class Cell::TextImpl : public Cell::Impl
 {
 public:
-    explicit TextImpl(Sheet &sheet, const std::string &text) : Impl(sheet) /*  text_(text) */
+    explicit TextImpl(Sheet &sheet, std::string text) : Impl(sheet)
     {
-        SetText(text);
+        SetText(std::move(text));
     }
     CellInterface::Value GetValue() const override
     {
@@ -164,205 +90,643 @@ public:
     {
         return {};
     }
-    std::unique_ptr<Impl> Clone(Sheet &sheet) const override
-    {
-        auto clone = std::make_unique<TextImpl>(sheet, text_);
-        clone->text_ = text_;
-        clone->refs_ = refs_;
-        clone->deps_ = deps_;
-        return clone;
-    }
-    void InvalidateCache() const override
+    // Значение для ссылающихся формул. Текст разбирается один раз, при
+    // установке, и дальше формулы читают готовое число или ошибку
+    FormulaInterface::Value GetArgument() const
     {
-        return;
+        std::string_view value = text_;
+        if (!value.empty() && value.front() == ESCAPE_SIGN)
+        {
+            value.remove_prefix(1);
+        }
+        return ParseTextArgument(value);
     }
-
-    // private:
-    // std::string text_;
 };
 
 class Cell::FormulaImpl : public Cell::Impl
 {
 public:
-    explicit FormulaImpl(Sheet &sheet, const std::string &formula) : Impl(sheet), formula_(ParseFormula(formula))
+    // Вычисленное значение хранится в value - поле самой ячейки, которое
+    // читают ссылающиеся на неё формулы
+    explicit FormulaImpl(Sheet &sheet, const std::string &formula, FormulaInterface::Value &value)
+        : FormulaImpl(sheet, ParseFormula(formula), value)
+    {
+    }
+    // Текст формулы строится по выражению один раз: печать и GetText
+    // берут готовую строку
+    FormulaImpl(Sheet &sheet, std::unique_ptr<FormulaInterface> formula, FormulaInterface::Value &value)
+        : Impl(sheet), formula_(std::move(formula)), value_(value)
     {
-        SetText(formula);
+        SetText(FORMULA_SIGN + formula_->GetExpression());
     }
-    FormulaImpl(const FormulaImpl &other) : Impl(*(static_cast<Impl *>(this))) {}
     CellInterface::Value GetValue() const override
     {
-        auto val = formula_->Evaluate(sheet_);
-        if (std::holds_alternative<double>(val))
+        if (std::holds_alternative<double>(value_))
         {
-            return CellInterface::Value(std::get<double>(val));
+            return CellInterface::Value(std::get<double>(value_));
         }
         else
         {
-            return CellInterface::Value(std::get<FormulaError>(val));
+            return CellInterface::Value(std::get<FormulaError>(value_));
         }
     }
-    std::string GetText() const override
-    {
-        return FORMULA_SIGN + formula_->GetExpression();
-    }
     std::vector<Position> GetReferencedCells() const override
     {
         return formula_->GetReferencedCells();
     }
-    std::unique_ptr<Impl> Clone(Sheet &sheet) const override
+    bool Recalculate(const RangeValues &ranges) override
     {
-        auto clone = std::make_unique<FormulaImpl>(sheet, text_);
-        clone->text_ = text_;
-        clone->refs_ = refs_;
-        clone->deps_ = deps_;
-        return clone;
+        value_ = formula_->Evaluate(args_.data(), ranges);
+        return true;
     }
-    void InvalidateCache() const override
+    bool IsFormula() const override
     {
-        cache_.reset();
-        for (auto ref : deps_)
-        {
-            if (ref.second->impl_->cache_.has_value())
-            {
-                ref.second->InvalidateCache();
-            }
-        }
+        return true;
+    }
+    const FormulaInterface *GetFormula() const override
+    {
+        return formula_.get();
+    }
+    void Bind(std::vector<const FormulaInterface::Value *> args) override
+    {
+        assert(args.size() == formula_->GetReferencedCells().size());
+        args_ = std::move(args);
     }
-
-    // ~FormulaImpl()
-    // {
-    //     auto deps = GetDeps();
-    //     for (auto dep : deps)
-    //     {
-    //     }
-    // }
 
 public:
     std::unique_ptr<FormulaInterface> formula_;
+
+private:
+    FormulaInterface::Value &value_;
+    std::vector<const FormulaInterface::Value *> args_;
+};
+
+// Значения ячеек диапазонов формулы читаются прямо из хранилища таблицы,
+// как и значения отдельных ссылок - из самих ячеек
+class Cell::RangeArgs final : public RangeValues
+{
+public:
+    explicit RangeArgs(CellStorage &cells) : cells_(cells) {}
+
+    void ForEach(CellRange range, const std::function<bool(const CellArg &)> &visit) const override
+    {
+        cells_.ForEachInRange(range, [&visit](Position, Cell &cell)
+                              { return visit(cell.value_); });
+    }
+
+private:
+    CellStorage &cells_;
 };
 
+bool Cell::IsFormulaText(std::string_view text)
+{
+    return text.size() > 1 && text.front() == FORMULA_SIGN;
+}
+
+size_t Cell::GetImplBlockSize(bool formula)
+{
+    return formula ? sizeof(FormulaImpl) : std::max(sizeof(EmptyImpl), sizeof(TextImpl));
+}
+
+template <typename T, typename... Args>
+Cell::ImplPtr Cell::MakeImpl(Sheet &sheet, Args &&...args)
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t));
+    FixedSizePool &pool = std::is_same_v<T, FormulaImpl> ? sheet.formula_impl_pool_ : sheet.impl_pool_;
+    void *block = pool.Allocate();
+    try
+    {
+        return ImplPtr(new (block) T(sheet, std::forward<Args>(args)...));
+    }
+    catch (...)
+    {
+        pool.Deallocate(block);
+        throw;
+    }
+}
+
+void Cell::DestroyImpl(Impl *impl)
+{
+    Sheet &sheet = impl->sheet_;
+    FixedSizePool &pool = impl->IsFormula() ? sheet.formula_impl_pool_ : sheet.impl_pool_;
+    impl->~Impl();
+    pool.Deallocate(impl);
+}
+
+void Cell::ImplDeleter::operator()(Impl *impl) const
+{
+    DestroyImpl(impl);
+}
+
 // Реализуйте следующие методы
-Cell::Cell(Sheet &sheet) : impl_(std::make_unique<Cell::EmptyImpl>(sheet)), sheet_(sheet)
+// Ячейка в диапазоне формулы должна стоять в порядке раньше неё, поэтому
+// такая ячейка создаётся в начале порядка
+Cell::Cell(Sheet &sheet, Position pos)
+    : impl_(MakeImpl<EmptyImpl>(sheet)), value_(0.0), sheet_(sheet), pos_(pos),
+      order_(sheet.range_index_.Covers(pos) ? --sheet.first_order_ : ++sheet.last_order_),
+      id_(sheet.graph_.AddNode(this))
 {
 }
 
-Cell::~Cell() = default;
+Cell::~Cell()
+{
+    sheet_.graph_.RemoveNode(id_);
+}
 
-void Cell::Set(std::string text)
+Cell::Content::Content(Cell &cell, std::string text)
 {
     if (text.empty())
     {
-        impl_ = std::make_unique<Cell::EmptyImpl>(sheet_);
+        impl_ = MakeImpl<EmptyImpl>(cell.sheet_);
+        value_ = 0.0;
     }
-    else if (text.front() == ESCAPE_SIGN)
+    else if (!IsFormulaText(text))
     {
-        impl_ = std::make_unique<Cell::TextImpl>(sheet_, text);
+        impl_ = MakeImpl<TextImpl>(cell.sheet_, std::move(text));
+        value_ = static_cast<TextImpl &>(*impl_).GetArgument();
     }
-    // else if (text.front() == ESCAPE_SIGN)
-    else if (text.front() != FORMULA_SIGN || text.size() <= 1)
+    else
     {
-        impl_ = std::make_unique<Cell::TextImpl>(sheet_, text);
+        impl_ = MakeImpl<FormulaImpl>(cell.sheet_, text.substr(1), cell.value_);
+        refs_ = impl_->GetReferencedCells();
+        ranges_ = impl_->GetFormula()->GetReferencedRanges();
     }
-    else
+}
+
+Cell::Content::Content(Cell &cell, std::unique_ptr<FormulaInterface> formula)
+    : impl_(MakeImpl<FormulaImpl>(cell.sheet_, std::move(formula), cell.value_)), refs_(impl_->GetReferencedCells()),
+      ranges_(impl_->GetFormula()->GetReferencedRanges())
+{
+}
+
+const std::vector<Position> &Cell::Content::GetReferencedCells() const
+{
+    return refs_;
+}
+
+void Cell::Swap(Content &content)
+{
+    sheet_.NoteChange(*this);
+    std::vector<Position> refs = GetReferencedCells();
+    std::vector<CellRange> ranges = GetReferencedRanges();
+    FormulaInterface::Value value = value_;
+    // Зависимые ячейки хранятся в графе таблицы и продолжают ссылаться на эту
+    std::swap(impl_, content.impl_);
+    text_changed_ = true;
+    if (content.value_)
     {
-        try
+        value_ = std::move(*content.value_);
+    }
+    content.value_ = std::move(value);
+    LinkRefs(content.refs_);
+    LinkRanges(ranges, content.ranges_);
+    content.refs_ = std::move(refs);
+    content.ranges_ = std::move(ranges);
+}
+
+void Cell::Set(std::string text)
+{
+    // Сначала строим новое содержимое целиком: если формула синтаксически
+    // некорректна или создаёт цикл, ячейка остаётся нетронутой
+    Content content(*this, std::move(text));
+    if (!PrepareOrder(content.refs_, content.ranges_))
+    {
+        throw CircularDependencyException("Circular dependency detected");
+    }
+    Swap(content);
+}
+
+void Cell::Clear()
+{
+    Set("");
+}
+
+Cell::Value Cell::GetValue() const
+{
+    // В ленивом режиме формула сначала сверяется с правками
+    if (sheet_.lazy_recalc_ && impl_->IsFormula())
+    {
+        sheet_.VerifyCell(pos_);
+    }
+    // В асинхронном - читается под блокировкой, пока фоновый поток её пишет
+    auto lock = sheet_.LockValues();
+    return impl_->GetValue();
+}
+
+Cell::Value Cell::GetCachedValue() const
+{
+    return impl_->GetValue();
+}
+
+std::string Cell::GetText() const
+{
+    return impl_->GetText();
+}
+
+const FormulaInterface *Cell::GetFormula() const
+{
+    return impl_->GetFormula();
+}
+
+void Cell::AppendValue(std::string &output) const
+{
+    if (!impl_->IsFormula())
+    {
+        std::string_view text = impl_->text_;
+        if (!text.empty() && text.front() == ESCAPE_SIGN)
         {
-            // Сохраняем текущее состояние для отката
-            auto old_impl = impl_->Clone(sheet_);
+            text.remove_prefix(1);
+        }
+        output += text;
+    }
+    else
+    {
+        AppendFormulaValue(value_, output);
+    }
+}
 
-            impl_ = std::make_unique<Cell::FormulaImpl>(sheet_, text.substr(1));
+void Cell::AppendText(std::string &output) const
+{
+    output += impl_->text_;
+}
+
+std::int64_t Cell::GetTopologicalOrder() const
+{
+    return order_;
+}
 
-            auto cells = static_cast<Cell::FormulaImpl *>(impl_.get())->GetReferencedCells();
-            if (cells.empty())
+bool Cell::PrepareOrder(const std::vector<Position> &refs, const std::vector<CellRange> &ranges)
+{
+    // Ссылка на саму себя - цикл при любом порядке
+    if (std::find(refs.begin(), refs.end(), pos_) != refs.end())
+    {
+        return false;
+    }
+    for (auto range : ranges)
+    {
+        if (range.Contains(pos_))
+        {
+            return false;
+        }
+    }
+    // От ячейки без зависимых ничего не зависит, и цикла быть не может: её
+    // достаточно поставить в конец порядка, не перебирая ячейки диапазонов
+    if (!ranges.empty() && !HasDependents())
+    {
+        order_ = ++sheet_.last_order_;
+        return true;
+    }
+    // Ссылка на ячейку, стоящую раньше текущей, порядок не нарушает, и цикл
+    // она замкнуть не может: вдоль ссылок номера только растут
+    for (auto pos : refs)
+    {
+        // Несуществующая ячейка будет создана в начале порядка
+        Cell *cell = sheet_.cells_.Find(pos);
+        if (cell && cell->order_ > order_ && !OrderAfter(*cell))
+        {
+            return false;
+        }
+    }
+    for (auto range : ranges)
+    {
+        if (!sheet_.cells_.ForEachInRange(range, [this](Position, Cell &cell)
+                                          { return cell.order_ < order_ || OrderAfter(cell); }))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Cell::OrderAfter(Cell &ref)
+{
+    // Ячейки, которые зависят от текущей и стоят не позже ref. Ссылка замкнёт
+    // цикл, только если ref среди них: на любом пути номера растут, поэтому
+    // дальше ref искать незачем
+    static thread_local std::vector<Cell *> forward, backward, stack, deps;
+    const DependencyGraph &graph = sheet_.graph_;
+    const std::int64_t lower = order_, upper = ref.order_;
+    const std::uint64_t forward_mark = ++sheet_.traversal_mark_;
+    forward.clear();
+    stack.assign(1, this);
+    mark_ = forward_mark;
+    while (!stack.empty())
+    {
+        Cell *cell = stack.back();
+        stack.pop_back();
+        forward.push_back(cell);
+        deps.clear();
+        for (auto dep_id : graph.GetDeps(cell->id_))
+        {
+            deps.push_back(graph.GetCell(dep_id));
+        }
+        cell->AppendRangeDependents(deps);
+        for (Cell *dep : deps)
+        {
+            if (dep == &ref)
             {
-                return;
+                return false;
             }
-
-            // Добавляем зависимости
-            for (auto pos : cells)
+            if (dep->order_ < upper && dep->mark_ != forward_mark)
             {
-                Cell *cell = static_cast<Cell *>(sheet_.GetCell(pos));
-                if (!cell)
-                {
-                    // Если ячейка не существует, создаем её как пустую
-                    sheet_.SetCell(pos, "");
-                    cell = static_cast<Cell *>(sheet_.GetCell(pos));
-                }
-                impl_->refs_[pos] = cell;
-
-                // Добавляем обратную ссылку
-                cell->impl_->deps_[pos] = this;
+                dep->mark_ = forward_mark;
+                stack.push_back(dep);
             }
+        }
+    }
 
-            // Проверяем на цикл после добавления всех зависимостей
-            if (impl_->HasCycle())
+    // Ячейки, от которых зависит ref и которые стоят позже текущей. С
+    // найденными выше они не пересекаются, раз цикла нет
+    const std::uint64_t backward_mark = ++sheet_.traversal_mark_;
+    backward.clear();
+    stack.assign(1, &ref);
+    ref.mark_ = backward_mark;
+    while (!stack.empty())
+    {
+        Cell *cell = stack.back();
+        stack.pop_back();
+        backward.push_back(cell);
+        auto reach = [lower, backward_mark](Cell &ref_cell)
+        {
+            if (ref_cell.order_ > lower && ref_cell.mark_ != backward_mark)
             {
-                // Если обнаружен цикл, откатываем изменения и бросаем исключение
-                impl_ = std::move(old_impl);
-                // Откатываем обратные ссылки
-                for (auto pos2 : cells)
-                {
-                    Cell *cell2 = static_cast<Cell *>(sheet_.GetCell(pos2));
-                    if (cell2)
-                    {
-                        cell2->impl_->deps_.erase(pos2);
-                    }
-                }
-                throw CircularDependencyException("Circular dependency detected");
+                ref_cell.mark_ = backward_mark;
+                stack.push_back(&ref_cell);
             }
-        }
-        catch (const FormulaException &)
+            return true;
+        };
+        for (auto ref_id : graph.GetRefs(cell->id_))
         {
-            throw;
+            reach(*graph.GetCell(ref_id));
         }
+        cell->ForEachRangeMember(reach);
+    }
+
+    // Обе группы занимают те же номера, что и раньше, но все ячейки второй
+    // идут перед всеми ячейками первой; внутри группы порядок сохраняется
+    auto by_order = [](const Cell *lhs, const Cell *rhs)
+    {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+    static thread_local std::vector<std::int64_t> orders;
+    orders.clear();
+    for (const Cell *cell : backward)
+    {
+        orders.push_back(cell->order_);
+    }
+    for (const Cell *cell : forward)
+    {
+        orders.push_back(cell->order_);
+    }
+    std::sort(orders.begin(), orders.end());
+    auto next = orders.begin();
+    for (Cell *cell : backward)
+    {
+        cell->order_ = *next++;
     }
-    // else
-    // {
-    //     impl_ = std::make_unique<Cell::TextImpl>(sheet_, text);
-    // }
+    for (Cell *cell : forward)
+    {
+        cell->order_ = *next++;
+    }
+    return true;
 }
 
-void Cell::Clear()
+void Cell::LinkRefs(const std::vector<Position> &refs)
 {
-    // Сначала сбрасываем impl_, чтобы избежать проблем с циклическими зависимостями
-    // и затем создаем новый EmptyImpl
-    impl_.reset();
-    impl_ = std::make_unique<Cell::EmptyImpl>(sheet_);
+    static thread_local std::vector<DependencyGraph::CellId> ids;
+    std::vector<const FormulaInterface::Value *> args;
+    ids.clear();
+    args.reserve(refs.size());
+    for (auto pos : refs)
+    {
+        // Если ячейка не существует, она создаётся пустой
+        Cell *cell = sheet_.GetOrCreateCell(pos);
+        ids.push_back(cell->id_);
+        args.push_back(&cell->value_);
+    }
+    sheet_.graph_.SetRefs(id_, ids);
+    // Ячейки хранятся в таблице по указателю и не перемещаются, а ячейка,
+    // на которую ссылаются, не удаляется, поэтому адреса остаются верными
+    impl_->Bind(std::move(args));
 }
 
-Cell::Value Cell::GetValue() const
+void Cell::LinkRanges(const std::vector<CellRange> &old_ranges, const std::vector<CellRange> &ranges)
 {
-    return impl_->GetValue();
+    if (old_ranges == ranges)
+    {
+        return;
+    }
+    for (auto range : old_ranges)
+    {
+        sheet_.range_index_.Remove(range, id_);
+    }
+    for (auto range : ranges)
+    {
+        sheet_.range_index_.Add(range, id_);
+    }
 }
 
-std::string Cell::GetText() const
+std::vector<Position> Cell::GetReferencedCells() const
 {
-    return impl_->GetText();
+    const DependencyGraph &graph = sheet_.graph_;
+    std::vector<Position> refs;
+    refs.reserve(graph.GetRefs(id_).size());
+    for (auto id : graph.GetRefs(id_))
+    {
+        refs.push_back(graph.GetCell(id)->pos_);
+    }
+    return refs;
 }
 
-void Cell::InvalidateCache() const
+std::vector<Position> Cell::GetDependedCells() const
 {
-    impl_->InvalidateCache();
+    const DependencyGraph &graph = sheet_.graph_;
+    std::vector<Position> deps;
+    deps.reserve(graph.GetDeps(id_).size());
+    for (auto id : graph.GetDeps(id_))
+    {
+        deps.push_back(graph.GetCell(id)->pos_);
+    }
+    return deps;
 }
 
-bool Cell::HasCycle() const
+std::vector<CellRange> Cell::GetReferencedRanges() const
 {
-    return impl_->HasCycle();
+    const FormulaInterface *formula = GetFormula();
+    return formula ? formula->GetReferencedRanges() : std::vector<CellRange>();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const
+bool Cell::IsReferenced() const
+{
+    return !sheet_.graph_.GetDeps(id_).empty();
+}
+
+bool Cell::HasDependents() const
 {
-    if (dynamic_cast<Cell::EmptyImpl *>(impl_.get()))
+    return IsReferenced() || sheet_.range_index_.Covers(pos_);
+}
+
+void Cell::AppendRangeDependents(std::vector<Cell *> &deps) const
+{
+    const RangeIndex &index = sheet_.range_index_;
+    if (index.IsEmpty())
+    {
+        return;
+    }
+    static thread_local std::vector<DependencyGraph::CellId> ids;
+    ids.clear();
+    index.FindCovering(pos_, ids);
+    for (auto id : ids)
     {
-        return static_cast<Cell::EmptyImpl *>(impl_.get())->GetReferencedCells();
+        deps.push_back(sheet_.graph_.GetCell(id));
     }
-    return impl_->GetReferencedCells();
 }
-std::vector<Position> Cell::GetDependedCells() const
+
+bool Cell::ForEachRangeMember(const std::function<bool(Cell &)> &visit) const
+{
+    const FormulaInterface *formula = GetFormula();
+    if (!formula)
+    {
+        return true;
+    }
+    const FormulaProgram program = formula->GetProgram();
+    for (size_t i = 0; i < program.range_count; ++i)
+    {
+        if (!sheet_.cells_.ForEachInRange(program.ranges[i], [&visit](Position, Cell &cell)
+                                          { return visit(cell); }))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Cell::IsEmpty() const
+{
+    return impl_->IsEmpty();
+}
+
+void Cell::GetDirtyCells(std::vector<Cell *> &order)
+{
+    order.clear();
+    // Частый случай - на ячейку никто не ссылается
+    if (!HasDependents())
+    {
+        order.push_back(this);
+        return;
+    }
+    const std::uint64_t mark = ++sheet_.traversal_mark_;
+    AppendDependents(mark, order);
+    std::reverse(order.begin(), order.end());
+}
+
+void Cell::GetDirtyCells(const std::vector<Cell *> &roots, std::vector<Cell *> &order)
+{
+    order.clear();
+    if (roots.empty())
+    {
+        return;
+    }
+    // Обратный порядок выхода из обходов от всех roots тоже топологический
+    const std::uint64_t mark = ++roots.front()->sheet_.traversal_mark_;
+    for (Cell *root : roots)
+    {
+        if (root->mark_ != mark)
+        {
+            root->AppendDependents(mark, order);
+        }
+    }
+    std::reverse(order.begin(), order.end());
+}
+
+void Cell::AppendDependents(std::uint64_t mark, std::vector<Cell *> &order)
+{
+    // Обратный порядок выхода из обхода в глубину по спискам зависимых.
+    // Обход идёт без рекурсии, чтобы длинные цепочки не переполняли стек:
+    // для каждой ячейки на стеке хранятся её зависимые и номер следующей
+    // непосещённой. Посещённые ячейки помечаются номером обхода, а стек
+    // переиспользуется, так что обход не обращается к куче. Зависимые через
+    // диапазоны идут после зависимых из графа и лежат отрезком общего буфера,
+    // который укорачивается при снятии ячейки со стека
+    struct Frame
+    {
+        Cell *cell;
+        DependencyGraph::Range deps;
+        size_t range_begin;
+        size_t size;
+        size_t next;
+    };
+    static thread_local std::vector<Frame> stack;
+    static thread_local std::vector<Cell *> range_deps;
+    const DependencyGraph &graph = sheet_.graph_;
+    auto push = [&graph](Cell *cell)
+    {
+        const DependencyGraph::Range deps = graph.GetDeps(cell->id_);
+        const size_t range_begin = range_deps.size();
+        cell->AppendRangeDependents(range_deps);
+        stack.push_back({cell, deps, range_begin, deps.size() + range_deps.size() - range_begin, 0});
+    };
+
+    stack.clear();
+    range_deps.clear();
+    push(this);
+    mark_ = mark;
+    while (!stack.empty())
+    {
+        Frame &frame = stack.back();
+        if (frame.next == frame.size)
+        {
+            order.push_back(frame.cell);
+            range_deps.resize(frame.range_begin);
+            stack.pop_back();
+            continue;
+        }
+        const size_t next = frame.next++;
+        Cell *dep = next < frame.deps.size() ? graph.GetCell(frame.deps[next])
+                                             : range_deps[frame.range_begin + next - frame.deps.size()];
+        if (dep->mark_ != mark)
+        {
+            dep->mark_ = mark;
+            push(dep);
+        }
+    }
+}
+
+std::vector<std::vector<Cell *>> Cell::GetDirtyLevels()
 {
-    if (dynamic_cast<Cell::EmptyImpl *>(impl_.get()))
+    // Уровень ячейки - длина самого длинного пути до неё от изменённой
+    // ячейки. В топологическом порядке он известен к моменту обработки ячейки
+    std::unordered_map<const Cell *, size_t> depth;
+    std::vector<std::vector<Cell *>> levels;
+    std::vector<Cell *> order;
+    std::vector<Cell *> deps;
+    GetDirtyCells(order);
+    for (Cell *cell : order)
     {
-        return static_cast<Cell::EmptyImpl *>(impl_.get())->GetDependedCells();
+        size_t level = depth[cell];
+        if (level == levels.size())
+        {
+            levels.emplace_back();
+        }
+        levels[level].push_back(cell);
+        deps.clear();
+        for (auto dep : sheet_.graph_.GetDeps(cell->id_))
+        {
+            deps.push_back(sheet_.graph_.GetCell(dep));
+        }
+        cell->AppendRangeDependents(deps);
+        for (Cell *dep : deps)
+        {
+            size_t &dep_level = depth[dep];
+            dep_level = std::max(dep_level, level + 1);
+        }
     }
-    return impl_->GetDependedCells();
-}
\ No newline at end of file
+    return levels;
+}
+
+bool Cell::Recalculate()
+{
+    return impl_->Recalculate(RangeArgs(sheet_.cells_));
+}
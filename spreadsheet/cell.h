@@ -2,21 +2,25 @@
 
 #include "sheet.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
 
+#include <cstdint>
 #include <functional>
+#include <limits>
 #include <unordered_set>
 #include <unordered_map>
 #include <optional>
 #include <stack>
 #include <stdexcept>
+#include <string_view>
 
 // class Sheet;
 
 class Cell : public CellInterface
 {
 public:
-    explicit Cell(Sheet &sheet);
+    Cell(Sheet &sheet, Position pos);
     ~Cell();
 
     // Cell(const Cell &other);
@@ -27,40 +31,144 @@ public:
 
     Value GetValue() const override;
     std::string GetText() const override;
+    // Дописывают к output значение и текст ячейки так, как их печатает
+    // таблица, не создавая промежуточных строк
+    void AppendValue(std::string &output) const;
+    void AppendText(std::string &output) const;
     std::vector<Position> GetReferencedCells() const override;
     std::vector<Position> GetDependedCells() const;
-    void InvalidateCache() const;
-    // Функция для поиска циклических зависимостей
-    bool HasCycle() const;
+    // Диапазоны формулы ячейки, как их возвращает
+    // FormulaInterface::GetReferencedRanges()
+    std::vector<CellRange> GetReferencedRanges() const;
+    // Есть ли формулы, которые ссылаются на эту ячейку
+    bool IsReferenced() const;
+    // Есть ли формулы, которые ссылаются на эту ячейку напрямую или через
+    // диапазон
+    bool HasDependents() const;
+    // Пуста ли ячейка, то есть пуст ли её текст
+    bool IsEmpty() const;
+    // Формула ячейки или nullptr, если ячейка не содержит формулы
+    const FormulaInterface *GetFormula() const;
+    // Ячейки, значения которых устаревают при изменении текущей: она сама и
+    // все транзитивно зависящие от неё. Список упорядочен топологически:
+    // каждая ячейка идёт после всех ячеек списка, на которые она ссылается.
+    // Записывается в order, чтобы буфер можно было переиспользовать
+    void GetDirtyCells(std::vector<Cell *> &order);
+    // То же для нескольких изменённых ячеек roots одной таблицы
+    static void GetDirtyCells(const std::vector<Cell *> &roots, std::vector<Cell *> &order);
+    // Те же ячейки, разбитые на уровни: ячейки одного уровня не зависят друг
+    // от друга и ссылаются только на ячейки предыдущих уровней
+    std::vector<std::vector<Cell *>> GetDirtyLevels();
+    // Вычисляет формулу заново по уже актуальным значениям её аргументов.
+    // Возвращает false, если ячейка не содержит формулы
+    bool Recalculate();
+    // Место ячейки в топологическом порядке таблицы: ячейка, на которую
+    // ссылается формула, всегда стоит раньше ячейки с этой формулой
+    std::int64_t GetTopologicalOrder() const;
+
+    // Размер блока пула таблицы под содержимое ячейки: под формулу или под
+    // текст и пустое значение
+    static size_t GetImplBlockSize(bool formula);
+    // Задаёт ли текст формулу
+    static bool IsFormulaText(std::string_view text);
+
+    // Содержимое ячейки, построенное по тексту заранее, без изменения самой
+    // ячейки
+    class Content;
+
+    // Обменивает содержимое ячейки с content, обновляя граф зависимостей, но
+    // без проверки циклов и пересчёта - это остаётся вызывающему коду.
+    // После обмена в content лежит прежнее содержимое, так что повторный
+    // обмен его возвращает
+    void Swap(Content &content);
 
 private:
+    friend class Sheet;
+
     class Impl;
-    /*     {
-        public:
-            virtual ~Impl() = default;
-            virtual CellInterface::Value GetValue() const = 0;
-            virtual std::string GetText() const = 0;
-        }; */
     class EmptyImpl;
     class TextImpl;
     class FormulaImpl;
-    /*     void InvalidateCache()
-        {
-            cache_.reset();
-            for (auto ref : refs_)
-            {
-                if (ref.second->cache_.has_value())
-                {
-                    ref.second->InvalidateCache();
-                }
-            }
-        } */
+    class RangeArgs;
+
+    // Содержимое ячейки размещается в пуле таблицы и возвращается в него
+    struct ImplDeleter
+    {
+        void operator()(Impl *impl) const;
+    };
+    using ImplPtr = std::unique_ptr<Impl, ImplDeleter>;
+
+    template <typename T, typename... Args>
+    static ImplPtr MakeImpl(Sheet &sheet, Args &&...args);
+    // Значение как есть, без проверки ленивого режима
+    Value GetCachedValue() const;
+    static void DestroyImpl(Impl *impl);
+
+    // Заменяет ссылки текущей ячейки в графе зависимостей таблицы на refs,
+    // создавая пустые ячейки там, где их ещё нет
+    void LinkRefs(const std::vector<Position> &refs);
+    // Заменяет диапазоны текущей ячейки в индексе диапазонов таблицы
+    void LinkRanges(const std::vector<CellRange> &old_ranges, const std::vector<CellRange> &ranges);
+    // Готовит топологический порядок к ссылкам текущей ячейки на ячейки refs
+    // и на ячейки диапазонов ranges. Возвращает false, если ссылки замкнут
+    // цикл; граф зависимостей при этом не меняется
+    bool PrepareOrder(const std::vector<Position> &refs, const std::vector<CellRange> &ranges);
+    // Шаг алгоритма Пирса - Келли для ссылки на ячейку ref, которая стоит в
+    // порядке позже текущей: ставит текущую ячейку после ref, переставляя
+    // только ячейки между ними. Возвращает false, если ссылка замкнёт цикл
+    bool OrderAfter(Cell &ref);
+    // Дописывает в order текущую ячейку и её непомеченные транзитивно
+    // зависимые в порядке выхода из обхода в глубину, помечая их номером mark
+    void AppendDependents(std::uint64_t mark, std::vector<Cell *> &order);
+    // Дописывает в deps формулы, диапазоны которых содержат текущую ячейку.
+    // Формула с несколькими такими диапазонами попадает туда несколько раз
+    void AppendRangeDependents(std::vector<Cell *> &deps) const;
+    // Обходит существующие ячейки диапазонов формулы текущей ячейки, пока
+    // visit не вернёт false; тогда возвращает false
+    bool ForEachRangeMember(const std::function<bool(Cell &)> &visit) const;
 
 private:
-    std::unique_ptr<Impl> impl_;
+    ImplPtr impl_;
+    // Значение ячейки для ссылающихся на неё формул: число или ошибка.
+    // Формулы читают его по адресу, найденному при установке формулы,
+    // поэтому оно хранится в самой ячейке, а не в её содержимом
+    FormulaInterface::Value value_;
     Sheet &sheet_;
-    // std::unordered_map<Position, Cell *> deps_; // список ячеек, на которые ссылается текущая
-    // std::unordered_map<Position, Cell *> refs_; // список ячеек, ссылающихся на эту
+    Position pos_;
+    // Отметка последнего обхода, в котором ячейка была посещена
+    std::uint64_t mark_ = 0;
+    // Номер в топологическом порядке. Номера уникальны, но не подряд
+    std::int64_t order_;
+    // Ленивый пересчёт (Sheet::SetLazyRecalc): эпоха правок, в которую
+    // значение ячейки последний раз изменилось, и эпоха, к которой оно
+    // подтверждено. UNVERIFIED - правленую формулу надо вычислить
+    static constexpr std::uint64_t UNVERIFIED = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t changed_epoch_ = 0;
+    std::uint64_t verified_epoch_ = 0;
+    // Номер узла ячейки в графе зависимостей таблицы
+    DependencyGraph::CellId id_;
+    // Содержимое сменилось после последней публикации в виды таблицы, и
+    // текст надо копировать заново; иначе меняется только значение
+    mutable bool text_changed_ = true;
+};
+
+class Cell::Content
+{
+public:
+    // Бросает FormulaException, если формула некорректна
+    Content(Cell &cell, std::string text);
+    // Формулу можно передать уже разобранной (без знака равенства)
+    Content(Cell &cell, std::unique_ptr<FormulaInterface> formula);
+
+    // Ячейки, на которые ссылается содержимое
+    const std::vector<Position> &GetReferencedCells() const;
+
+private:
+    friend class Cell;
 
-    // mutable std::optional<FormulaInterface::Value> cache_; // перенести в определения FormulaImpl и тд.
-};
\ No newline at end of file
+    ImplPtr impl_;
+    std::vector<Position> refs_;
+    std::vector<CellRange> ranges_;
+    // Значение формулы появится при пересчёте, значение текста известно сразу
+    std::optional<FormulaInterface::Value> value_;
+};
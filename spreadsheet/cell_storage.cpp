@@ -0,0 +1,260 @@
+#include "cell_storage.h"
+
+#include "cell.h"
+
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+    // Номер младшего установленного бита ненулевой маски
+    int LowestBit(std::uint64_t mask)
+    {
+        assert(mask != 0);
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(mask);
+#endif
+    }
+} // namespace
+
+struct CellStorage::Tile
+{
+    static constexpr int PATCHES = TILE_SIZE / PATCH_SIZE;
+
+    // Место под ячейку; сама ячейка создаётся в нём при появлении
+    struct Slot
+    {
+        alignas(Cell) unsigned char bytes[sizeof(Cell)];
+    };
+
+    struct Patch
+    {
+        std::array<Slot, PATCH_SIZE * PATCH_SIZE> slots;
+        int size = 0;
+    };
+
+    static int PatchOf(Position pos)
+    {
+        return pos.row % TILE_SIZE / PATCH_SIZE * PATCHES + pos.col % TILE_SIZE / PATCH_SIZE;
+    }
+
+    static int SlotOf(Position pos)
+    {
+        return pos.row % PATCH_SIZE * PATCH_SIZE + pos.col % PATCH_SIZE;
+    }
+
+    bool IsOccupied(Position pos) const
+    {
+        return occupied[pos.row % TILE_SIZE] >> (pos.col % TILE_SIZE) & 1;
+    }
+
+    Cell *Get(Position pos)
+    {
+        return std::launder(reinterpret_cast<Cell *>(patches[PatchOf(pos)]->slots[SlotOf(pos)].bytes));
+    }
+
+    std::array<std::unique_ptr<Patch>, PATCHES * PATCHES> patches;
+    // Занятые места: бит col слова row
+    std::array<std::uint64_t, TILE_SIZE> occupied{};
+    int size = 0;
+};
+
+static_assert(CellStorage::TILE_SIZE == 64, "a row of a tile is tracked by one 64-bit mask");
+
+CellStorage::CellStorage() = default;
+
+CellStorage::~CellStorage()
+{
+    ForEach([](Position, const Cell &cell)
+            { cell.~Cell(); });
+}
+
+CellStorage::Tile *CellStorage::FindTile(Position pos) const
+{
+    const auto &row = tiles_[pos.row / TILE_SIZE];
+    return row ? (*row)[pos.col / TILE_SIZE].get() : nullptr;
+}
+
+Cell *CellStorage::Find(Position pos)
+{
+    assert(pos.IsValid());
+    Tile *tile = FindTile(pos);
+    return tile && tile->IsOccupied(pos) ? tile->Get(pos) : nullptr;
+}
+
+const Cell *CellStorage::Find(Position pos) const
+{
+    return const_cast<CellStorage *>(this)->Find(pos);
+}
+
+Cell *CellStorage::Emplace(Sheet &sheet, Position pos)
+{
+    assert(pos.IsValid() && !Find(pos));
+    auto &row = tiles_[pos.row / TILE_SIZE];
+    if (!row)
+    {
+        row = std::make_unique<TileRow>();
+        ++tile_row_count_;
+    }
+    auto &tile = (*row)[pos.col / TILE_SIZE];
+    if (!tile)
+    {
+        tile = std::make_unique<Tile>();
+        ++tile_count_;
+    }
+    auto &patch = tile->patches[Tile::PatchOf(pos)];
+    if (!patch)
+    {
+        // Без value-инициализации: места под ячейки заполнять незачем
+        patch.reset(new Tile::Patch);
+        ++patch_count_;
+    }
+
+    Cell *cell = new (patch->slots[Tile::SlotOf(pos)].bytes) Cell(sheet, pos);
+    tile->occupied[pos.row % TILE_SIZE] |= std::uint64_t(1) << (pos.col % TILE_SIZE);
+    ++patch->size;
+    ++tile->size;
+    ++size_;
+    return cell;
+}
+
+void CellStorage::Erase(Position pos)
+{
+    auto &tile = (*tiles_[pos.row / TILE_SIZE])[pos.col / TILE_SIZE];
+    assert(tile && tile->IsOccupied(pos));
+    tile->Get(pos)->~Cell();
+    tile->occupied[pos.row % TILE_SIZE] &= ~(std::uint64_t(1) << (pos.col % TILE_SIZE));
+    --size_;
+    auto &patch = tile->patches[Tile::PatchOf(pos)];
+    if (--patch->size == 0)
+    {
+        patch.reset();
+        --patch_count_;
+    }
+    if (--tile->size == 0)
+    {
+        tile.reset();
+        --tile_count_;
+    }
+}
+
+size_t CellStorage::GetSize() const
+{
+    return size_;
+}
+
+size_t CellStorage::GetMemoryUsage() const
+{
+    return sizeof(*this) + tile_row_count_ * sizeof(TileRow) + tile_count_ * sizeof(Tile) +
+           patch_count_ * sizeof(Tile::Patch);
+}
+
+void CellStorage::ForEach(const std::function<void(Position, const Cell &)> &visit) const
+{
+    for (int tile_row = 0; tile_row < TILE_ROWS; ++tile_row)
+    {
+        if (!tiles_[tile_row])
+        {
+            continue;
+        }
+        for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col)
+        {
+            Tile *tile = (*tiles_[tile_row])[tile_col].get();
+            if (!tile)
+            {
+                continue;
+            }
+            for (int row = 0; row < TILE_SIZE; ++row)
+            {
+                for (std::uint64_t mask = tile->occupied[row]; mask != 0; mask &= mask - 1)
+                {
+                    const int col = LowestBit(mask);
+                    Position pos{tile_row * TILE_SIZE + row, tile_col * TILE_SIZE + col};
+                    visit(pos, *tile->Get(pos));
+                }
+            }
+        }
+    }
+}
+
+void CellStorage::ForEachInRow(int row, const std::function<void(int col, const Cell &)> &visit) const
+{
+    const auto &tile_row = tiles_[row / TILE_SIZE];
+    if (!tile_row)
+    {
+        return;
+    }
+    for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col)
+    {
+        Tile *tile = (*tile_row)[tile_col].get();
+        if (!tile)
+        {
+            continue;
+        }
+        for (std::uint64_t mask = tile->occupied[row % TILE_SIZE]; mask != 0; mask &= mask - 1)
+        {
+            const int col = LowestBit(mask);
+            Position pos{row, tile_col * TILE_SIZE + col};
+            visit(pos.col, *tile->Get(pos));
+        }
+    }
+}
+
+bool CellStorage::ForEachInRange(CellRange range, const std::function<bool(Position, Cell &)> &visit)
+{
+    assert(range.IsValid());
+    for (int row = range.first.row; row <= range.last.row; ++row)
+    {
+        const auto &tile_row = tiles_[row / TILE_SIZE];
+        if (!tile_row)
+        {
+            // Сразу к последней строке пустой строки блоков
+            row = (row / TILE_SIZE + 1) * TILE_SIZE - 1;
+            continue;
+        }
+        for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col)
+        {
+            Tile *tile = (*tile_row)[tile_col].get();
+            if (!tile)
+            {
+                continue;
+            }
+            const int first_col = tile_col * TILE_SIZE;
+            std::uint64_t mask = tile->occupied[row % TILE_SIZE];
+            if (range.first.col > first_col)
+            {
+                mask &= ~std::uint64_t(0) << (range.first.col - first_col);
+            }
+            if (range.last.col < first_col + TILE_SIZE - 1)
+            {
+                mask &= ~(~std::uint64_t(0) << (range.last.col - first_col + 1));
+            }
+            for (; mask != 0; mask &= mask - 1)
+            {
+                const int col = LowestBit(mask);
+                Position pos{row, first_col + col};
+                if (!visit(pos, *tile->Get(pos)))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool CellStorage::ForEachInRange(CellRange range,
+                                 const std::function<bool(Position, const Cell &)> &visit) const
+{
+    return const_cast<CellStorage *>(this)->ForEachInRange(range, [&visit](Position pos, Cell &cell)
+                                                           { return visit(pos, cell); });
+}
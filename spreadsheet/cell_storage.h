@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+class Cell;
+class Sheet;
+
+// Хранилище ячеек таблицы. Поле разбито на блоки TILE_SIZE x TILE_SIZE
+// ячеек, а блок - на участки PATCH_SIZE x PATCH_SIZE. Память под блок
+// (маски занятости и указатели на участки) и под участок выделяется, когда
+// в нём появляется первая ячейка, и освобождается вместе с последней.
+// Поэтому одинокая ячейка вдали от остальных, например пустая, на которую
+// ссылается формула, занимает участок, а не место под весь блок. Блоки
+// адресуются двухуровневым каталогом (строка блоков, затем блок в ней),
+// поэтому поиск ячейки - несколько сдвигов и обращений по индексу, без
+// хеширования. Ячейки лежат прямо в памяти участка по строкам и не
+// перемещаются, пока существуют
+class CellStorage
+{
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int PATCH_SIZE = 8;
+
+    CellStorage();
+    ~CellStorage();
+
+    CellStorage(const CellStorage &) = delete;
+    CellStorage &operator=(const CellStorage &) = delete;
+
+    // Позиция должна быть корректной. Возвращает nullptr, если ячейки нет
+    Cell *Find(Position pos);
+    const Cell *Find(Position pos) const;
+    // Создаёт пустую ячейку там, где её ещё нет
+    Cell *Emplace(Sheet &sheet, Position pos);
+    // Удаляет существующую ячейку
+    void Erase(Position pos);
+
+    size_t GetSize() const;
+    // Память, занятая участками, блоками и каталогом, в байтах
+    size_t GetMemoryUsage() const;
+
+    // Обходит ячейки блок за блоком, внутри блока - по строкам
+    void ForEach(const std::function<void(Position, const Cell &)> &visit) const;
+    // Обходит ячейки строки row по возрастанию столбца
+    void ForEachInRow(int row, const std::function<void(int col, const Cell &)> &visit) const;
+    // Обходит существующие ячейки диапазона по строкам, пропуская блоки,
+    // которых нет. Останавливается, как только visit вернёт false, и тогда
+    // возвращает false
+    bool ForEachInRange(CellRange range, const std::function<bool(Position, Cell &)> &visit);
+    bool ForEachInRange(CellRange range, const std::function<bool(Position, const Cell &)> &visit) const;
+
+private:
+    struct Tile;
+
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+    static_assert(TILE_ROWS * TILE_SIZE == Position::MAX_ROWS && TILE_COLS * TILE_SIZE == Position::MAX_COLS,
+                  "the sheet must consist of whole tiles");
+    static_assert(TILE_SIZE % PATCH_SIZE == 0, "a tile must consist of whole patches");
+
+    using TileRow = std::array<std::unique_ptr<Tile>, TILE_COLS>;
+
+    Tile *FindTile(Position pos) const;
+
+    std::array<std::unique_ptr<TileRow>, TILE_ROWS> tiles_;
+    size_t size_ = 0;
+    size_t tile_count_ = 0;
+    size_t tile_row_count_ = 0;
+    size_t patch_count_ = 0;
+};
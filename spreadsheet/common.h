@@ -49,6 +49,27 @@ struct Size
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольник ячеек от first до last включительно. В формуле
+// записывается как A1:C100; корректный диапазон задаётся левым верхним и
+// правым нижним углом
+struct CellRange
+{
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+    bool operator<(CellRange rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Углы можно задать в любом порядке: диапазон приводится к левому
+    // верхнему и правому нижнему. Некорректная запись даёт диапазон с
+    // некорректными позициями
+    static CellRange FromString(std::string_view str);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError
 {
@@ -0,0 +1,163 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+DependencyGraph::CellId DependencyGraph::AddNode(Cell *cell)
+{
+    CellId id;
+    if (free_ids_.empty())
+    {
+        id = static_cast<CellId>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    else
+    {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    }
+    nodes_[id] = Node{};
+    nodes_[id].cell = cell;
+    return id;
+}
+
+void DependencyGraph::RemoveNode(CellId id)
+{
+    Node &node = nodes_[id];
+    dead_refs_ += node.refs_size;
+    dead_deps_ += node.deps_capacity;
+    edge_count_ -= node.refs_size;
+    node = Node{};
+    free_ids_.push_back(id);
+    CompactIfNeeded();
+}
+
+void DependencyGraph::SetRefs(CellId id, const std::vector<CellId> &refs)
+{
+    Node &node = nodes_[id];
+    for (std::uint32_t i = 0; i < node.refs_size; ++i)
+    {
+        const Edge &edge = refs_[node.refs_begin + i];
+        RemoveDep(edge.cell, edge.back);
+    }
+    dead_refs_ += node.refs_size;
+    edge_count_ -= node.refs_size;
+    node.refs_begin = 0;
+    node.refs_size = 0;
+
+    if (!refs.empty())
+    {
+        node.refs_begin = static_cast<std::uint32_t>(refs_.size());
+        node.refs_size = static_cast<std::uint32_t>(refs.size());
+        for (std::uint32_t i = 0; i < node.refs_size; ++i)
+        {
+            // Отрезок уже отведён, и место парной связи известно сразу
+            refs_.push_back({refs[i], AddDep(refs[i], id, i)});
+        }
+        edge_count_ += refs.size();
+    }
+    CompactIfNeeded();
+}
+
+Cell *DependencyGraph::GetCell(CellId id) const
+{
+    return nodes_[id].cell;
+}
+
+DependencyGraph::Range DependencyGraph::GetRefs(CellId id) const
+{
+    const Node &node = nodes_[id];
+    return Range(refs_.data() + node.refs_begin, node.refs_size);
+}
+
+DependencyGraph::Range DependencyGraph::GetDeps(CellId id) const
+{
+    const Node &node = nodes_[id];
+    return Range(deps_.data() + node.deps_begin, node.deps_size);
+}
+
+size_t DependencyGraph::GetNodeCount() const
+{
+    return nodes_.size();
+}
+
+size_t DependencyGraph::GetEdgeCount() const
+{
+    return edge_count_;
+}
+
+size_t DependencyGraph::GetMemoryUsage() const
+{
+    return nodes_.capacity() * sizeof(Node) + free_ids_.capacity() * sizeof(CellId) +
+           (refs_.capacity() + deps_.capacity()) * sizeof(Edge);
+}
+
+std::uint32_t DependencyGraph::AddDep(CellId id, CellId dependent, std::uint32_t ref)
+{
+    Node &node = nodes_[id];
+    if (node.deps_size == node.deps_capacity)
+    {
+        const std::uint32_t capacity = std::max<std::uint32_t>(1, node.deps_capacity * 2);
+        const size_t end = node.deps_begin + node.deps_capacity;
+        if (node.deps_capacity != 0 && end == deps_.size())
+        {
+            // Отрезок последний в массиве и растёт на месте
+            deps_.resize(node.deps_begin + capacity);
+        }
+        else
+        {
+            const auto begin = static_cast<std::uint32_t>(deps_.size());
+            deps_.resize(begin + capacity);
+            std::copy_n(deps_.begin() + node.deps_begin, node.deps_size, deps_.begin() + begin);
+            dead_deps_ += node.deps_capacity;
+            node.deps_begin = begin;
+        }
+        node.deps_capacity = capacity;
+    }
+    deps_[node.deps_begin + node.deps_size] = {dependent, ref};
+    return node.deps_size++;
+}
+
+void DependencyGraph::RemoveDep(CellId id, std::uint32_t index)
+{
+    Node &node = nodes_[id];
+    assert(index < node.deps_size);
+    const Edge last = deps_[node.deps_begin + --node.deps_size];
+    deps_[node.deps_begin + index] = last;
+    // Перенесённая связь сообщает своё новое место парной ссылке
+    refs_[nodes_[last.cell].refs_begin + last.back].back = index;
+}
+
+void DependencyGraph::CompactIfNeeded()
+{
+    // Отрезки переписываются подряд в порядке номеров узлов; места связей
+    // внутри отрезков не меняются, поэтому парные связи остаются верными
+    if (dead_refs_ >= MIN_DEAD_EDGES && dead_refs_ * 2 > refs_.size())
+    {
+        std::vector<Edge> refs;
+        refs.reserve((refs_.size() - dead_refs_) * 2);
+        for (Node &node : nodes_)
+        {
+            const auto begin = static_cast<std::uint32_t>(refs.size());
+            refs.insert(refs.end(), refs_.begin() + node.refs_begin,
+                        refs_.begin() + node.refs_begin + node.refs_size);
+            node.refs_begin = begin;
+        }
+        refs_ = std::move(refs);
+        dead_refs_ = 0;
+    }
+    if (dead_deps_ >= MIN_DEAD_EDGES && dead_deps_ * 2 > deps_.size())
+    {
+        std::vector<Edge> deps;
+        deps.reserve((deps_.size() - dead_deps_) * 2);
+        for (Node &node : nodes_)
+        {
+            const auto begin = static_cast<std::uint32_t>(deps.size());
+            deps.insert(deps.end(), deps_.begin() + node.deps_begin,
+                        deps_.begin() + node.deps_begin + node.deps_capacity);
+            node.deps_begin = begin;
+        }
+        deps_ = std::move(deps);
+        dead_deps_ = 0;
+    }
+}
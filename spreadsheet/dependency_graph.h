@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+class Cell;
+
+// Граф зависимостей ячеек таблицы. Ячейка - узел с 32-битным номером, а её
+// связи лежат отрезками в двух общих массивах: ссылки формулы и ячейки,
+// формулы которых ссылаются на неё. Отрезок ссылок заменяется целиком при
+// смене формулы; отрезок зависимых, которому не хватило места, переносится
+// в конец массива с двойным запасом. Оставленные отрезки помечаются
+// мёртвыми и убираются уплотнением, когда их становится больше, чем живых.
+// Каждая связь помнит место парной связи у другого узла, поэтому удаление
+// ребра не ищет его в списке
+class DependencyGraph
+{
+public:
+    using CellId = std::uint32_t;
+
+private:
+    struct Edge
+    {
+        // Узел на другом конце ребра
+        CellId cell;
+        // Место парной связи в отрезке узла cell
+        std::uint32_t back;
+    };
+
+public:
+    // Номера узлов на других концах рёбер. Действителен до изменения графа
+    class Range
+    {
+    public:
+        class Iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = CellId;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const CellId *;
+            using reference = CellId;
+
+            explicit Iterator(const Edge *edge) : edge_(edge) {}
+            CellId operator*() const { return edge_->cell; }
+            Iterator &operator++()
+            {
+                ++edge_;
+                return *this;
+            }
+            bool operator==(Iterator rhs) const { return edge_ == rhs.edge_; }
+            bool operator!=(Iterator rhs) const { return edge_ != rhs.edge_; }
+
+        private:
+            const Edge *edge_;
+        };
+
+        Range(const Edge *begin, size_t size) : begin_(begin), size_(size) {}
+
+        Iterator begin() const { return Iterator(begin_); }
+        Iterator end() const { return Iterator(begin_ + size_); }
+        CellId operator[](size_t index) const { return begin_[index].cell; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+    private:
+        const Edge *begin_;
+        size_t size_;
+    };
+
+    // Добавляет узел без рёбер. Номера удалённых узлов используются повторно
+    CellId AddNode(Cell *cell);
+    // Удаляет узел. Его рёбра к этому моменту должны быть удалены; иначе
+    // граф остаётся согласованным только для уничтожения вместе с таблицей
+    void RemoveNode(CellId id);
+    // Заменяет ссылки узла id на refs (без повторов); списки зависимых у
+    // прежних и новых ссылаемых узлов обновляются
+    void SetRefs(CellId id, const std::vector<CellId> &refs);
+
+    Cell *GetCell(CellId id) const;
+    // Ссылки узла в порядке, заданном SetRefs
+    Range GetRefs(CellId id) const;
+    // Узлы, ссылающиеся на id, в произвольном порядке
+    Range GetDeps(CellId id) const;
+
+    // Число номеров узлов, включая свободные
+    size_t GetNodeCount() const;
+    size_t GetEdgeCount() const;
+    // Память под узлы и рёбра, в байтах
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Node
+    {
+        Cell *cell = nullptr;
+        std::uint32_t refs_begin = 0;
+        std::uint32_t refs_size = 0;
+        std::uint32_t deps_begin = 0;
+        std::uint32_t deps_size = 0;
+        std::uint32_t deps_capacity = 0;
+    };
+
+    // Уплотнение не запускается, пока мёртвых связей меньше этого числа
+    static constexpr size_t MIN_DEAD_EDGES = 1024;
+
+    // Добавляет dependent в зависимые узла id; ref - место парной связи в
+    // ссылках dependent. Возвращает место новой связи
+    std::uint32_t AddDep(CellId id, CellId dependent, std::uint32_t ref);
+    // Удаляет зависимую связь узла id, перенося на её место последнюю
+    void RemoveDep(CellId id, std::uint32_t index);
+    void CompactIfNeeded();
+
+    std::vector<Node> nodes_;
+    std::vector<CellId> free_ids_;
+    std::vector<Edge> refs_;
+    std::vector<Edge> deps_;
+    size_t dead_refs_ = 0;
+    size_t dead_deps_ = 0;
+    size_t edge_count_ = 0;
+};
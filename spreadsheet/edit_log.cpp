@@ -0,0 +1,436 @@
+#include "edit_log.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EDIT_LOG_FSYNC 1
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define EDIT_LOG_FSYNC 0
+#endif
+
+using namespace std::literals;
+
+namespace
+{
+    constexpr char LOG_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'L', 'O', 'G'};
+    constexpr std::uint32_t LOG_VERSION = 1;
+    // Записывается как есть: на машине с другим порядком байтов читается иначе
+    constexpr std::uint32_t LOG_BYTE_ORDER = 0x01020304;
+    constexpr size_t HEADER_SIZE = sizeof(LOG_MAGIC) + 2 * sizeof(std::uint32_t);
+    // Размер данных кадра и их контрольная сумма
+    constexpr size_t FRAME_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+    // Длина текста правки, которая очищает ячейку
+    constexpr std::uint32_t CLEARED = std::numeric_limits<std::uint32_t>::max();
+
+    template <typename T>
+    void Put(std::string &output, T value)
+    {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        output.append(bytes, sizeof(T));
+    }
+
+    template <typename T>
+    T Get(const char *input)
+    {
+        T value;
+        std::memcpy(&value, input, sizeof(T));
+        return value;
+    }
+
+    // FNV-1a: обнаруживает кадр, дописанный не до конца или поверх мусора
+    std::uint32_t Checksum(const char *data, size_t size)
+    {
+        std::uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    std::string MakeHeader()
+    {
+        std::string header(LOG_MAGIC, sizeof(LOG_MAGIC));
+        Put(header, LOG_VERSION);
+        Put(header, LOG_BYTE_ORDER);
+        return header;
+    }
+
+    [[noreturn]] void Corrupt(const std::string &path)
+    {
+        throw EditLogException("Corrupt edit log "s + path);
+    }
+} // namespace
+
+EditLog::EditLog(const std::string &path, EditLogOptions options) : path_(path), options_(options)
+{
+    const std::uint64_t valid = std::filesystem::exists(path) ? ReadValid(path, nullptr) : 0;
+    if (valid == 0)
+    {
+        // Нового журнала или журнала, чей заголовок не дописан при создании
+        file_ = std::fopen(path.c_str(), "wb");
+        const std::string header = MakeHeader();
+        if (!file_ || std::fwrite(header.data(), 1, header.size(), file_) != header.size() ||
+            std::fflush(file_) != 0)
+        {
+            if (file_)
+            {
+                std::fclose(file_);
+            }
+            throw EditLogException("Cannot create edit log "s + path);
+        }
+        written_ = header.size();
+    }
+    else
+    {
+        if (std::filesystem::file_size(path) > valid)
+        {
+            std::filesystem::resize_file(path, valid);
+        }
+        file_ = std::fopen(path.c_str(), "ab");
+        if (!file_)
+        {
+            throw EditLogException("Cannot open edit log "s + path);
+        }
+        written_ = valid;
+    }
+    // Always пишет каждую транзакцию сразу, и ждать ему нечего
+    if (options_.sync != EditLogOptions::Sync::Always)
+    {
+        flusher_ = std::thread([this]
+                               { RunFlusher(); });
+    }
+}
+
+EditLog::~EditLog()
+{
+    if (flusher_.joinable())
+    {
+        {
+            std::lock_guard lock(mutex_);
+            stop_flusher_ = true;
+        }
+        flusher_cv_.notify_all();
+        flusher_.join();
+    }
+    try
+    {
+        AbortTransaction();
+        WriteGroup();
+    }
+    catch (...)
+    {
+    }
+    if (file_)
+    {
+        std::fclose(file_);
+    }
+}
+
+void EditLog::Append(Position pos, std::optional<std::string_view> text)
+{
+    std::lock_guard lock(mutex_);
+    if (text && text->size() >= CLEARED)
+    {
+        throw EditLogException("Cell text is too long for the edit log"s);
+    }
+    if (!transaction_)
+    {
+        transaction_ = pending_.size();
+        pending_.append(FRAME_HEADER_SIZE, '\0');
+        transaction_edits_ = 0;
+    }
+    Put<std::int32_t>(pending_, pos.row);
+    Put<std::int32_t>(pending_, pos.col);
+    Put<std::uint32_t>(pending_, text ? static_cast<std::uint32_t>(text->size()) : CLEARED);
+    if (text)
+    {
+        pending_.append(*text);
+    }
+    ++transaction_edits_;
+}
+
+void EditLog::EndTransaction()
+{
+    std::unique_lock lock(mutex_);
+    if (!transaction_)
+    {
+        return;
+    }
+    const size_t frame = *transaction_;
+    const size_t begin = frame + FRAME_HEADER_SIZE;
+    const size_t size = pending_.size() - begin;
+    if (size > std::numeric_limits<std::uint32_t>::max())
+    {
+        pending_.resize(frame);
+        transaction_.reset();
+        throw EditLogException("Transaction is too large for the edit log"s);
+    }
+    const auto frame_size = static_cast<std::uint32_t>(size);
+    const std::uint32_t checksum = Checksum(pending_.data() + begin, size);
+    std::memcpy(pending_.data() + *transaction_, &frame_size, sizeof(frame_size));
+    std::memcpy(pending_.data() + *transaction_ + sizeof(frame_size), &checksum, sizeof(checksum));
+    transaction_.reset();
+
+    const auto now = std::chrono::steady_clock::now();
+    const bool started = pending_edits_ == 0;
+    if (started)
+    {
+        group_start_ = now;
+    }
+    pending_edits_ += transaction_edits_;
+    if (options_.sync == EditLogOptions::Sync::Always || pending_edits_ >= options_.group_size ||
+        now - group_start_ >= options_.group_delay || flush_failed_)
+    {
+        try
+        {
+            WriteGroup();
+        }
+        catch (...)
+        {
+            // Правку откатывает вызывающий; прежние транзакции остаются в
+            // группе до следующей попытки
+            pending_.resize(frame);
+            pending_edits_ -= transaction_edits_;
+            throw;
+        }
+    }
+    else if (started)
+    {
+        lock.unlock();
+        flusher_cv_.notify_all();
+    }
+}
+
+void EditLog::AbortTransaction()
+{
+    std::lock_guard lock(mutex_);
+    if (transaction_)
+    {
+        pending_.resize(*transaction_);
+        transaction_.reset();
+    }
+}
+
+void EditLog::Flush()
+{
+    std::lock_guard lock(mutex_);
+    WriteGroup();
+}
+
+void EditLog::Reset()
+{
+    std::lock_guard lock(mutex_);
+    pending_.clear();
+    transaction_.reset();
+    pending_edits_ = 0;
+    if (file_)
+    {
+        std::fclose(file_);
+    }
+    file_ = std::fopen(path_.c_str(), "wb");
+    const std::string header = MakeHeader();
+    if (!file_ || std::fwrite(header.data(), 1, header.size(), file_) != header.size() || std::fflush(file_) != 0)
+    {
+        throw EditLogException("Cannot reset edit log "s + path_);
+    }
+    written_ = header.size();
+    flush_failed_ = false;
+    if (options_.sync != EditLogOptions::Sync::None && !Sync())
+    {
+        throw EditLogException("Cannot sync edit log "s + path_);
+    }
+}
+
+size_t EditLog::GetGroupCount() const
+{
+    std::lock_guard lock(mutex_);
+    return group_count_;
+}
+
+size_t EditLog::GetSyncCount() const
+{
+    std::lock_guard lock(mutex_);
+    return sync_count_;
+}
+
+std::vector<EditLog::Edit> EditLog::Read(const std::string &path)
+{
+    std::vector<Edit> edits;
+    if (std::filesystem::exists(path))
+    {
+        ReadValid(path, &edits);
+    }
+    return edits;
+}
+
+std::uint64_t EditLog::ReadValid(const std::string &path, std::vector<Edit> *edits)
+{
+    std::ifstream input(path, std::ios::binary);
+    if (!input)
+    {
+        throw EditLogException("Cannot open edit log "s + path);
+    }
+    const std::string data{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+    if (data.size() < HEADER_SIZE)
+    {
+        return 0;
+    }
+    if (data.compare(0, HEADER_SIZE, MakeHeader()) != 0)
+    {
+        throw EditLogException("Not an edit log or an unsupported version: "s + path);
+    }
+
+    size_t offset = HEADER_SIZE;
+    while (data.size() - offset >= FRAME_HEADER_SIZE)
+    {
+        const auto size = Get<std::uint32_t>(data.data() + offset);
+        const auto checksum = Get<std::uint32_t>(data.data() + offset + sizeof(size));
+        const char *payload = data.data() + offset + FRAME_HEADER_SIZE;
+        // Здесь кончается то, что успело записаться целиком
+        if (size > data.size() - offset - FRAME_HEADER_SIZE || Checksum(payload, size) != checksum)
+        {
+            break;
+        }
+        for (size_t at = 0; edits && at < size;)
+        {
+            if (size - at < 3 * sizeof(std::uint32_t))
+            {
+                Corrupt(path);
+            }
+            const Position pos{Get<std::int32_t>(payload + at), Get<std::int32_t>(payload + at + 4)};
+            const auto text_size = Get<std::uint32_t>(payload + at + 8);
+            at += 3 * sizeof(std::uint32_t);
+            if (!pos.IsValid() || (text_size != CLEARED && text_size > size - at))
+            {
+                Corrupt(path);
+            }
+            if (text_size == CLEARED)
+            {
+                edits->emplace_back(pos, std::nullopt);
+            }
+            else
+            {
+                edits->emplace_back(pos, std::string(payload + at, text_size));
+                at += text_size;
+            }
+        }
+        offset += FRAME_HEADER_SIZE + size;
+    }
+    return offset;
+}
+
+void EditLog::WriteGroup()
+{
+    const size_t size = transaction_.value_or(pending_.size());
+    if (size == 0)
+    {
+        return;
+    }
+    // Группа считается записанной, только когда она и на диске, если это
+    // требуется: иначе таблица отменит правки, которые остались в файле
+    if (!file_ || std::fwrite(pending_.data(), 1, size, file_) != size || std::fflush(file_) != 0 ||
+        (options_.sync != EditLogOptions::Sync::None && !Sync()))
+    {
+        DiscardUnwritten();
+        throw EditLogException("Cannot write edit log "s + path_);
+    }
+    written_ += size;
+    flush_failed_ = false;
+    pending_.erase(0, size);
+    if (transaction_)
+    {
+        *transaction_ -= size;
+    }
+    pending_edits_ = 0;
+    ++group_count_;
+}
+
+void EditLog::DiscardUnwritten()
+{
+    if (file_)
+    {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+    // Не вышло - следующая запись сообщит, что файла нет
+    std::error_code error;
+    std::filesystem::resize_file(path_, written_, error);
+    if (!error)
+    {
+        file_ = std::fopen(path_.c_str(), "ab");
+    }
+}
+
+void EditLog::RunFlusher()
+{
+    std::unique_lock lock(mutex_);
+    while (!stop_flusher_)
+    {
+        if (pending_edits_ == 0 || flush_failed_)
+        {
+            flusher_cv_.wait(lock);
+            continue;
+        }
+        const auto deadline = group_start_ + options_.group_delay;
+        if (std::chrono::steady_clock::now() < deadline)
+        {
+            flusher_cv_.wait_until(lock, deadline);
+            continue;
+        }
+        try
+        {
+            WriteGroup();
+        }
+        catch (const EditLogException &)
+        {
+            // Повторять без перерыва незачем: группу запишет следующая правка
+            // или Flush, который и сообщит об ошибке
+            flush_failed_ = true;
+        }
+    }
+}
+
+bool EditLog::Sync()
+{
+#if EDIT_LOG_FSYNC
+#if defined(__linux__)
+    // Размер файла fdatasync сбрасывает тоже, а время изменения не нужно
+    const int result = ::fdatasync(::fileno(file_));
+#else
+    const int result = ::fsync(::fileno(file_));
+#endif
+    if (result != 0)
+    {
+        return false;
+    }
+#endif
+    ++sync_count_;
+    return true;
+}
+
+void SyncPath(const std::string &path)
+{
+#if EDIT_LOG_FSYNC
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw EditLogException("Cannot open "s + path);
+    }
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0)
+    {
+        throw EditLogException("Cannot sync "s + path);
+    }
+#else
+    (void)path;
+#endif
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Журнал правок таблицы: файл, в конец которого дописываются правки ячеек
+// между контрольными точками (Sheet::OpenLog, Sheet::Checkpoint).
+//
+// Файл начинается с заголовка из сигнатуры и версии, за которым идут кадры
+// транзакций: размер и контрольная сумма данных, затем правки - позиция,
+// длина текста (или признак очистки) и текст. Правки транзакции - одной
+// правки, пакета или загрузки - восстанавливаются только вместе: кадр,
+// дописанный не до конца при сбое, отбрасывается целиком.
+//
+// Кадры копятся в памяти и записываются группами: запись и fsync одной
+// группы делят между собой все её транзакции. Группа, запись которой не
+// удалась, отрезается от файла и ждёт следующей попытки; транзакция, на
+// которой это случилось, отбрасывается
+
+// Бросается, если журнал не удаётся прочитать или записать либо он повреждён
+class EditLogException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct EditLogOptions
+{
+    // Когда записанное становится долговечным
+    enum class Sync
+    {
+        // Группы передаются системе без fsync: правки переживают падение
+        // процесса, но не системы
+        None,
+        // Каждая группа записывается и сбрасывается на диск одним fsync
+        Group,
+        // Каждая транзакция записывается и сбрасывается на диск сразу
+        Always,
+    };
+
+    Sync sync = Sync::Group;
+    // Группа записывается, когда в ней набирается group_size правок или
+    // когда её первой транзакции исполняется group_delay. По времени группу
+    // записывает фоновый поток журнала, так что последняя группа ложится на
+    // диск и без следующих правок; Sheet::FlushLog записывает группу сразу
+    size_t group_size = 256;
+    std::chrono::milliseconds group_delay{10};
+};
+
+class EditLog
+{
+public:
+    // Правка журнала; отсутствие текста означает очистку ячейки
+    using Edit = std::pair<Position, std::optional<std::string>>;
+
+    // Открывает журнал для дописывания, создавая его, если файла нет.
+    // Недописанный кадр в конце файла отрезается
+    EditLog(const std::string &path, EditLogOptions options);
+    // Останавливает фоновый поток и записывает накопленную группу
+    ~EditLog();
+
+    EditLog(const EditLog &) = delete;
+    EditLog &operator=(const EditLog &) = delete;
+
+    // Добавляет правку в открытую транзакцию, открывая её при необходимости
+    void Append(Position pos, std::optional<std::string_view> text);
+    // Завершает транзакцию и записывает группу, если она набралась. Если
+    // запись не удалась, транзакция отбрасывается, а исключение летит дальше
+    void EndTransaction();
+    // Отбрасывает правки открытой транзакции
+    void AbortTransaction();
+    // Записывает завершённые транзакции, не дожидаясь группы, в том числе
+    // группу, фоновая запись которой не удалась
+    void Flush();
+    // Очищает журнал: его правки уже сохранены в контрольной точке.
+    // Незаписанные транзакции тоже отбрасываются
+    void Reset();
+
+    // Сколько групп записано в файл и сколько раз он сброшен на диск
+    size_t GetGroupCount() const;
+    size_t GetSyncCount() const;
+
+    // Правки завершённых транзакций журнала path в порядке записи. Пустой
+    // список, если файла нет
+    static std::vector<Edit> Read(const std::string &path);
+
+private:
+    // Разбирает журнал path: правки завершённых транзакций, если нужны, и
+    // длина части файла, которую они занимают вместе с заголовком
+    static std::uint64_t ReadValid(const std::string &path, std::vector<Edit> *edits);
+    void WriteGroup();
+    // Отрезает от файла то, что записано после целых кадров, и открывает
+    // его заново, сбросив буфер неудавшейся записи
+    void DiscardUnwritten();
+    bool Sync();
+    // Тело фонового потока: записывает группы, которым исполнилось group_delay
+    void RunFlusher();
+
+    std::string path_;
+    EditLogOptions options_;
+    // Защищает всё ниже от фонового потока
+    mutable std::mutex mutex_;
+    std::FILE *file_ = nullptr;
+    // Длина файла, занятая заголовком и целыми кадрами
+    std::uint64_t written_ = 0;
+    // Завершённые, но не записанные транзакции, и за ними открытая
+    std::string pending_;
+    // Начало кадра открытой транзакции в pending_
+    std::optional<size_t> transaction_;
+    size_t pending_edits_ = 0;
+    size_t transaction_edits_ = 0;
+    std::chrono::steady_clock::time_point group_start_;
+    size_t group_count_ = 0;
+    size_t sync_count_ = 0;
+    // Фоновая запись не удалась: группа ждёт правки или Flush
+    bool flush_failed_ = false;
+    bool stop_flusher_ = false;
+    std::condition_variable flusher_cv_;
+    std::thread flusher_;
+};
+
+// Транзакция журнала на время одной правки таблицы: если до выхода из
+// области видимости не вызван Commit, её правки отбрасываются. Без журнала
+// ничего не делает
+class EditLogTransaction
+{
+public:
+    explicit EditLogTransaction(EditLog *log) : log_(log) {}
+
+    ~EditLogTransaction()
+    {
+        if (log_)
+        {
+            log_->AbortTransaction();
+        }
+    }
+
+    EditLogTransaction(const EditLogTransaction &) = delete;
+    EditLogTransaction &operator=(const EditLogTransaction &) = delete;
+
+    void Append(Position pos, std::optional<std::string_view> text)
+    {
+        if (log_)
+        {
+            log_->Append(pos, text);
+        }
+    }
+
+    void Commit()
+    {
+        if (EditLog *log = std::exchange(log_, nullptr))
+        {
+            log->EndTransaction();
+        }
+    }
+
+private:
+    EditLog *log_;
+};
+
+// Сбрасывает на диск файл или каталог path, где система это позволяет
+void SyncPath(const std::string &path);
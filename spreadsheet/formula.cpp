@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
 #include <cmath>
 #include <sstream>
 
@@ -18,6 +19,46 @@ std::ostream &operator<<(std::ostream &output, FormulaError fe)
 
 namespace
 {
+    using Value = FormulaInterface::Value;
+
+    // Значение ячейки pos таблицы sheet для формулы, которая на неё ссылается
+    Value GetArgument(const SheetInterface &sheet, Position pos)
+    {
+        if (!pos.IsValid())
+            return FormulaError(FormulaError::Category::Ref);
+        const CellInterface *cell = sheet.GetCell(pos);
+        if (!cell)
+            return 0.0;
+        auto value = cell->GetValue();
+        if (std::holds_alternative<double>(value))
+        {
+            return std::get<double>(value);
+        }
+        else if (std::holds_alternative<FormulaError>(value))
+        {
+            return std::get<FormulaError>(value);
+        }
+        else if (std::holds_alternative<std::string>(value))
+        {
+            return ParseTextArgument(std::get<std::string>(value));
+        }
+        else
+        {
+            return FormulaError(FormulaError::Category::Value);
+        }
+    }
+
+    // Проверяет, что вычисленное значение - конечное число
+    Value Check(Value result)
+    {
+        const double *number = std::get_if<double>(&result);
+        if (number && !std::isfinite(*number))
+        {
+            return FormulaError(FormulaError::Category::Arithmetic);
+        }
+        return result;
+    }
+
     class Formula : public FormulaInterface
     {
     public:
@@ -34,99 +75,158 @@ namespace
 
         Value Evaluate(const SheetInterface &sheet) const override
         {
-            auto getval = [&sheet](Position pos) -> double
-            {
-                if (!pos.IsValid())
-                    throw FormulaError(FormulaError::Category::Ref);
-                const CellInterface *cell = sheet.GetCell(pos);
-                if (!cell)
-                    return 0.0;
-                auto value = cell->GetValue();
-                if (std::holds_alternative<double>(value))
-                {
-                    return std::get<double>(value);
-                }
-                else if (std::holds_alternative<FormulaError>(value))
-                {
-                    throw std::get<FormulaError>(value);
-                }
-                else if (std::holds_alternative<std::string>(value))
-                {
-                    const std::string &text = std::get<std::string>(value);
-                    if (text.empty())
-                    {
-                        return 0.0;
-                    }
-                    try
-                    {
-                        size_t pos = 0;
-                        double result = std::stod(text, &pos);
-                        if (pos == text.size()) { // Убедимся, что вся строка была числом
-                            return result;
-                        } else {
-                            throw FormulaError(FormulaError::Category::Value);
-                        }
-                    }
-                    catch (const std::invalid_argument &)
-                    {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                    catch (const std::out_of_range &)
-                    {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                }
-                else
-                {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            };
-            try
-            {
+            return Check(ast_.Execute([&sheet](Position pos)
+                                      { return GetArgument(sheet, pos); }));
+        }
 
-                double result = ast_.Execute(getval);
-                if (!std::isfinite(result))
-                {
-                    return FormulaError(FormulaError::Category::Arithmetic);
-                }
-                return result;
-            }
-            catch (const FormulaError &fe)
-            {
-                return fe;
-            }
+        Value Evaluate(const Value *const *args, const RangeValues &ranges) const override
+        {
+            return Check(ast_.Execute(args, ranges));
         }
 
         std::string GetExpression() const override
         {
-            std::ostringstream out;
+            // Поток создаётся один раз на поток выполнения: его создание
+            // дороже самой печати короткой формулы
+            static thread_local std::ostringstream out;
+            out.str(std::string());
             ast_.PrintFormula(out);
             return out.str();
         }
 
         std::vector<Position> GetReferencedCells() const override
         {
-            auto &cells = ast_.GetCells();
-            if (cells.empty())
+            return ast_.GetUniqueCells();
+        }
+
+        std::vector<CellRange> GetReferencedRanges() const override
+        {
+            return ast_.GetUniqueRanges();
+        }
+
+        FormulaProgram GetProgram() const override
+        {
+            return ast_.GetProgram();
+        }
+
+    private:
+        FormulaAST ast_;
+    };
+
+    // Формула без дерева разбора: выражение, ячейки и программа лежат в
+    // чужой памяти, например в отображённом в память снимке таблицы
+    class CompiledFormula : public FormulaInterface
+    {
+    public:
+        CompiledFormula(std::string_view expression, const Position *cells, size_t cell_count,
+                        FormulaProgram program, std::shared_ptr<const void> owner)
+            : expression_(expression), cells_(cells), cell_count_(cell_count), program_(program),
+              owner_(std::move(owner))
+        {
+        }
+
+        Value Evaluate(const SheetInterface &sheet) const override
+        {
+            std::vector<Value> values;
+            std::vector<const Value *> args;
+            values.reserve(cell_count_);
+            args.reserve(cell_count_);
+            for (size_t i = 0; i < cell_count_; ++i)
             {
-                return {};
+                values.push_back(GetArgument(sheet, cells_[i]));
+                args.push_back(&values.back());
             }
-            std::vector<Position> refCells;
-            for (auto &cell : cells)
+            const SheetArgs get_value = [&sheet](Position pos)
             {
-                refCells.push_back(cell);
-            }
-            std::sort(refCells.begin(), refCells.end());
-            refCells.erase(std::unique(refCells.begin(), refCells.end()), refCells.end());
-            return refCells;
+                return GetArgument(sheet, pos);
+            };
+            return Evaluate(args.data(), SheetArgsRanges(get_value));
+        }
+
+        Value Evaluate(const Value *const *args, const RangeValues &ranges) const override
+        {
+            return Check(ExecuteProgram(program_, args, ranges));
+        }
+
+        std::string GetExpression() const override
+        {
+            return std::string(expression_);
+        }
+
+        std::vector<Position> GetReferencedCells() const override
+        {
+            return std::vector<Position>(cells_, cells_ + cell_count_);
+        }
+
+        std::vector<CellRange> GetReferencedRanges() const override
+        {
+            return std::vector<CellRange>(program_.ranges, program_.ranges + program_.range_count);
+        }
+
+        FormulaProgram GetProgram() const override
+        {
+            return program_;
         }
 
     private:
-        FormulaAST ast_;
+        std::string_view expression_;
+        const Position *cells_;
+        size_t cell_count_;
+        FormulaProgram program_;
+        std::shared_ptr<const void> owner_;
     };
 } // namespace
 
+FormulaInterface::Value ParseTextArgument(std::string_view text)
+{
+    if (text.empty())
+    {
+        return 0.0;
+    }
+    // Как и прежде с std::stod, перед числом допускаются пробелы и знак плюс
+    size_t begin = 0;
+    while (begin < text.size() && std::isspace(static_cast<unsigned char>(text[begin])))
+    {
+        ++begin;
+    }
+    if (begin + 1 < text.size() && text[begin] == '+' && text[begin + 1] != '-')
+    {
+        ++begin;
+    }
+
+    const char *last = text.data() + text.size();
+    double result = 0;
+    auto [end, error] = std::from_chars(text.data() + begin, last, result);
+    if (error != std::errc() || end != last) // Убедимся, что вся строка была числом
+    {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return result;
+}
+
+void AppendFormulaValue(const FormulaInterface::Value &value, std::string &output)
+{
+    if (const double *number = std::get_if<double>(&value))
+    {
+        // %g с точностью 6
+        char buffer[32];
+        const auto result = std::to_chars(buffer, buffer + sizeof(buffer), *number, std::chars_format::general, 6);
+        output.append(buffer, result.ptr);
+    }
+    else
+    {
+        output += std::get<FormulaError>(value).ToString();
+    }
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
 {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
+
+std::unique_ptr<FormulaInterface> MakeCompiledFormula(std::string_view expression, const Position *cells,
+                                                      size_t cell_count, FormulaProgram program,
+                                                      std::shared_ptr<const void> owner)
+{
+    return std::make_unique<CompiledFormula>(expression, cells, cell_count, program, std::move(owner));
+}
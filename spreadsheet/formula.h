@@ -1,14 +1,21 @@
 #pragma once
 
 #include "common.h"
+#include "formula_program.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, MIN и MAX от диапазона ячеек: SUM(A1:C100). Учитывается
+//   каждая ячейка диапазона, пустая - как ноль; при ошибках в диапазоне
+//   возвращается первая по строкам. От обычного выражения функция равна
+//   самому выражению. Диапазон допустим только как аргумент функции
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -26,6 +33,12 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Вычисляет формулу по значениям ячеек, найденным заранее: args[i]
+    // указывает на значение i-й ячейки из GetReferencedCells(). Значения
+    // читаются напрямую, без поиска ячеек в таблице. Ячейки диапазонов из
+    // GetReferencedRanges() перебираются через ranges.
+    virtual Value Evaluate(const Value* const* args, const RangeValues& ranges) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
@@ -34,8 +47,38 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны, которые задействованы в формуле. Список
+    // отсортирован по возрастанию и не содержит повторов. Ячейки диапазонов
+    // в GetReferencedCells() не входят.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Возвращает скомпилированную программу формулы над ячейками из
+    // GetReferencedCells() и диапазонами из GetReferencedRanges().
+    // Действительна, пока жива формула.
+    virtual FormulaProgram GetProgram() const = 0;
 };
 
+// Значение текста для формул, которые ссылаются на ячейку с ним. Пустой текст
+// трактуется как ноль, текст, целиком представляющий число, - как это число,
+// любой другой текст - как ошибка #VALUE!. Исключений не бросает.
+FormulaInterface::Value ParseTextArgument(std::string_view text);
+
+// Дописывает к output значение формулы так, как его печатает таблица:
+// число - как operator<< потока с настройками по умолчанию, ошибку - как
+// FormulaError::ToString
+void AppendFormulaValue(const FormulaInterface::Value& value, std::string& output);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Создаёт формулу из уже скомпилированного вида, не разбирая выражение:
+// expression - её выражение, cells - ячейки, на которые она ссылается
+// (cell_count штук по возрастанию без повторов), program - программа над
+// ними вместе со своими диапазонами. Формула не копирует эти данные, а указывает на них; память под
+// ними должна жить, пока жив owner, которого формула хранит у себя.
+// Программа должна быть проверена IsValidProgram.
+std::unique_ptr<FormulaInterface> MakeCompiledFormula(std::string_view expression, const Position* cells,
+                                                      size_t cell_count, FormulaProgram program,
+                                                      std::shared_ptr<const void> owner);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <variant>
+
+namespace ASTImpl
+{
+    // Инструкция стековой машины, в программу которой компилируется дерево
+    // выражения. Ячейка задаётся номером в отсортированном списке различных
+    // ячеек, на которые ссылается формула
+    struct Instruction
+    {
+        enum class Op : std::uint8_t
+        {
+            PushNumber,
+            PushCell,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Negate,
+            // Правый операнд бинарной операции берётся прямо из инструкции, а
+            // не кладётся на стек отдельно
+            AddNumber,
+            SubtractNumber,
+            MultiplyNumber,
+            DivideNumber,
+            AddCell,
+            SubtractCell,
+            MultiplyCell,
+            DivideCell,
+            // Кладут на стек сумму, минимум или максимум ячеек диапазона,
+            // заданного номером в диапазонах программы
+            SumRange,
+            MinRange,
+            MaxRange,
+        };
+
+        Op op;
+        std::uint32_t operand = 0;
+        double number = 0;
+    };
+}
+
+// Значение ячейки, каким его видят ссылающиеся на неё формулы. Ошибки
+// передаются как значения: вычисление останавливается на первой из них
+// и возвращает её, исключений не бросается
+using CellArg = std::variant<double, FormulaError>;
+
+// Ячейки диапазонов, которые сворачивает формула. Диапазоны не
+// связываются заранее, как отдельные ячейки: они могут накрывать почти всю
+// таблицу, поэтому их значения читаются из ячеек во время вычисления
+class RangeValues
+{
+public:
+    // Вызывает visit со значением каждой ячейки range по строкам, пока
+    // тот не вернёт false. Пустые ячейки можно пропускать: непосещённая
+    // ячейка считается нулём
+    virtual void ForEach(CellRange range, const std::function<bool(const CellArg &)> &visit) const = 0;
+
+protected:
+    ~RangeValues() = default;
+};
+
+// Скомпилированная формула: постфиксная программа над различными
+// ячейками и диапазонами, на которые ссылается формула. Это только вид:
+// инструкции и диапазоны принадлежат FormulaAST или отображённому в память
+// снимку
+struct FormulaProgram
+{
+    const ASTImpl::Instruction *code = nullptr;
+    size_t size = 0;
+    // Сколько ячеек стека нужно программе, включая ячейку под дном
+    size_t stack_size = 0;
+    // Отсортированы и без повторов
+    const CellRange *ranges = nullptr;
+    size_t range_count = 0;
+};
+
+// Выполняет программу; args[i] - значение i-й ячейки, на которую она
+// ссылается, ranges даёт ячейки её диапазонов
+CellArg ExecuteProgram(FormulaProgram program, const CellArg *const *args, const RangeValues &ranges);
+
+// Проверяет, что программу, прочитанную извне, безопасно выполнять над
+// cell_count ячейками: коды операций и операнды-ячейки и диапазоны
+// корректны, диапазоны лежат в пределах таблицы, а стек не уходит ниже дна
+// и не превышает stack_size
+bool IsValidProgram(FormulaProgram program, size_t cell_count);
@@ -0,0 +1,48 @@
+#include "heap_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<size_t> heap_allocations = 0;
+}
+
+size_t GetHeapAllocationCount()
+{
+    return heap_allocations.load(std::memory_order_relaxed);
+}
+
+void *operator new(std::size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *block = std::malloc(size ? size : 1))
+    {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+// Без неё память из nothrow-варианта стандартной библиотеки освобождалась
+// бы заменённым delete, а выделялась бы не malloc
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void operator delete(void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+// Число обращений к куче через operator new с начала работы программы.
+// Программа заменяет глобальный operator new, чтобы тесты и бенчмарки видели,
+// сколько выделений памяти стоит правка таблицы
+size_t GetHeapAllocationCount();
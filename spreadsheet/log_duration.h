@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profileGuard, __LINE__)
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+#define LOG_DURATION_STREAM(x, y) LogDuration UNIQUE_VAR_NAME_PROFILE(x, y)
+
+// Выводит время жизни объекта: от создания до разрушения
+class LogDuration
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LogDuration(std::string_view id, std::ostream &dst_stream = std::cerr)
+        : id_(id), dst_stream_(dst_stream)
+    {
+    }
+
+    ~LogDuration()
+    {
+        using namespace std::chrono;
+        using namespace std::literals;
+
+        const auto end_time = Clock::now();
+        const auto dur = end_time - start_time_;
+        dst_stream_ << id_ << ": "sv << duration_cast<microseconds>(dur).count() / 1000.0 << " ms"sv << std::endl;
+    }
+
+private:
+    const std::string id_;
+    const Clock::time_point start_time_ = Clock::now();
+    std::ostream &dst_stream_;
+};
@@ -1,144 +1,3587 @@
-// #include "common.h"
-// #include "test_runner_p.h"
-
-// #include <iomanip>
-
-// inline std::ostream &operator<<(std::ostream &output, Position pos)
-// {
-//     return output << "(" << pos.row << ", " << pos.col << ")";
-// }
-
-// inline Position operator"" _pos(const char *str, std::size_t)
-// {
-//     return Position::FromString(str);
-// }
-
-// inline std::ostream &operator<<(std::ostream &output, Size size)
-// {
-//     return output << "(" << size.rows << ", " << size.cols << ")";
-// }
-
-// inline std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value)
-// {
-//     std::visit(
-//         [&](const auto &x)
-//         {
-//             output << x;
-//         },
-//         value);
-//     return output;
-// }
-
-// namespace
-// {
-
-//     void TestEmpty()
-//     {
-//         auto sheet = CreateSheet();
-//         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-//     }
-
-//     void TestInvalidPosition()
-//     {
-//         auto sheet = CreateSheet();
-//         try
-//         {
-//             sheet->SetCell(Position{-1, 0}, "");
-//         }
-//         catch (const InvalidPositionException &)
-//         {
-//         }
-//         try
-//         {
-//             sheet->GetCell(Position{0, -2});
-//         }
-//         catch (const InvalidPositionException &)
-//         {
-//         }
-//         try
-//         {
-//             sheet->ClearCell(Position{Position::MAX_ROWS, 0});
-//         }
-//         catch (const InvalidPositionException &)
-//         {
-//         }
-//     }
-
-//     void TestSetCellPlainText()
-//     {
-//         auto sheet = CreateSheet();
-
-//         auto checkCell = [&](Position pos, std::string text)
-//         {
-//             sheet->SetCell(pos, text);
-//             CellInterface *cell = sheet->GetCell(pos);
-//             ASSERT(cell != nullptr);
-//             ASSERT_EQUAL(cell->GetText(), text);
-//             ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-//         };
-
-//         checkCell("A1"_pos, "Hello");
-//         checkCell("A1"_pos, "World");
-//         checkCell("B2"_pos, "Purr");
-//         checkCell("A3"_pos, "Meow");
-
-//         const SheetInterface &constSheet = *sheet;
-//         ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-//         sheet->SetCell("A3"_pos, "'=escaped");
-//         CellInterface *cell = sheet->GetCell("A3"_pos);
-//         ASSERT_EQUAL(cell->GetText(), "'=escaped");
-//         ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-//     }
-
-//     void TestClearCell()
-//     {
-//         auto sheet = CreateSheet();
-
-//         sheet->SetCell("C2"_pos, "Me gusta");
-//         sheet->ClearCell("C2"_pos);
-//         ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-//         sheet->ClearCell("A1"_pos);
-//         sheet->ClearCell("J10"_pos);
-//     }
-//     void TestPrint()
-//     {
-//         auto sheet = CreateSheet();
-//         sheet->SetCell("A2"_pos, "meow");
-//         sheet->SetCell("B2"_pos, "=1+2");
-//         sheet->SetCell("A1"_pos, "=1/0");
-
-//         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-//         std::ostringstream texts;
-//         sheet->PrintTexts(texts);
-//         // std::cout << texts.str() << "=1/0\t\nmeow\t=1+2\n" << std::endl;
-
-//         std::cout << "=== PrintTexts ===" << std::endl;
-//         std::cout << texts.str() << std::endl;
-//         // Position pos = "B2"_pos;
-//         // std::cout << pos.col << std::endl; // должно быть 2
-//         std::cout << "==================" << std::endl;
-
-//         ASSERT_EQUAL(texts.str(), "=1/0\t\nmeow\t=1+2\n");
-
-//         std::ostringstream values;
-//         sheet->PrintValues(values);
-//         ASSERT_EQUAL(values.str(), "#ARITHM!\t\nmeow\t3\n");
-
-//         sheet->ClearCell("B2"_pos);
-//         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
-//     }
-
-// } // namespace
-
-// int main()
-// {
-//     TestRunner tr;
-//     RUN_TEST(tr, TestEmpty);
-//     RUN_TEST(tr, TestInvalidPosition);
-//     RUN_TEST(tr, TestSetCellPlainText);
-//     RUN_TEST(tr, TestClearCell);
-//     RUN_TEST(tr, TestPrint);
-// }
\ No newline at end of file
+#include "common.h"
+#include "FormulaAST.h"
+#include "cell.h"
+#include "cell_storage.h"
+#include "dependency_graph.h"
+#include "edit_log.h"
+#include "heap_counter.h"
+#include "log_duration.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "test_runner_p.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__linux__)
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+using namespace std::literals;
+
+inline std::ostream &operator<<(std::ostream &output, Position pos)
+{
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+inline Position operator"" _pos(const char *str, std::size_t)
+{
+    return Position::FromString(str);
+}
+
+inline std::ostream &operator<<(std::ostream &output, Size size)
+{
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value)
+{
+    std::visit(
+        [&](const auto &x)
+        {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+namespace
+{
+
+    void TestEmpty()
+    {
+        auto sheet = CreateSheet();
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestInvalidPosition()
+    {
+        auto sheet = CreateSheet();
+        try
+        {
+            sheet->SetCell(Position{-1, 0}, "");
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+        try
+        {
+            sheet->GetCell(Position{0, -2});
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+        try
+        {
+            sheet->ClearCell(Position{Position::MAX_ROWS, 0});
+        }
+        catch (const InvalidPositionException &)
+        {
+        }
+    }
+
+    void TestSetCellPlainText()
+    {
+        auto sheet = CreateSheet();
+
+        auto checkCell = [&](Position pos, std::string text)
+        {
+            sheet->SetCell(pos, text);
+            CellInterface *cell = sheet->GetCell(pos);
+            ASSERT(cell != nullptr);
+            ASSERT_EQUAL(cell->GetText(), text);
+            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+        };
+
+        checkCell("A1"_pos, "Hello");
+        checkCell("A1"_pos, "World");
+        checkCell("B2"_pos, "Purr");
+        checkCell("A3"_pos, "Meow");
+
+        const SheetInterface &constSheet = *sheet;
+        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+        sheet->SetCell("A3"_pos, "'=escaped");
+        CellInterface *cell = sheet->GetCell("A3"_pos);
+        ASSERT_EQUAL(cell->GetText(), "'=escaped");
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+    }
+
+    void TestClearCell()
+    {
+        auto sheet = CreateSheet();
+
+        sheet->SetCell("C2"_pos, "Me gusta");
+        sheet->ClearCell("C2"_pos);
+        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+        sheet->ClearCell("A1"_pos);
+        sheet->ClearCell("J10"_pos);
+    }
+    void TestPrint()
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A2"_pos, "meow");
+        sheet->SetCell("B2"_pos, "=1+2");
+        sheet->SetCell("A1"_pos, "=1/0");
+
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "=1/0\t\nmeow\t=1+2\n");
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "#ARITHM!\t\nmeow\t3\n");
+
+        sheet->ClearCell("B2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
+    }
+
+    void TestMemoizedDiamond()
+    {
+        // Каждый ярус ссылается дважды на предыдущий: без кэша вычисление
+        // последнего яруса стоит 2^LAYERS вычислений
+        const int LAYERS = 40;
+        const size_t FORMULAS = 2 * (LAYERS - 1);
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "1");
+        for (int row = 1; row < LAYERS; ++row)
+        {
+            std::string prev = std::to_string(row);
+            sheet.SetCell(Position{row, 0}, "=A" + prev + "+B" + prev);
+            sheet.SetCell(Position{row, 1}, "=B" + prev + "+A" + prev);
+            ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(1));
+        }
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), FORMULAS);
+
+        // Чтение берёт значения из кэша
+        const CellInterface *top = sheet.GetCell(Position{LAYERS - 1, 0});
+        ASSERT_EQUAL(std::get<double>(top->GetValue()), std::pow(2.0, LAYERS - 1));
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), FORMULAS);
+
+        // Правка середины пересчитывает только ярусы ниже неё, каждую ячейку
+        // ровно один раз
+        sheet.SetCell(Position{LAYERS / 2, 1}, "0");
+        const size_t BELOW = 2 * (LAYERS - 1 - LAYERS / 2);
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), BELOW);
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), FORMULAS + BELOW);
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), FORMULAS + BELOW);
+
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), FORMULAS - 1);
+    }
+
+    void TestMemoizedChain()
+    {
+        const int LENGTH = 100;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < LENGTH; ++row)
+        {
+            sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=A1*2");
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(LENGTH));
+
+        const CellInterface *last = sheet.GetCell(Position{LENGTH - 1, 0});
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(LENGTH));
+
+        // Правка ячейки вне цепочки не затрагивает её
+        sheet.SetCell("C1"_pos, "meow");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(0));
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH));
+
+        // Правка середины цепочки пересчитывает только хвост
+        sheet.SetCell(Position{LENGTH / 2, 0}, "0");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH - 1 - LENGTH / 2));
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH / 2 - 1));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(LENGTH + LENGTH - 1 - LENGTH / 2));
+
+        // Значение, зависящее от текстовой ячейки, тоже пересчитывается
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 10.0);
+        sheet.ClearCell("A1"_pos);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 0.0);
+    }
+
+    void TestReferencedValues()
+    {
+        // Формула читает значения ячеек, найденные при её установке: они
+        // должны оставаться верными при замене содержимого этих ячеек и
+        // при росте таблицы
+        Sheet sheet;
+        sheet.SetCell("C1"_pos, "=A1+B1");
+        auto value = [&sheet]
+        { return sheet.GetCell("C1"_pos)->GetValue(); };
+        ASSERT_EQUAL(std::get<double>(value()), 0.0);
+
+        sheet.SetCell("A1"_pos, "3");
+        sheet.SetCell("B1"_pos, "'4");
+        ASSERT_EQUAL(std::get<double>(value()), 7.0);
+
+        sheet.SetCell("B1"_pos, "4x");
+        ASSERT_EQUAL(std::get<FormulaError>(value()), FormulaError(FormulaError::Category::Value));
+
+        sheet.SetCell("B1"_pos, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(value()), FormulaError(FormulaError::Category::Arithmetic));
+
+        for (int row = 1; row < 2000; ++row)
+        {
+            sheet.SetCell(Position{row, 5}, std::to_string(row));
+        }
+        sheet.SetCell("B1"_pos, "=F2000");
+        ASSERT_EQUAL(std::get<double>(value()), 1999.0 + 3.0);
+
+        sheet.ClearCell("A1"_pos);
+        sheet.ClearCell("B1"_pos);
+        ASSERT_EQUAL(std::get<double>(value()), 0.0);
+    }
+
+    void TestTextArguments()
+    {
+        // Текст, на который ссылается формула, разбирается один раз при
+        // установке; результат должен совпадать с разбором при вычислении
+        // формулы по интерфейсу таблицы
+        const FormulaError value_error(FormulaError::Category::Value);
+        const std::vector<std::pair<std::string, FormulaInterface::Value>> cases = {
+            {"5", 5.0},
+            {"-2.5e1", -25.0},
+            {".5", 0.5},
+            {"  7", 7.0},
+            {"+3", 3.0},
+            {"'12", 12.0},
+            {"'", 0.0},
+            {"+-3", value_error},
+            {"7 ", value_error},
+            {"1e400", value_error},
+            {"12abc", value_error},
+            {"meow", value_error},
+            {" ", value_error},
+        };
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1");
+        auto by_interface = ParseFormula("A1");
+        for (const auto &[text, expected] : cases)
+        {
+            sheet.SetCell("A1"_pos, text);
+            const auto value = sheet.GetCell("B1"_pos)->GetValue();
+            if (std::holds_alternative<double>(expected))
+            {
+                ASSERT_EQUAL(std::get<double>(value), std::get<double>(expected));
+            }
+            else
+            {
+                ASSERT_EQUAL(std::get<FormulaError>(value), std::get<FormulaError>(expected));
+            }
+            ASSERT(by_interface->Evaluate(sheet) == expected);
+        }
+    }
+
+    void TestCellStorage()
+    {
+        Sheet sheet;
+        CellStorage storage;
+        const size_t empty_usage = storage.GetMemoryUsage();
+        // Углы блоков и таблицы, в порядке обхода
+        const std::vector<Position> positions = {
+            {0, 0}, {0, 63}, {63, 0}, {63, 63}, {0, 64}, {64, 0}, {64, 64},
+            {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+        for (Position pos : positions)
+        {
+            ASSERT(storage.Find(pos) == nullptr);
+            storage.Emplace(sheet, pos)->Set(pos.ToString());
+        }
+        ASSERT_EQUAL(storage.GetSize(), positions.size());
+        for (Position pos : positions)
+        {
+            ASSERT_EQUAL(storage.Find(pos)->GetText(), pos.ToString());
+        }
+        ASSERT(storage.Find({1, 1}) == nullptr);
+        ASSERT(storage.Find({64, 63}) == nullptr);
+
+        std::vector<Position> visited;
+        storage.ForEach([&visited](Position pos, const Cell &cell)
+                        {
+                            ASSERT_EQUAL(cell.GetText(), pos.ToString());
+                            visited.push_back(pos); });
+        ASSERT(visited == positions);
+
+        // Блок освобождается вместе с последней ячейкой
+        for (Position pos : positions)
+        {
+            storage.Erase(pos);
+            ASSERT(storage.Find(pos) == nullptr);
+        }
+        ASSERT_EQUAL(storage.GetSize(), size_t(0));
+        ASSERT(storage.GetMemoryUsage() < empty_usage + 4 * CellStorage::TILE_SIZE * CellStorage::TILE_SIZE);
+    }
+
+    void TestSparseCellMemory()
+    {
+        // Формулы ссылаются на пустые ячейки в разных блоках: каждая такая
+        // ячейка занимает участок и свой блок без мест под ячейки
+        Sheet sheet;
+        const int FORMULAS = 200;
+        const size_t empty_usage = sheet.GetCellMemoryUsage();
+        for (int i = 0; i < FORMULAS; ++i)
+        {
+            const Position far{200 + i * 80, 64 + i * 80};
+            sheet.SetCell({i, 0}, "=" + far.ToString() + "+1");
+            ASSERT(sheet.GetCell(far) != nullptr);
+        }
+        const size_t usage = sheet.GetCellMemoryUsage() - empty_usage;
+        ASSERT(usage < size_t(FORMULAS) * 16 * 1024);
+        ASSERT(sheet.GetCell("A1"_pos)->GetValue() == CellInterface::Value(1.0));
+    }
+
+    void TestPrintableSize()
+    {
+        // Размер, который таблица поддерживает при правках, сверяется с
+        // полным перебором ячеек. Формулы создают пустые ячейки, на которые
+        // ссылаются; они в область печати не входят
+        const int SIDE = 12;
+        Sheet sheet;
+        auto scan = [&sheet]
+        {
+            Size size{0, 0};
+            for (int row = 0; row < SIDE; ++row)
+            {
+                for (int col = 0; col < SIDE; ++col)
+                {
+                    const CellInterface *cell = sheet.GetCell({row, col});
+                    if (cell && !cell->GetText().empty())
+                    {
+                        size.rows = std::max(size.rows, row + 1);
+                        size.cols = std::max(size.cols, col + 1);
+                    }
+                }
+            }
+            return size;
+        };
+        std::mt19937 random;
+        auto random_pos = [&random]
+        { return Position{int(random() % SIDE), int(random() % SIDE)}; };
+        for (int step = 0; step < 3000; ++step)
+        {
+            Position pos = random_pos();
+            switch (random() % 5)
+            {
+            case 0:
+                sheet.ClearCell(pos);
+                break;
+            case 1:
+                sheet.SetCell(pos, "");
+                break;
+            case 2:
+                try
+                {
+                    sheet.SetCell(pos, "=" + random_pos().ToString());
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+                break;
+            default:
+                sheet.SetCell(pos, "x");
+            }
+            ASSERT(sheet.GetPrintableSize() == scan());
+        }
+    }
+
+    void TestSteadyStateAllocations()
+    {
+        // Повторные правки уже заполненной таблицы берут содержимое ячеек из
+        // пула и не обращаются к куче. Тексты короткие, чтобы сами строки
+        // не требовали памяти
+        Sheet sheet;
+        const int SIDE = 50;
+        sheet.SetCell({SIDE, 0}, "=A1+B2");
+        sheet.SetCell({SIDE, 1}, "=A" + std::to_string(SIDE + 1) + "*2");
+        auto fill = [&sheet](int round)
+        {
+            for (int row = 0; row < SIDE; ++row)
+            {
+                for (int col = 0; col < SIDE; ++col)
+                {
+                    Position pos{row, col};
+                    if ((row + col + round) % 3 == 0)
+                    {
+                        sheet.ClearCell(pos);
+                    }
+                    else
+                    {
+                        sheet.SetCell(pos, (row + col + round) % 2 ? "meow" : "1.5");
+                    }
+                }
+            }
+        };
+        fill(0);
+        fill(1);
+        fill(2);
+        const size_t before = GetHeapAllocationCount();
+        for (int round = 3; round < 10; ++round)
+        {
+            fill(round);
+        }
+        const size_t allocations = GetHeapAllocationCount() - before;
+        ASSERT_EQUAL(allocations, size_t(0));
+        // В последнем круге A1 очищена, а в B2 текст
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell({SIDE, 1})->GetValue()),
+                     FormulaError(FormulaError::Category::Value));
+    }
+
+    void TestLongChainRecalc()
+    {
+        // Цепочка идёт змейкой по нескольким столбцам. Правка её начала
+        // пересчитывает всю цепочку за один проход без рекурсии
+        const int LENGTH = 5000;
+        const int ROWS = 1000;
+        auto at = [](int i)
+        {
+            return Position{i % ROWS, i / ROWS};
+        };
+        Sheet sheet;
+        for (int i = 1; i < LENGTH; ++i)
+        {
+            sheet.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+        }
+        const CellInterface *last = sheet.GetCell(at(LENGTH - 1));
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH - 1));
+
+        sheet.SetCell(at(0), "1");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH - 1));
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH));
+
+        sheet.ClearCell(at(0));
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH - 1));
+        ASSERT_EQUAL(std::get<double>(last->GetValue()), double(LENGTH - 1));
+    }
+
+    void TestIncrementalCycleDetection()
+    {
+        // Случайные правки небольшой таблицы: исключение о цикле бросается
+        // ровно тогда, когда ссылаемая ячейка транзитивно зависит от
+        // изменяемой, а топологический порядок остаётся верным для всех ссылок
+        const int SIDE = 6;
+        Sheet sheet;
+        auto as_cell = [&sheet](Position pos)
+        {
+            return static_cast<const Cell *>(sheet.GetCell(pos));
+        };
+        // Достижима ли target из from по ссылкам формул
+        auto reaches = [&](Position from, Position target)
+        {
+            std::vector<Position> stack = {from};
+            std::set<Position> visited = {from};
+            while (!stack.empty())
+            {
+                Position pos = stack.back();
+                stack.pop_back();
+                if (pos == target)
+                {
+                    return true;
+                }
+                if (const Cell *cell = as_cell(pos))
+                {
+                    for (Position ref : cell->GetReferencedCells())
+                    {
+                        if (visited.insert(ref).second)
+                        {
+                            stack.push_back(ref);
+                        }
+                    }
+                }
+            }
+            return false;
+        };
+
+        std::mt19937 random;
+        auto random_pos = [&random]
+        { return Position{int(random() % SIDE), int(random() % SIDE)}; };
+        for (int step = 0; step < 5000; ++step)
+        {
+            Position pos = random_pos();
+            if (random() % 4 == 0)
+            {
+                sheet.SetCell(pos, random() % 2 ? "1" : "");
+                continue;
+            }
+            std::string formula = "=" + random_pos().ToString();
+            for (size_t refs = random() % 3; refs > 0; --refs)
+            {
+                formula += "+" + random_pos().ToString();
+            }
+            bool cycle = false;
+            for (Position ref : ParseFormula(formula.substr(1))->GetReferencedCells())
+            {
+                cycle = cycle || reaches(ref, pos);
+            }
+            const std::string old_text = as_cell(pos) ? as_cell(pos)->GetText() : "";
+            try
+            {
+                sheet.SetCell(pos, formula);
+                ASSERT(!cycle);
+            }
+            catch (const CircularDependencyException &)
+            {
+                ASSERT(cycle);
+                ASSERT_EQUAL(as_cell(pos) ? as_cell(pos)->GetText() : "", old_text);
+            }
+
+            for (int row = 0; row < SIDE; ++row)
+            {
+                for (int col = 0; col < SIDE; ++col)
+                {
+                    const Cell *cell = as_cell({row, col});
+                    for (Position ref : cell ? cell->GetReferencedCells() : std::vector<Position>{})
+                    {
+                        ASSERT(as_cell(ref)->GetTopologicalOrder() < cell->GetTopologicalOrder());
+                    }
+                }
+            }
+        }
+
+        // Цикл через длинную цепочку находится без рекурсии
+        const int LENGTH = 100'000;
+        const int ROWS = 10'000;
+        auto at = [](int i)
+        {
+            return Position{i % ROWS, SIDE + i / ROWS};
+        };
+        for (int i = 1; i < LENGTH; ++i)
+        {
+            sheet.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+        }
+        try
+        {
+            sheet.SetCell(at(0), "=" + at(LENGTH - 1).ToString());
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException &)
+        {
+        }
+        sheet.SetCell(at(0), "=" + Position{0, 0}.ToString() + "*0");
+        ASSERT(as_cell(at(0))->GetTopologicalOrder() < as_cell(at(1))->GetTopologicalOrder());
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(at(LENGTH - 1))->GetValue()), double(LENGTH - 1));
+    }
+
+    void TestDependencyGraph()
+    {
+        // Случайные замены ссылок сверяются с простой моделью: ссылки узла
+        // сохраняют заданный порядок, зависимые совпадают с обратными
+        // ссылками, а мёртвые отрезки не копятся
+        using CellId = DependencyGraph::CellId;
+        const CellId NODES = 200;
+        DependencyGraph graph;
+        std::vector<std::vector<CellId>> model(NODES);
+        for (CellId id = 0; id < NODES; ++id)
+        {
+            ASSERT_EQUAL(graph.AddNode(nullptr), id);
+        }
+        auto check = [&]
+        {
+            std::vector<std::vector<CellId>> deps(NODES);
+            size_t edges = 0;
+            for (CellId id = 0; id < NODES; ++id)
+            {
+                auto refs = graph.GetRefs(id);
+                ASSERT(std::vector<CellId>(refs.begin(), refs.end()) == model[id]);
+                for (CellId ref : model[id])
+                {
+                    deps[ref].push_back(id);
+                }
+                edges += model[id].size();
+            }
+            for (CellId id = 0; id < NODES; ++id)
+            {
+                auto range = graph.GetDeps(id);
+                std::vector<CellId> actual(range.begin(), range.end());
+                std::sort(actual.begin(), actual.end());
+                ASSERT(actual == deps[id]);
+            }
+            ASSERT_EQUAL(graph.GetEdgeCount(), edges);
+        };
+
+        std::mt19937 random;
+        size_t peak_usage = 0;
+        for (int step = 0; step < 200'000; ++step)
+        {
+            const CellId id = random() % NODES;
+            std::vector<CellId> refs;
+            for (size_t count = random() % 6; count > 0; --count)
+            {
+                // Узлы с малыми номерами популярны: у них длинные списки зависимых
+                CellId ref = random() % 2 ? random() % 8 : random() % NODES;
+                if (std::find(refs.begin(), refs.end(), ref) == refs.end())
+                {
+                    refs.push_back(ref);
+                }
+            }
+            graph.SetRefs(id, refs);
+            model[id] = refs;
+            if (step % 20'000 == 0)
+            {
+                check();
+            }
+            if (step == 20'000)
+            {
+                peak_usage = graph.GetMemoryUsage();
+            }
+        }
+        check();
+        ASSERT(graph.GetMemoryUsage() <= 2 * peak_usage);
+
+        // Удалённый узел без рёбер отдаёт свой номер новому
+        graph.SetRefs(NODES - 1, {});
+        for (CellId id = 0; id < NODES; ++id)
+        {
+            model[id].erase(std::remove(model[id].begin(), model[id].end(), NODES - 1), model[id].end());
+            graph.SetRefs(id, model[id]);
+        }
+        graph.RemoveNode(NODES - 1);
+        ASSERT_EQUAL(graph.AddNode(nullptr), NODES - 1);
+        check();
+    }
+
+    // Бросает ли action исключение типа Exception
+    template <typename Exception, typename Action>
+    bool Throws(Action action)
+    {
+        try
+        {
+            action();
+        }
+        catch (const Exception &)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    void TestBatchCommit()
+    {
+        // Правки пакета не видны до Commit, последняя правка ячейки
+        // побеждает, а каждая формула вычисляется один раз, даже если цепочка
+        // задана с конца
+        const int LENGTH = 100;
+        const std::string last = "B" + std::to_string(LENGTH);
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.BeginBatch();
+        ASSERT(sheet.IsInBatch());
+        for (int i = LENGTH; i > 1; --i)
+        {
+            sheet.SetCell(Position::FromString("B" + std::to_string(i)), "=B" + std::to_string(i - 1) + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("A1"_pos, "=B1");
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT((sheet.GetPrintableSize() == Size{1, 1}));
+
+        const size_t evaluations = sheet.GetEvaluationCount();
+        sheet.Commit();
+        ASSERT(!sheet.IsInBatch());
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, size_t(LENGTH));
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position::FromString(last))->GetValue()), double(3 + LENGTH));
+        ASSERT((sheet.GetPrintableSize() == Size{LENGTH, 2}));
+
+        // Порядок ячеек после пакета верен для последующих правок
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("B1"_pos, "=" + last); }));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=" + last); }));
+
+        // Ошибка в любой правке пакета оставляет таблицу нетронутой
+        auto unchanged = [&]
+        {
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+            ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetText(), "=B49+1");
+            ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+            ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+            ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+            ASSERT((sheet.GetPrintableSize() == Size{LENGTH, 2}));
+            sheet.SetCell("A1"_pos, "4");
+            ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH));
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position::FromString(last))->GetValue()), double(4 + LENGTH));
+            sheet.SetCell("A1"_pos, "3");
+        };
+        sheet.BeginBatch();
+        sheet.SetCell("C1"_pos, "=" + last + "*2");
+        sheet.SetCell("A1"_pos, "5");
+        sheet.ClearCell("B50"_pos);
+        sheet.SetCell("C2"_pos, "=1+");
+        ASSERT(Throws<FormulaException>([&]
+                                        { sheet.Commit(); }));
+        ASSERT(!sheet.IsInBatch());
+        unchanged();
+
+        sheet.BeginBatch();
+        sheet.SetCell("D1"_pos, "=E1");
+        sheet.SetCell("B50"_pos, "=B49*2");
+        sheet.SetCell("A1"_pos, "=" + last);
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.Commit(); }));
+        unchanged();
+
+        sheet.BeginBatch();
+        sheet.SetCell("D1"_pos, "=E1");
+        sheet.SetCell("E1"_pos, "=D1");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.Commit(); }));
+        unchanged();
+
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "100");
+        sheet.Rollback();
+        ASSERT(!sheet.IsInBatch());
+        unchanged();
+
+        // Очистка в пакете удаляет ячейку, на которую никто не ссылается
+        sheet.BeginBatch();
+        sheet.ClearCell(Position::FromString(last));
+        sheet.ClearCell("B10"_pos);
+        sheet.Commit();
+        ASSERT(sheet.GetCell(Position::FromString(last)) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B10"_pos)->GetText(), "");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B11"_pos)->GetValue()), 1.0);
+        ASSERT((sheet.GetPrintableSize() == Size{LENGTH - 1, 2}));
+    }
+
+    void TestImportTexts()
+    {
+        // Загрузка вывода PrintTexts восстанавливает тексты и значения при
+        // любом числе потоков, в том числе когда формулы ссылаются на ячейки
+        // из следующих строк и порций
+        Sheet source;
+        const int ROWS = 300;
+        const int COLS = 70;
+        std::mt19937 random;
+        for (int row = 0; row < ROWS; ++row)
+        {
+            for (int col = 0; col < COLS; col += 1 + random() % 3)
+            {
+                Position pos{row, col};
+                // Формулы ссылаются только на следующие строки
+                switch (row + 1 < ROWS ? random() % 5 : 0)
+                {
+                case 0:
+                    source.SetCell(pos, std::to_string(row * col));
+                    break;
+                case 1:
+                    source.SetCell(pos, "'=text");
+                    break;
+                case 2:
+                    source.SetCell(pos, "=");
+                    break;
+                default:
+                    Position ref{std::min(ROWS - 1, row + 1 + int(random() % 200)), int(random() % COLS)};
+                    source.SetCell(pos, "=(" + ref.ToString() + "+1)/2");
+                }
+            }
+        }
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+        std::ostringstream values;
+        source.PrintValues(values);
+
+        for (size_t threads : {1, 4})
+        {
+            Sheet sheet;
+            std::istringstream input(texts.str());
+            sheet.ImportTexts(input, threads);
+            std::ostringstream imported_texts;
+            sheet.PrintTexts(imported_texts);
+            ASSERT_EQUAL(imported_texts.str(), texts.str());
+            std::ostringstream imported_values;
+            sheet.PrintValues(imported_values);
+            ASSERT_EQUAL(imported_values.str(), values.str());
+        }
+
+        // Загрузка поверх таблицы меняет только непустые поля, а ошибка в
+        // любом месте файла оставляет таблицу прежней
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C3"_pos, "=B1*10");
+        auto import = [&sheet](const std::string &text)
+        {
+            std::istringstream input(text);
+            sheet.ImportTexts(input, 2);
+        };
+        auto unchanged = [&sheet]
+        {
+            std::ostringstream texts;
+            sheet.PrintTexts(texts);
+            ASSERT_EQUAL(texts.str(), "1\t=A1+1\t\n\t\t\n\t\t=B1*10\n");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), 20.0);
+            ASSERT(sheet.GetCell("D4"_pos) == nullptr);
+        };
+        ASSERT(Throws<FormulaException>([&]
+                                        { import("5\t\t=D4\n=1+\n"); }));
+        unchanged();
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { import("=C3\t\t=D4\n"); }));
+        unchanged();
+        ASSERT(Throws<InvalidPositionException>([&]
+                                                { import("2\n" + std::string(Position::MAX_COLS, '\t') + "x"); }));
+        unchanged();
+
+        import("5\t\t=D4\n\t\t\n\t\t\n\t\t\t=A1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), 60.0);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=D4");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("D4"_pos)->GetValue()), 5.0);
+        ASSERT((sheet.GetPrintableSize() == Size{4, 4}));
+    }
+
+    void TestFormulaBytecode()
+    {
+        // Две ячейки с разными ошибками: по ним видно, какая ошибка
+        // возвращается первой
+        auto args = [](Position pos) -> CellArg
+        {
+            if (pos == "C3"_pos)
+            {
+                return FormulaError(FormulaError::Category::Value);
+            }
+            if (pos == "D4"_pos)
+            {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            return pos.row * 10 + pos.col + 0.5;
+        };
+        auto print = [](const CellArg &result) -> std::string
+        {
+            if (std::holds_alternative<FormulaError>(result))
+            {
+                return std::string(std::get<FormulaError>(result).ToString());
+            }
+            std::ostringstream out;
+            out << std::get<double>(result);
+            return out.str();
+        };
+        using Method = CellArg (FormulaAST::*)(const SheetArgs &) const;
+        auto execute = [&args, &print](const FormulaAST &ast, Method method)
+        {
+            return print((ast.*method)(args));
+        };
+        // Те же значения ячеек, найденные заранее, как их видит ячейка таблицы
+        auto execute_bound = [&args, &print](const FormulaAST &ast)
+        {
+            std::vector<CellArg> values;
+            for (Position pos : ast.GetUniqueCells())
+            {
+                values.push_back(args(pos));
+            }
+            std::vector<const CellArg *> bound;
+            for (const auto &value : values)
+            {
+                bound.push_back(&value);
+            }
+            return print(ast.Execute(bound.data(), SheetArgsRanges(args)));
+        };
+
+        std::vector<std::string> formulas = {"1", "-A1", "+-+B2", "1+2*3", "(1+2)*3", "A1-B2-C1", "A1-(B2-C1)",
+                                             "A1/B2/C1", "A1/(B2/C1)", "-(A1+B1)*-(A2-B2)", "1/0", "1/(A1-A1)",
+                                             "A1/0", "2/(3*0)", "C3+1/0", "1/0+C3", "C3+D4", "D4*C3", "-D4/0",
+                                             "D4/C3/0", "A1*A1+B1*B1+A1*B1", "1e3*.5-2.5E-1"};
+        // Глубокая вложенность слева и справа: во втором случае программе
+        // нужен стек больше встроенного
+        std::string left = "A1";
+        std::string right = "A1";
+        for (int i = 2; i < 50; ++i)
+        {
+            left = "(" + left + "-A" + std::to_string(i) + ")";
+            right = "A" + std::to_string(i) + "-(" + right + ")";
+        }
+        formulas.push_back(left);
+        formulas.push_back(right);
+
+        for (const auto &formula : formulas)
+        {
+            auto ast = ParseFormulaAST(formula);
+            const std::string expected = execute(ast, &FormulaAST::ExecuteTree);
+            ASSERT_EQUAL(execute(ast, &FormulaAST::Execute), expected);
+            ASSERT_EQUAL(execute_bound(ast), expected);
+        }
+
+        // Возвращается первая ошибка в порядке вычисления слева направо
+        ASSERT_EQUAL(execute(ParseFormulaAST("C3+D4"), &FormulaAST::Execute), "#VALUE!"s);
+        ASSERT_EQUAL(execute(ParseFormulaAST("D4*C3"), &FormulaAST::Execute), "#REF!"s);
+        ASSERT_EQUAL(execute(ParseFormulaAST("1/0+C3"), &FormulaAST::Execute), "#ARITHM!"s);
+        ASSERT_EQUAL(execute(ParseFormulaAST("C3/0"), &FormulaAST::Execute), "#VALUE!"s);
+    }
+
+    void TestParallelRecalc()
+    {
+        // Несколько широких уровней зависимостей, в том числе с ошибками
+        const int WIDTH = 3000;
+        auto fill = [](Sheet &sheet)
+        {
+            sheet.SetCell("A1"_pos, "1");
+            for (int col = 0; col < WIDTH; ++col)
+            {
+                Position first{1 + col % 1000, 1 + col / 1000};
+                Position second{first.row, first.col + 3};
+                sheet.SetCell(first, "=A1*" + std::to_string(col) + "+1");
+                sheet.SetCell(second, "=" + first.ToString() + "/(A1-" + std::to_string(col % 7) + ")");
+            }
+        };
+        Sheet serial;
+        Sheet parallel;
+        parallel.SetRecalcThreads(4);
+        ASSERT_EQUAL(parallel.GetRecalcThreads(), size_t(4));
+        fill(serial);
+        fill(parallel);
+
+        for (std::string value : {"2", "3", "=1/0", "text", ""})
+        {
+            serial.SetCell("A1"_pos, value);
+            parallel.SetCell("A1"_pos, value);
+            ASSERT_EQUAL(parallel.GetLastRecalcCount(), serial.GetLastRecalcCount());
+            ASSERT(parallel.GetLastRecalcCount() >= size_t(2 * WIDTH));
+
+            std::ostringstream serial_values;
+            std::ostringstream parallel_values;
+            serial.PrintValues(serial_values);
+            parallel.PrintValues(parallel_values);
+            ASSERT(serial_values.str() == parallel_values.str());
+        }
+        ASSERT_EQUAL(parallel.GetEvaluationCount(), serial.GetEvaluationCount());
+
+        parallel.SetRecalcThreads(1);
+        ASSERT_EQUAL(parallel.GetRecalcThreads(), size_t(1));
+    }
+
+    void TestSnapshot()
+    {
+        // Таблица с текстом, экранированием, ошибками, пустыми ячейками под
+        // ссылками, цепочкой, заданной с конца, и формулой с глубоким стеком
+        auto fill = [](Sheet &sheet)
+        {
+            sheet.SetCell("A1"_pos, "2");
+            sheet.SetCell("B1"_pos, "'=escaped");
+            sheet.SetCell("C1"_pos, "=");
+            sheet.SetCell("D1"_pos, "text");
+            sheet.SetCell("A2"_pos, "=A1*(B2+3)/2");
+            sheet.SetCell("B3"_pos, "=A2/C3");
+            sheet.SetCell("C4"_pos, "=D1+A2");
+            sheet.SetCell("D5"_pos, "=-(A2-A1)*A2+B3");
+            for (int row = 40; row > 0; --row)
+            {
+                sheet.SetCell({row, 5}, "=" + Position{row + 1, 5}.ToString() + "+1");
+            }
+            sheet.SetCell("F42"_pos, "=A1");
+            std::string deep = "A1";
+            for (int i = 0; i < 40; ++i)
+            {
+                deep = "1+(" + deep + ")";
+            }
+            sheet.SetCell("G1"_pos, "=" + deep);
+        };
+        auto texts = [](const Sheet &sheet)
+        {
+            std::ostringstream output;
+            sheet.PrintTexts(output);
+            return output.str();
+        };
+        auto values = [](const Sheet &sheet)
+        {
+            std::ostringstream output;
+            sheet.PrintValues(output);
+            return output.str();
+        };
+        auto save = [](const Sheet &sheet)
+        {
+            std::ostringstream output;
+            sheet.SaveSnapshot(output);
+            return output.str();
+        };
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test_snapshot.bin").string();
+        auto write = [&path](const std::string &bytes)
+        {
+            std::ofstream output(path, std::ios::binary | std::ios::trunc);
+            output << bytes;
+        };
+
+        Sheet source;
+        fill(source);
+        const std::string snapshot = save(source);
+        const std::string source_values = values(source);
+        write(snapshot);
+
+        // Тексты и значения восстанавливаются без единого вычисления
+        Sheet loaded;
+        loaded.LoadSnapshot(path);
+        ASSERT_EQUAL(texts(loaded), texts(source));
+        ASSERT_EQUAL(values(loaded), source_values);
+        ASSERT_EQUAL(loaded.GetEvaluationCount(), size_t(0));
+        ASSERT_EQUAL(loaded.GetPrintableSize(), source.GetPrintableSize());
+        ASSERT_EQUAL(save(loaded), snapshot);
+
+        // Загруженные формулы пересчитываются по правкам так же, как исходные
+        for (auto [pos, text] : {std::pair{"A1"_pos, "5"}, {"C3"_pos, "4"}, {"D1"_pos, "7"}, {"F42"_pos, "=D1"},
+                                 {"B2"_pos, "=A1"}})
+        {
+            source.SetCell(pos, text);
+            loaded.SetCell(pos, text);
+            ASSERT_EQUAL(loaded.GetLastRecalcCount(), source.GetLastRecalcCount());
+            ASSERT_EQUAL(values(loaded), values(source));
+        }
+        ASSERT_EQUAL(texts(loaded), texts(source));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { loaded.SetCell("A1"_pos, "=G1"); }));
+        ASSERT(Throws<std::logic_error>([&]
+                                        { loaded.LoadSnapshot(path); }));
+
+        // Испорченный снимок отвергается, не читая за пределами файла, и
+        // таблица остаётся пустой: в неё можно загрузить исправный снимок
+        auto load = [&](const std::string &bytes)
+        {
+            write(bytes);
+            Sheet sheet;
+            try
+            {
+                sheet.LoadSnapshot(path);
+                return true;
+            }
+            catch (const SnapshotException &)
+            {
+                ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+                write(snapshot);
+                sheet.LoadSnapshot(path);
+                ASSERT_EQUAL(values(sheet), source_values);
+                return false;
+            }
+        };
+        for (size_t size : {size_t(0), size_t(8), sizeof(SnapshotHeader), sizeof(SnapshotHeader) + 30,
+                            snapshot.size() / 2, snapshot.size() - 1})
+        {
+            ASSERT(!load(snapshot.substr(0, size)));
+        }
+        ASSERT(!load(snapshot + "garbage!"));
+        for (size_t offset : {size_t(0), offsetof(SnapshotHeader, version), offsetof(SnapshotHeader, byte_order),
+                              offsetof(SnapshotHeader, instruction_size)})
+        {
+            std::string corrupt = snapshot;
+            ++corrupt[offset];
+            ASSERT(!load(corrupt));
+        }
+        std::mt19937 random;
+        for (int i = 0; i < 500; ++i)
+        {
+            std::string corrupt = snapshot;
+            corrupt[random() % corrupt.size()] ^= char(1 << random() % 8);
+            load(corrupt);
+        }
+        ASSERT(Throws<SnapshotException>([&]
+                                         {
+                                             Sheet sheet;
+                                             sheet.LoadSnapshot(path + ".missing");
+                                         }));
+        std::filesystem::remove(path);
+    }
+
+    void TestEditLog()
+    {
+        const auto directory = std::filesystem::temp_directory_path();
+        const std::string log_path = (directory / "spreadsheet_test_edits.log").string();
+        const std::string snapshot_path = (directory / "spreadsheet_test_edits.snapshot").string();
+        std::filesystem::remove(log_path);
+        std::filesystem::remove(snapshot_path);
+        auto dump = [](const Sheet &sheet)
+        {
+            std::ostringstream output;
+            sheet.PrintTexts(output);
+            sheet.PrintValues(output);
+            return output.str();
+        };
+        auto recovered = [&]
+        {
+            Sheet sheet;
+            sheet.Recover(snapshot_path, log_path);
+            return dump(sheet);
+        };
+
+        // Группа пишется, когда набирается group_size правок; неудавшиеся
+        // правки в журнал не попадают
+        Sheet sheet;
+        EditLogOptions options;
+        options.group_size = 4;
+        options.group_delay = std::chrono::hours(1);
+        sheet.OpenLog(log_path, options);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        ASSERT(Throws<FormulaException>([&]
+                                        { sheet.SetCell("C1"_pos, "=1+"); }));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=B1"); }));
+        sheet.SetCell("C1"_pos, "text");
+        ASSERT_EQUAL(sheet.GetLog()->GetGroupCount(), size_t(0));
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(sheet.GetLog()->GetGroupCount(), size_t(1));
+        ASSERT_EQUAL(sheet.GetLog()->GetSyncCount(), size_t(1));
+
+        sheet.BeginBatch();
+        sheet.SetCell("A2"_pos, "=B1*A3");
+        sheet.SetCell("A3"_pos, "'=escaped\ttab");
+        sheet.SetCell("A3"_pos, "4");
+        sheet.Commit();
+        sheet.BeginBatch();
+        sheet.SetCell("A3"_pos, "=A2");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.Commit(); }));
+        std::istringstream import("\t\t=A1*2\n\t=\n");
+        sheet.ImportTexts(import, 1);
+        sheet.FlushLog();
+        ASSERT_EQUAL(recovered(), dump(sheet));
+
+        // Восстановление применяет журнал одним пакетом: каждая формула
+        // вычисляется один раз
+        {
+            Sheet replayed;
+            replayed.Recover(snapshot_path, log_path);
+            ASSERT_EQUAL(replayed.GetEvaluationCount(), size_t(3));
+        }
+
+        // Контрольная точка очищает журнал; правки после неё ложатся на снимок
+        const std::string before_checkpoint = [&]
+        {
+            std::ifstream input(log_path, std::ios::binary);
+            return std::string(std::istreambuf_iterator<char>(input), {});
+        }();
+        sheet.Checkpoint(snapshot_path);
+        ASSERT(std::filesystem::file_size(log_path) < 32);
+        ASSERT_EQUAL(recovered(), dump(sheet));
+        sheet.SetCell("A1"_pos, "10");
+        sheet.ClearCell("A3"_pos);
+        sheet.FlushLog();
+        ASSERT_EQUAL(recovered(), dump(sheet));
+
+        // Сбой между снимком и очисткой журнала: старые правки поверх нового
+        // снимка дают то же состояние
+        sheet.CloseLog();
+        const std::string expected = dump(sheet);
+        {
+            std::ofstream output(log_path, std::ios::binary | std::ios::trunc);
+            output << before_checkpoint;
+        }
+        sheet.OpenLog(log_path, options);
+        sheet.SetCell("A1"_pos, "10");
+        sheet.ClearCell("A3"_pos);
+        sheet.CloseLog();
+        ASSERT_EQUAL(recovered(), expected);
+
+        // Недописанный кадр в конце отбрасывается, а открытие журнала его
+        // отрезает, чтобы новые правки легли за целыми кадрами
+        const auto intact_size = std::filesystem::file_size(log_path);
+        {
+            std::ofstream output(log_path, std::ios::binary | std::ios::app);
+            output << std::string("\x20\0\0\0torn", 8);
+        }
+        ASSERT_EQUAL(recovered(), expected);
+        sheet.OpenLog(log_path, options);
+        ASSERT_EQUAL(std::filesystem::file_size(log_path), intact_size);
+        sheet.SetCell("D4"_pos, "=A1/2");
+        sheet.CloseLog();
+        ASSERT_EQUAL(recovered(), dump(sheet));
+
+        // Без fsync группы всё равно пишутся; Always пишет каждую транзакцию
+        std::filesystem::remove(snapshot_path);
+        for (auto sync : {EditLogOptions::Sync::None, EditLogOptions::Sync::Always})
+        {
+            std::filesystem::remove(log_path);
+            Sheet synced;
+            options.sync = sync;
+            synced.OpenLog(log_path, options);
+            for (int i = 0; i < 8; ++i)
+            {
+                synced.SetCell({i, 0}, std::to_string(i));
+            }
+            const bool always = sync == EditLogOptions::Sync::Always;
+            ASSERT_EQUAL(synced.GetLog()->GetGroupCount(), size_t(always ? 8 : 2));
+            ASSERT_EQUAL(synced.GetLog()->GetSyncCount(), size_t(always ? 8 : 0));
+            ASSERT(Throws<std::logic_error>([&]
+                                            { synced.OpenLog(log_path, options); }));
+            synced.CloseLog();
+            ASSERT_EQUAL(recovered(), dump(synced));
+        }
+
+        // Последнюю группу пишет фоновый поток журнала, когда ей исполняется
+        // group_delay, даже если правок больше нет
+        {
+            std::filesystem::remove(log_path);
+            Sheet delayed;
+            EditLogOptions delay_options;
+            delay_options.group_delay = std::chrono::milliseconds(20);
+            delayed.OpenLog(log_path, delay_options);
+            delayed.SetCell("A1"_pos, "1");
+            delayed.SetCell("B1"_pos, "=A1*2");
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (delayed.GetLog()->GetSyncCount() == 0 && std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            ASSERT_EQUAL(delayed.GetLog()->GetGroupCount(), size_t(1));
+            ASSERT_EQUAL(delayed.GetLog()->GetSyncCount(), size_t(1));
+            ASSERT_EQUAL(recovered(), dump(delayed));
+        }
+
+#if defined(__linux__)
+        // Правка, которую не удалось записать в журнал, откатывается, а файл
+        // остаётся из целых кадров. Запись упирается в предел размера файла
+        {
+            std::filesystem::remove(log_path);
+            Sheet failing;
+            EditLogOptions always;
+            always.sync = EditLogOptions::Sync::Always;
+            failing.OpenLog(log_path, always);
+            failing.SetCell("A1"_pos, "1");
+            failing.SetCell("B1"_pos, "=A1*2");
+            const std::string before = dump(failing);
+            const auto intact = std::filesystem::file_size(log_path);
+
+            std::signal(SIGXFSZ, SIG_IGN);
+            rlimit old_limit{};
+            getrlimit(RLIMIT_FSIZE, &old_limit);
+            rlimit limit = old_limit;
+            limit.rlim_cur = static_cast<rlim_t>(intact);
+            setrlimit(RLIMIT_FSIZE, &limit);
+            const bool set_failed = Throws<EditLogException>([&]
+                                                             { failing.SetCell("A1"_pos, "5"); });
+            const bool created_failed = Throws<EditLogException>([&]
+                                                                 { failing.SetCell("C3"_pos, "=B1+1"); });
+            const bool cleared_failed = Throws<EditLogException>([&]
+                                                                 { failing.ClearCell("B1"_pos); });
+            failing.BeginBatch();
+            failing.SetCell("A1"_pos, "7");
+            failing.SetCell("A2"_pos, "=A1");
+            const bool batch_failed = Throws<EditLogException>([&]
+                                                               { failing.Commit(); });
+            std::istringstream failing_import("=B1*3\t8\n");
+            const bool import_failed = Throws<EditLogException>([&]
+                                                                { failing.ImportTexts(failing_import, 1); });
+            setrlimit(RLIMIT_FSIZE, &old_limit);
+            std::signal(SIGXFSZ, SIG_DFL);
+
+            ASSERT(set_failed && created_failed && cleared_failed && batch_failed && import_failed);
+            ASSERT_EQUAL(dump(failing), before);
+            ASSERT(failing.GetCell("C3"_pos) == nullptr);
+            ASSERT(failing.GetCell("A2"_pos) == nullptr);
+            ASSERT(failing.GetCell("B1"_pos)->GetValue() == CellInterface::Value(2.0));
+            ASSERT_EQUAL(std::filesystem::file_size(log_path), intact);
+            failing.SetCell("A1"_pos, "3");
+            failing.CloseLog();
+            ASSERT_EQUAL(recovered(), dump(failing));
+        }
+#endif
+
+        {
+            std::ofstream output(log_path, std::ios::binary | std::ios::trunc);
+            output << "not a log, just text";
+        }
+        ASSERT(Throws<EditLogException>([&]
+                                        { recovered(); }));
+        std::filesystem::remove(log_path);
+        std::filesystem::remove(snapshot_path);
+    }
+
+    void TestPrintOutput()
+    {
+        // Печать совпадает с построчным выводом значений через поток: числа
+        // в формате operator<<, ошибки своими названиями, текст без
+        // экранирования. Пустые ячейки под ссылками вне области не печатаются
+        Sheet sheet;
+        std::mt19937 random;
+        for (int i = 0; i < 2000; ++i)
+        {
+            Position pos{int(random() % 60), int(random() % 20)};
+            const double number = std::ldexp(double(random() % 2000000) - 1000000, int(random() % 80) - 40);
+            switch (random() % 6)
+            {
+            case 0:
+                sheet.SetCell(pos, "=" + std::to_string(number) + "/" + std::to_string(1 + random() % 7));
+                break;
+            case 1:
+                sheet.SetCell(pos, "'=escaped");
+                break;
+            case 2:
+                sheet.SetCell(pos, std::to_string(number));
+                break;
+            case 3:
+                sheet.ClearCell(pos);
+                break;
+            default:
+                try
+                {
+                    const Position ref{int(random() % 80), int(random() % 30)};
+                    sheet.SetCell(pos, "=" + ref.ToString() + "*" + std::to_string(number) + "/" +
+                                           std::to_string(random() % 3));
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+        }
+        sheet.SetCell("A1"_pos, "=1/0");
+        sheet.SetCell("B1"_pos, "=C1");
+        sheet.SetCell("C1"_pos, "meow");
+
+        const Size size = sheet.GetPrintableSize();
+        std::ostringstream expected_values;
+        std::ostringstream expected_texts;
+        for (int row = 0; row < size.rows; ++row)
+        {
+            for (int col = 0; col < size.cols; ++col)
+            {
+                if (const CellInterface *cell = sheet.GetCell({row, col}))
+                {
+                    expected_values << cell->GetValue();
+                    expected_texts << cell->GetText();
+                }
+                if (col + 1 < size.cols)
+                {
+                    expected_values << '\t';
+                    expected_texts << '\t';
+                }
+            }
+            expected_values << '\n';
+            expected_texts << '\n';
+        }
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), expected_values.str());
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), expected_texts.str());
+        ASSERT(values.str().find("#ARITHM!\t#VALUE!\tmeow") == 0);
+
+        // Повторная печать не обращается к куче
+        std::ostream null_output(nullptr);
+        sheet.PrintValues(null_output);
+        sheet.PrintTexts(null_output);
+        const size_t before = GetHeapAllocationCount();
+        sheet.PrintValues(null_output);
+        sheet.PrintTexts(null_output);
+        const size_t allocations = GetHeapAllocationCount() - before;
+        ASSERT_EQUAL(allocations, size_t(0));
+    }
+
+    void TestParallelExport()
+    {
+        // Полосы строк, отформатированные параллельно, дают тот же вывод,
+        // что и последовательная печать, в том числе с пустыми полосами,
+        // неполной последней полосой и ячейками под ссылками вне области
+        Sheet sheet;
+        std::mt19937 random;
+        for (int i = 0; i < 20000; ++i)
+        {
+            Position pos{int(random() % 1500), int(random() % 40)};
+            if (pos.row >= 600 && pos.row < 1100)
+            {
+                continue;
+            }
+            switch (random() % 4)
+            {
+            case 0:
+                sheet.SetCell(pos, std::to_string(random() % 1000) + "." + std::to_string(random() % 100));
+                break;
+            case 1:
+                sheet.SetCell(pos, "'=text " + std::to_string(i));
+                break;
+            default:
+                try
+                {
+                    const Position ref{int(random() % 1600), int(random() % 50)};
+                    sheet.SetCell(pos, "=" + ref.ToString() + "/" + std::to_string(random() % 4));
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+        }
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        for (size_t threads : {1, 2, 3, 8})
+        {
+            std::ostringstream exported_values;
+            sheet.ExportValues(exported_values, threads);
+            ASSERT(exported_values.str() == values.str());
+            std::ostringstream exported_texts;
+            sheet.ExportTexts(exported_texts, threads);
+            ASSERT(exported_texts.str() == texts.str());
+        }
+
+        // Экспорт из нескольких потоков одновременно по неизменной таблице
+        std::vector<std::thread> readers;
+        std::vector<std::string> outputs(4);
+        for (size_t i = 0; i < outputs.size(); ++i)
+        {
+            readers.emplace_back([&sheet, &outputs, i]
+                                 {
+                                     std::ostringstream output;
+                                     sheet.ExportValues(output, 2);
+                                     outputs[i] = output.str();
+                                 });
+        }
+        for (auto &reader : readers)
+        {
+            reader.join();
+        }
+        for (const std::string &output : outputs)
+        {
+            ASSERT(output == values.str());
+        }
+
+        Sheet empty;
+        std::ostringstream nothing;
+        empty.ExportTexts(nothing, 4);
+        ASSERT_EQUAL(nothing.str(), ""s);
+    }
+
+    void TestConcurrentReads()
+    {
+        Sheet sheet;
+        ASSERT(Throws<std::logic_error>([&]
+                                        { sheet.ReadValue("A1"_pos); }));
+        sheet.SetCell("A1"_pos, "=2+3");
+        sheet.SetCell("B1"_pos, "=A1/0");
+        sheet.SetCell("C1"_pos, "'=text");
+        sheet.SetCell("D1"_pos, "=E1");
+        sheet.EnableConcurrentReads();
+        ASSERT(sheet.IsConcurrentReadEnabled());
+        ASSERT(sheet.ReadValue("A1"_pos) == CellInterface::Value(5.0));
+        ASSERT(sheet.ReadValue("B1"_pos) == CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT(sheet.ReadValue("C1"_pos) == CellInterface::Value("=text"s));
+        ASSERT(sheet.ReadValue("D1"_pos) == CellInterface::Value(0.0));
+        ASSERT(sheet.ReadValue("E1"_pos) == CellInterface::Value(""s));
+        ASSERT(sheet.ReadValue("Z99"_pos) == CellInterface::Value(""s));
+        ASSERT_EQUAL(sheet.GetValueVersion("Z99"_pos), 0u);
+        ASSERT(Throws<InvalidPositionException>([&]
+                                                { sheet.ReadValue(Position::NONE); }));
+
+        // Правка публикует значения изменённой ячейки и зависящих от неё;
+        // правка, завершившаяся исключением, - ничего
+        const std::uint64_t version = sheet.GetValueVersion("D1"_pos);
+        sheet.SetCell("E1"_pos, "7");
+        ASSERT(sheet.ReadValue("E1"_pos) == CellInterface::Value("7"s));
+        ASSERT(sheet.ReadValue("D1"_pos) == CellInterface::Value(7.0));
+        ASSERT(sheet.GetValueVersion("D1"_pos) > version);
+        const std::uint64_t a1_version = sheet.GetValueVersion("A1"_pos);
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("E1"_pos, "=D1"); }));
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "=1");
+        ASSERT(sheet.ReadValue("A1"_pos) == CellInterface::Value(5.0));
+        sheet.SetCell("A2"_pos, "=A1+");
+        ASSERT(Throws<FormulaException>([&]
+                                        { sheet.Commit(); }));
+        ASSERT_EQUAL(sheet.GetValueVersion("A1"_pos), a1_version);
+        ASSERT(sheet.ReadValue("D1"_pos) == CellInterface::Value(7.0));
+        sheet.ClearCell("E1"_pos);
+        ASSERT(sheet.ReadValue("E1"_pos) == CellInterface::Value(""s));
+        ASSERT(sheet.ReadValue("D1"_pos) == CellInterface::Value(0.0));
+        sheet.ClearCell("C1"_pos);
+        ASSERT(sheet.ReadValue("C1"_pos) == CellInterface::Value(""s));
+
+        // Два писателя и несколько читателей одновременно. Читатель видит
+        // каждую ячейку только в одном из её возможных состояний, а значения
+        // и версии ячейки не убывают. Зависимых у A1 больше порога
+        // параллельного пересчёта, так что они пересчитываются на пуле
+        const int EDITS = 200;
+        const int DEPENDENTS = 1100;
+        sheet.SetRecalcThreads(2);
+        sheet.SetCell("A1"_pos, "=0");
+        for (int i = 0; i < DEPENDENTS; ++i)
+        {
+            sheet.SetCell({1 + i, 0}, "=A1*2+" + std::to_string(i));
+        }
+        sheet.SetCell("C1"_pos, "abc");
+        std::atomic<bool> done = false;
+        std::atomic<bool> consistent = true;
+        auto writer = [&sheet](Position pos, auto text)
+        {
+            for (int i = 1; i <= EDITS; ++i)
+            {
+                sheet.SetCell(pos, text(i));
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.emplace_back(writer, "A1"_pos, [](int i)
+                             { return "=" + std::to_string(i); });
+        threads.emplace_back(writer, "C1"_pos, [](int i)
+                             { return i % 2 ? "abc"s : "'=xyz"s; });
+        threads.emplace_back(writer, "B1"_pos, [](int i)
+                             { return i % 2 ? "=1/0"s : "=A1"s; });
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 3; ++r)
+        {
+            readers.emplace_back([&sheet, &done, &consistent, r]
+                                 {
+                                     std::mt19937 random(r);
+                                     std::vector<double> last(static_cast<size_t>(DEPENDENTS), 0);
+                                     std::uint64_t last_version = 0;
+                                     while (!done)
+                                     {
+                                         const int i = static_cast<int>(random() % DEPENDENTS);
+                                         const auto value = sheet.ReadValue({1 + i, 0});
+                                         const double *number = std::get_if<double>(&value);
+                                         const std::uint64_t version = sheet.GetValueVersion("C1"_pos);
+                                         const auto text = sheet.ReadValue("C1"_pos);
+                                         const auto error = sheet.ReadValue("B1"_pos);
+                                         if (!number || *number < last[i] || *number > 2 * EDITS + i ||
+                                             std::fmod(*number - i, 2) != 0 || version < last_version ||
+                                             (!(text == CellInterface::Value("abc"s)) &&
+                                              !(text == CellInterface::Value("=xyz"s))) ||
+                                             (!std::holds_alternative<double>(error) &&
+                                              !std::holds_alternative<FormulaError>(error)))
+                                         {
+                                             consistent = false;
+                                         }
+                                         last[i] = number ? *number : last[i];
+                                         last_version = version;
+                                     }
+                                 });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        done = true;
+        for (auto &reader : readers)
+        {
+            reader.join();
+        }
+        ASSERT(consistent);
+        for (int i = 0; i < DEPENDENTS; ++i)
+        {
+            const Position pos{1 + i, 0};
+            ASSERT(sheet.ReadValue(pos) == CellInterface::Value(double(2 * EDITS + i)));
+            ASSERT(sheet.ReadValue(pos) == sheet.GetCell(pos)->GetValue());
+        }
+        ASSERT(sheet.ReadValue("B1"_pos) == CellInterface::Value(double(EDITS)));
+        ASSERT(sheet.ReadValue("C1"_pos) == CellInterface::Value("=xyz"s));
+
+        // Значения снимка публикуются при загрузке
+        std::ostringstream saved;
+        sheet.SaveSnapshot(saved);
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test_reads.snp").string();
+        std::ofstream(path, std::ios::binary) << saved.str();
+        Sheet loaded;
+        loaded.EnableConcurrentReads();
+        loaded.LoadSnapshot(path);
+        std::filesystem::remove(path);
+        ASSERT(loaded.ReadValue({DEPENDENTS, 0}) == CellInterface::Value(double(2 * EDITS + DEPENDENTS - 1)));
+        ASSERT(loaded.ReadValue("C1"_pos) == CellInterface::Value("=xyz"s));
+    }
+
+    void TestSheetSnapshot()
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1*3");
+        sheet.SetCell("C2"_pos, "'=text");
+        sheet.SetCell("D3"_pos, "=1/0");
+        sheet.SetCell("E1"_pos, "=Z9");
+        auto printed = [](const auto &source, bool texts)
+        {
+            std::ostringstream output;
+            texts ? source.PrintTexts(output) : source.PrintValues(output);
+            return output.str();
+        };
+
+        const auto first = sheet.Snapshot();
+        ASSERT(first->GetValue("B1"_pos) == CellInterface::Value(6.0));
+        ASSERT_EQUAL(first->GetText("B1"_pos), "=A1*3");
+        ASSERT(first->GetValue("C2"_pos) == CellInterface::Value("=text"s));
+        ASSERT_EQUAL(first->GetText("C2"_pos), "'=text");
+        ASSERT(first->GetValue("D3"_pos) == CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT(first->GetValue("Z9"_pos) == CellInterface::Value(""s));
+        ASSERT(first->GetValue("X100"_pos) == CellInterface::Value(""s));
+        ASSERT((first->GetPrintableSize() == Size{3, 5}));
+        const std::string values = printed(sheet, false);
+        const std::string texts = printed(sheet, true);
+        ASSERT_EQUAL(printed(*first, false), values);
+        ASSERT_EQUAL(printed(*first, true), texts);
+        ASSERT(Throws<InvalidPositionException>([&]
+                                                { first->GetText(Position::NONE); }));
+
+        // Правки после снимка его не меняют, а следующий снимок их видит
+        sheet.SetCell("A1"_pos, "5");
+        sheet.ClearCell("C2"_pos);
+        sheet.SetCell("F5"_pos, "new");
+        const auto second = sheet.Snapshot();
+        ASSERT(first->GetValue("B1"_pos) == CellInterface::Value(6.0));
+        ASSERT_EQUAL(first->GetText("C2"_pos), "'=text");
+        ASSERT_EQUAL(printed(*first, true), texts);
+        ASSERT(second->GetValue("B1"_pos) == CellInterface::Value(15.0));
+        ASSERT_EQUAL(second->GetText("C2"_pos), "");
+        ASSERT_EQUAL(printed(*second, false), printed(sheet, false));
+        ASSERT_EQUAL(printed(*second, true), printed(sheet, true));
+
+        // Отменённые правки в снимок не попадают
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=B1"); }));
+        ASSERT_EQUAL(sheet.Snapshot()->GetText("A1"_pos), "5");
+
+        // Снимок переживает таблицу
+        std::shared_ptr<const SheetView> last;
+        {
+            Sheet temporary;
+            temporary.SetCell("A1"_pos, "=1+2");
+            last = temporary.Snapshot();
+        }
+        ASSERT(last->GetValue("A1"_pos) == CellInterface::Value(3.0));
+
+        // Правка после снимка копирует только путь к своей ячейке, сколько
+        // бы ячеек ни было в таблице
+        Sheet large;
+        for (int row = 0; row < 300; ++row)
+        {
+            for (int col = 0; col < 100; ++col)
+            {
+                large.SetCell({row, col}, std::to_string(row + col));
+            }
+        }
+        large.SetCell("A1"_pos, "1");
+        const auto before_edit = large.Snapshot();
+        const size_t before = GetHeapAllocationCount();
+        large.SetCell("A1"_pos, "2");
+        const size_t copied = GetHeapAllocationCount() - before;
+        large.SetCell("A1"_pos, "3");
+        const size_t in_place = GetHeapAllocationCount() - before - copied;
+        // Корень, три узла пути, состояние ячейки и её текст; затем только
+        // состояние и текст
+        ASSERT_EQUAL(copied, 6u);
+        ASSERT_EQUAL(in_place, 2u);
+        ASSERT_EQUAL(before_edit->GetText("A1"_pos), "1");
+
+        // Пересчитанная формула делит текст с прежним состоянием. A1 и B1
+        // лежат в одном листе: копия пути, состояние и текст A1 и одно
+        // состояние B1
+        large.SetCell("B1"_pos, "=A1*2");
+        const auto before_recalc = large.Snapshot();
+        const size_t recalc_start = GetHeapAllocationCount();
+        large.SetCell("A1"_pos, "4");
+        const size_t recalculated = GetHeapAllocationCount() - recalc_start;
+        ASSERT_EQUAL(recalculated, 7u);
+        ASSERT(before_recalc->GetValue("B1"_pos) == CellInterface::Value(6.0));
+        ASSERT(large.Snapshot()->GetValue("B1"_pos) == CellInterface::Value(8.0));
+        ASSERT_EQUAL(large.Snapshot()->GetText("B1"_pos), "=A1*2");
+
+        // Когда последний вид отпущен, правка стоит столько же, сколько в
+        // таблице, с которой снимков не брали, а следующий снимок видит всё
+        {
+            Sheet plain;
+            Sheet viewed;
+            for (Sheet *target : {&plain, &viewed})
+            {
+                target->SetCell("A1"_pos, "1");
+                for (int row = 1; row < 1000; ++row)
+                {
+                    target->SetCell({row, 0}, "=A1+" + std::to_string(row));
+                }
+            }
+            const auto dropped = viewed.Snapshot();
+            viewed.SetCell("A1"_pos, "2");
+            viewed.Snapshot();
+            auto edit_cost = [](Sheet &target, const std::string &text)
+            {
+                const size_t start = GetHeapAllocationCount();
+                target.SetCell("A1"_pos, text);
+                return GetHeapAllocationCount() - start;
+            };
+            edit_cost(plain, "2");
+            for (const std::string text : {"3", "4"})
+            {
+                const size_t viewed_cost = edit_cost(viewed, text);
+                const size_t plain_cost = edit_cost(plain, text);
+                ASSERT_EQUAL(viewed_cost, plain_cost);
+            }
+            ASSERT(dropped->GetValue("B1"_pos) == CellInterface::Value(""s));
+            ASSERT(dropped->GetValue("A2"_pos) == CellInterface::Value(2.0));
+            const auto rebuilt = viewed.Snapshot();
+            ASSERT(rebuilt->GetValue("A2"_pos) == CellInterface::Value(5.0));
+            ASSERT_EQUAL(printed(*rebuilt, true), printed(viewed, true));
+        }
+
+        // Снимки из других потоков во время правок согласованы: значение
+        // формулы всегда соответствует тексту ячейки, на которую она ссылается
+        sheet.SetCell("A1"_pos, "0");
+        std::atomic<bool> done = false;
+        std::atomic<bool> consistent = true;
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 2; ++r)
+        {
+            readers.emplace_back([&sheet, &done, &consistent]
+                                 {
+                                     while (!done)
+                                     {
+                                         const auto view = sheet.Snapshot();
+                                         const double a1 = std::stod(view->GetText("A1"_pos));
+                                         if (!(view->GetValue("B1"_pos) == CellInterface::Value(a1 * 3)))
+                                         {
+                                             consistent = false;
+                                         }
+                                     }
+                                 });
+        }
+        for (int i = 1; i <= 300; ++i)
+        {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+        }
+        done = true;
+        for (auto &reader : readers)
+        {
+            reader.join();
+        }
+        ASSERT(consistent);
+    }
+
+    void TestAsyncRecalc()
+    {
+        Sheet sheet;
+        sheet.SetAsyncRecalc(true);
+        ASSERT(sheet.IsAsyncRecalc());
+        ASSERT(sheet.IsConcurrentReadEnabled());
+        const int DEPENDENTS = 5000;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 0; i < DEPENDENTS; ++i)
+        {
+            sheet.SetCell({1 + i, 0}, "=A1+" + std::to_string(i));
+        }
+        sheet.SetCell("B1"_pos, "=A5000*2");
+        ASSERT(sheet.WaitForValue("B1"_pos) == CellInterface::Value(2.0 * (1 + DEPENDENTS - 2)));
+
+        // Правка не пересчитывает формулы сама, а ошибки разбора и циклы
+        // по-прежнему видны сразу
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 0u);
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=B1"); }));
+        ASSERT(Throws<FormulaException>([&]
+                                        { sheet.SetCell("A1"_pos, "=B1+"); }));
+        ASSERT(sheet.WaitForValue("B1"_pos) == CellInterface::Value(2.0 * (10 + DEPENDENTS - 2)));
+        sheet.WaitForRecalc();
+        ASSERT(!sheet.IsStale("B1"_pos));
+        for (int i = 0; i < DEPENDENTS; ++i)
+        {
+            ASSERT(sheet.ReadValue({1 + i, 0}) == CellInterface::Value(10.0 + i));
+        }
+
+        // После тех же правок, включая перестановки порядка, очистки и
+        // пакеты, таблица совпадает с пересчитанной синхронно
+        Sheet async;
+        async.SetAsyncRecalc(true);
+        Sheet expected;
+        std::mt19937 random;
+        for (int i = 0; i < 3000; ++i)
+        {
+            const Position pos{int(random() % 30), int(random() % 5)};
+            const int kind = random() % 5;
+            std::string text = kind == 0   ? std::to_string(random() % 100)
+                               : kind == 1 ? ""s
+                                           : "=" + Position{int(random() % 30), int(random() % 5)}.ToString() + "+" +
+                                                 Position{int(random() % 30), int(random() % 5)}.ToString();
+            const bool batch = random() % 50 == 0;
+            for (Sheet *target : {&async, &expected})
+            {
+                try
+                {
+                    if (batch)
+                    {
+                        target->BeginBatch();
+                        target->SetCell(pos, text);
+                        target->SetCell({pos.row, 6}, "=" + pos.ToString());
+                        target->Commit();
+                    }
+                    else if (text.empty())
+                    {
+                        target->ClearCell(pos);
+                    }
+                    else
+                    {
+                        target->SetCell(pos, text);
+                    }
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+        }
+        async.WaitForRecalc();
+        std::ostringstream actual_values;
+        async.PrintValues(actual_values);
+        std::ostringstream expected_values;
+        expected.PrintValues(expected_values);
+        ASSERT_EQUAL(actual_values.str(), expected_values.str());
+
+        // Читатели из других потоков во время правок
+        std::atomic<bool> done = false;
+        std::atomic<bool> consistent = true;
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 2; ++r)
+        {
+            readers.emplace_back([&sheet, &done, &consistent, r]
+                                 {
+                                     std::mt19937 random(r);
+                                     while (!done)
+                                     {
+                                         const Position pos{1 + int(random() % DEPENDENTS), 0};
+                                         const auto value = r == 0 ? sheet.WaitForValue(pos) : sheet.ReadValue(pos);
+                                         sheet.IsStale(pos);
+                                         if (!std::holds_alternative<double>(value))
+                                         {
+                                             consistent = false;
+                                         }
+                                     }
+                                 });
+        }
+        for (int i = 0; i < 50; ++i)
+        {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+        }
+        done = true;
+        for (auto &reader : readers)
+        {
+            reader.join();
+        }
+        ASSERT(consistent);
+
+        // Значения из GetCell, печать и снимок читаются во время пересчёта
+        for (int i = 0; i < 5; ++i)
+        {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            ASSERT(std::holds_alternative<double>(sheet.GetCell("B1"_pos)->GetValue()));
+            std::ostringstream values;
+            sheet.PrintValues(values);
+            sheet.ExportValues(values, 2);
+            std::ostringstream snapshot;
+            sheet.SaveSnapshot(snapshot);
+        }
+
+        // Выключение режима дожидается пересчёта
+        sheet.SetCell("A1"_pos, "100");
+        sheet.SetAsyncRecalc(false);
+        ASSERT(!sheet.IsAsyncRecalc());
+        ASSERT(sheet.GetCell("B1"_pos)->GetValue() == CellInterface::Value(2.0 * (100 + DEPENDENTS - 2)));
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT(sheet.GetCell("B1"_pos)->GetValue() == CellInterface::Value(2.0 * (1 + DEPENDENTS - 2)));
+    }
+
+    void TestChangeNotifications()
+    {
+        Sheet sheet;
+        std::vector<std::vector<Sheet::CellChange>> all;
+        std::vector<std::vector<Sheet::CellChange>> column;
+        const size_t everything = sheet.Subscribe([&all](const std::vector<Sheet::CellChange> &changes)
+                                                  { all.push_back(changes); });
+        sheet.Subscribe([&column](const std::vector<Sheet::CellChange> &changes)
+                        { column.push_back(changes); },
+                        Sheet::Region{"C1"_pos, "C10"_pos});
+        auto value = [](const auto &v)
+        { return CellInterface::Value(v); };
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(all.size(), 3u);
+        ASSERT_EQUAL(column.size(), 1u);
+        ASSERT(column[0][0].new_value == value(3.0));
+
+        // Одна доставка на правку: изменённая ячейка и пересчитанные
+        // зависимые, по возрастанию позиции, с прежним и новым значением
+        all.clear();
+        column.clear();
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(all.size(), 1u);
+        ASSERT_EQUAL(all[0].size(), 3u);
+        ASSERT(all[0][0].pos == "A1"_pos && all[0][0].old_value == value("1"s) && all[0][0].new_value == value("2"s));
+        ASSERT(all[0][1].pos == "B1"_pos && all[0][1].old_value == value(2.0) && all[0][1].new_value == value(4.0));
+        ASSERT(all[0][2].pos == "C1"_pos && all[0][2].old_value == value(3.0) && all[0][2].new_value == value(5.0));
+        ASSERT_EQUAL(column.size(), 1u);
+        ASSERT_EQUAL(column[0].size(), 1u);
+        ASSERT(column[0][0].pos == "C1"_pos);
+
+        // Правки, не изменившие значений, и отменённые не доставляются
+        all.clear();
+        column.clear();
+        sheet.SetCell("B1"_pos, "=A1+A1");
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=C1"); }));
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("A2"_pos, "=A1+");
+        ASSERT(Throws<FormulaException>([&]
+                                        { sheet.Commit(); }));
+        ASSERT(all.empty());
+        sheet.SetCell("E5"_pos, "far");
+        ASSERT_EQUAL(all.size(), 1u);
+        ASSERT(column.empty());
+
+        // Пакет - одна доставка; очистка даёт пустое значение
+        all.clear();
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "3");
+        sheet.ClearCell("E5"_pos);
+        sheet.Commit();
+        ASSERT_EQUAL(all.size(), 1u);
+        ASSERT_EQUAL(all[0].size(), 4u);
+        ASSERT(all[0][3].pos == "E5"_pos && all[0][3].old_value == value("far"s) && all[0][3].new_value == value(""s));
+
+        // Слушатель может править таблицу: его правка доставляется следом
+        all.clear();
+        const size_t mirror = sheet.Subscribe([&sheet](const std::vector<Sheet::CellChange> &changes)
+                                              { sheet.SetCell("D1"_pos, std::get<std::string>(changes[0].new_value)); },
+                                              Sheet::Region{"A1"_pos, "A1"_pos});
+        sheet.SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(all.size(), 2u);
+        ASSERT(all[1][0].pos == "D1"_pos && all[1][0].new_value == value("7"s));
+        sheet.Unsubscribe(mirror);
+        sheet.Unsubscribe(everything);
+        all.clear();
+        sheet.SetCell("A1"_pos, "8");
+        ASSERT(all.empty());
+        ASSERT(Throws<InvalidPositionException>([&]
+                                                { sheet.Subscribe([](const auto &) {},
+                                                                  Sheet::Region{Position::NONE, "A1"_pos}); }));
+
+        // В асинхронном режиме пересчитанные значения приходят из фонового
+        // потока после каждой порции
+        std::mutex mutex;
+        std::map<Position, CellInterface::Value> latest;
+        sheet.Subscribe([&mutex, &latest](const std::vector<Sheet::CellChange> &changes)
+                        {
+                            std::lock_guard guard(mutex);
+                            for (const auto &change : changes)
+                            {
+                                latest[change.pos] = change.new_value;
+                            }
+                        });
+        sheet.SetAsyncRecalc(true);
+        for (int i = 10; i <= 20; ++i)
+        {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+        }
+        sheet.WaitForRecalc();
+        const auto deadline = std::chrono::steady_clock::now() + 5s;
+        bool delivered = false;
+        while (!delivered && std::chrono::steady_clock::now() < deadline)
+        {
+            {
+                std::lock_guard guard(mutex);
+                delivered = latest.count("C1"_pos) != 0 && latest["C1"_pos] == value(41.0);
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+        ASSERT(delivered);
+        sheet.SetAsyncRecalc(false);
+    }
+
+    void TestEarlyCutoff()
+    {
+        // Пересчёт не идёт дальше формулы, значение которой не изменилось
+        const int LENGTH = 100;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("B1"_pos, "=A1*0");
+        for (int row = 1; row < LENGTH; ++row)
+        {
+            sheet.SetCell(Position{row, 1}, "=B" + std::to_string(row) + "+1");
+        }
+        const CellInterface *last = sheet.GetCell(Position{LENGTH - 1, 1});
+        ASSERT(last->GetValue() == CellInterface::Value(double(LENGTH - 1)));
+        size_t evaluations = sheet.GetEvaluationCount();
+        sheet.SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 1u);
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, 1u);
+
+        // Формула, переписанная с тем же значением, тоже не трогает зависимых
+        sheet.SetCell("B1"_pos, "=A1-A1");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 1u);
+        sheet.SetCell("B1"_pos, "=3");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH));
+        ASSERT(last->GetValue() == CellInterface::Value(double(LENGTH + 2)));
+
+        // Та же ошибка - то же значение
+        sheet.SetCell("B1"_pos, "=1/A1");
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), size_t(LENGTH));
+        ASSERT(last->GetValue() == CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        sheet.ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 1u);
+
+        // 0 и -0 печатаются по-разному, поэтому различаются; а B2 = B1+1
+        // от этого не меняется, и цепочка дальше не пересчитывается
+        sheet.SetCell("B1"_pos, "=A1*0");
+        sheet.SetCell("C1"_pos, "=B1");
+        sheet.SetCell("A1"_pos, "-1");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 3u);
+        ASSERT_EQUAL(std::signbit(std::get<double>(sheet.GetCell("C1"_pos)->GetValue())), true);
+
+        // Широкая волна пересчитывается обходом в глубину, но тоже
+        // останавливается на формулах с прежним значением
+        const int WIDE = 200;
+        Sheet wide;
+        wide.SetCell("A1"_pos, "1");
+        for (int row = 0; row < WIDE; ++row)
+        {
+            const std::string index = std::to_string(row);
+            wide.SetCell({row, 1}, row % 2 == 0 ? "=A1*0+" + index : "=A1+" + index);
+            wide.SetCell({row, 2}, "=B" + std::to_string(row + 1) + "*2");
+        }
+        evaluations = wide.GetEvaluationCount();
+        wide.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(wide.GetLastRecalcCount(), size_t(WIDE + WIDE / 2));
+        ASSERT_EQUAL(wide.GetEvaluationCount() - evaluations, size_t(WIDE + WIDE / 2));
+        for (int row = 0; row < WIDE; ++row)
+        {
+            const double expected = 2.0 * (row % 2 == 0 ? row : row + 2);
+            ASSERT(wide.GetCell({row, 2})->GetValue() == CellInterface::Value(expected));
+        }
+
+        // Пакеты, параллельный и фоновый пересчёт отсекают так же, а значения
+        // совпадают с пересчётом всей таблицы
+        Sheet serial;
+        Sheet parallel;
+        parallel.SetRecalcThreads(4);
+        Sheet async;
+        async.SetAsyncRecalc(true);
+        const std::vector<std::string> patterns = {"=X*0+Y", "=X-X", "=X/Y", "=X+Y", "=(X+1)*0"};
+        std::mt19937 random;
+        auto random_pos = [&random]
+        {
+            return Position{int(random() % 20), int(random() % 5)}.ToString();
+        };
+        for (int i = 0; i < 2000; ++i)
+        {
+            const Position pos{int(random() % 20), int(random() % 5)};
+            std::string text;
+            if (random() % 3 == 0)
+            {
+                text = std::vector<std::string>{"0", "1", "2", "x", ""}[random() % 5];
+            }
+            else
+            {
+                const std::string x = random_pos();
+                const std::string y = random_pos();
+                for (char c : patterns[random() % patterns.size()])
+                {
+                    text += c == 'X' ? x : c == 'Y' ? y : std::string(1, c);
+                }
+            }
+            const bool batch = random() % 20 == 0;
+            for (Sheet *target : {&serial, &parallel, &async})
+            {
+                try
+                {
+                    if (batch)
+                    {
+                        target->BeginBatch();
+                        target->SetCell(pos, text);
+                        target->SetCell({pos.row, 6}, "=" + pos.ToString() + "*0");
+                        target->Commit();
+                    }
+                    else
+                    {
+                        target->SetCell(pos, text);
+                    }
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+        }
+        async.WaitForRecalc();
+
+        // Пакет из всех ячеек пересчитывает каждую формулу
+        Sheet expected;
+        expected.BeginBatch();
+        const Size size = serial.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row)
+        {
+            for (int col = 0; col < size.cols; ++col)
+            {
+                if (const CellInterface *cell = serial.GetCell({row, col}))
+                {
+                    expected.SetCell({row, col}, cell->GetText());
+                }
+            }
+        }
+        expected.Commit();
+        std::ostringstream expected_values;
+        expected.PrintValues(expected_values);
+        for (Sheet *target : {&serial, &parallel, &async})
+        {
+            std::ostringstream values;
+            target->PrintValues(values);
+            ASSERT_EQUAL(values.str(), expected_values.str());
+        }
+        ASSERT_EQUAL(parallel.GetEvaluationCount(), serial.GetEvaluationCount());
+    }
+
+    void TestLazyRecalc()
+    {
+        // Правка не пересчитывает зависимых, чтение подтверждает значения
+        // без рекурсии даже на длинной цепочке
+        const int LENGTH = 100000;
+        auto link = [](int index)
+        {
+            return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+        };
+        Sheet sheet;
+        sheet.SetLazyRecalc(true);
+        ASSERT(sheet.IsLazyRecalc());
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < LENGTH; ++i)
+        {
+            sheet.SetCell(link(i), "=" + link(i - 1).ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 0u);
+        const CellInterface *last = sheet.GetCell(link(LENGTH - 1));
+        ASSERT(sheet.IsStale(link(LENGTH - 1)));
+        ASSERT(last->GetValue() == CellInterface::Value(double(LENGTH)));
+        ASSERT(!sheet.IsStale(link(LENGTH - 1)));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(LENGTH - 1));
+        ASSERT(last->GetValue() == CellInterface::Value(double(LENGTH)));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(LENGTH - 1));
+
+        // Чтение середины вычисляет только начало цепочки, чтение конца -
+        // остальное
+        size_t evaluations = sheet.GetEvaluationCount();
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetLastRecalcCount(), 0u);
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), evaluations);
+        ASSERT(sheet.GetCell(link(LENGTH / 2))->GetValue() == CellInterface::Value(double(LENGTH / 2 + 2)));
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, size_t(LENGTH / 2));
+        ASSERT(last->GetValue() == CellInterface::Value(double(LENGTH + 1)));
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, size_t(LENGTH - 1));
+
+        // Формула с прежним значением не заставляет вычислять зависимых
+        sheet.SetCell("K1"_pos, "=A1*0");
+        sheet.SetCell("L1"_pos, "=K1+1");
+        ASSERT(sheet.GetCell("L1"_pos)->GetValue() == CellInterface::Value(1.0));
+        evaluations = sheet.GetEvaluationCount();
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(sheet.GetCell("L1"_pos)->GetValue() == CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, 1u);
+
+        // Несколько правок ячейки до чтения: зависимые сверяются с последней
+        sheet.SetCell("M1"_pos, "5");
+        sheet.SetCell("N1"_pos, "=M1*2");
+        ASSERT(sheet.GetCell("N1"_pos)->GetValue() == CellInterface::Value(10.0));
+        sheet.SetCell("M1"_pos, "7");
+        sheet.SetCell("M1"_pos, "=5");
+        ASSERT(sheet.GetCell("N1"_pos)->GetValue() == CellInterface::Value(10.0));
+        sheet.SetCell("M1"_pos, "=3");
+        sheet.ClearCell("M1"_pos);
+        sheet.SetCell("M1"_pos, "=4");
+        ASSERT(sheet.GetCell("N1"_pos)->GetValue() == CellInterface::Value(8.0));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("M1"_pos, "=N1"); }));
+        ASSERT(Throws<std::logic_error>([&]
+                                        { sheet.SetAsyncRecalc(true); }));
+        sheet.SetLazyRecalc(false);
+        ASSERT(!sheet.IsLazyRecalc());
+
+        // Печать, снимки и пакеты видят то же, что обычный пересчёт, при
+        // любой смеси правок и чтений
+        Sheet lazy;
+        lazy.SetLazyRecalc(true);
+        Sheet expected;
+        std::mt19937 random;
+        std::shared_ptr<const SheetView> view;
+        for (int i = 0; i < 3000; ++i)
+        {
+            const Position pos{int(random() % 30), int(random() % 5)};
+            const int kind = random() % 5;
+            std::string text = kind == 0   ? std::to_string(random() % 3)
+                               : kind == 1 ? ""s
+                                           : "=" + Position{int(random() % 30), int(random() % 5)}.ToString() + "*0+" +
+                                                 Position{int(random() % 30), int(random() % 5)}.ToString();
+            const bool batch = random() % 50 == 0;
+            for (Sheet *target : {&lazy, &expected})
+            {
+                try
+                {
+                    if (batch)
+                    {
+                        target->BeginBatch();
+                        target->SetCell(pos, text);
+                        target->Commit();
+                    }
+                    else if (text.empty())
+                    {
+                        target->ClearCell(pos);
+                    }
+                    else
+                    {
+                        target->SetCell(pos, text);
+                    }
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+            if (random() % 4 == 0)
+            {
+                const Position read{int(random() % 30), int(random() % 5)};
+                const CellInterface *actual = lazy.GetCell(read);
+                const CellInterface *reference = expected.GetCell(read);
+                ASSERT_EQUAL(actual != nullptr, reference != nullptr);
+                ASSERT(!actual || actual->GetValue() == reference->GetValue());
+            }
+            if (random() % 100 == 0)
+            {
+                view = lazy.Snapshot();
+                std::ostringstream view_values;
+                view->PrintValues(view_values);
+                std::ostringstream expected_values;
+                expected.PrintValues(expected_values);
+                ASSERT_EQUAL(view_values.str(), expected_values.str());
+            }
+        }
+        std::ostringstream actual_values;
+        lazy.PrintValues(actual_values);
+        std::ostringstream expected_values;
+        expected.PrintValues(expected_values);
+        ASSERT_EQUAL(actual_values.str(), expected_values.str());
+
+        // Подписчики получают изменения каждой правки
+        std::vector<Sheet::CellChange> changes;
+        lazy.SetCell("Z1"_pos, "1");
+        lazy.SetCell("Z2"_pos, "=Z1+1");
+        lazy.Subscribe([&changes](const std::vector<Sheet::CellChange> &delivered)
+                       { changes = delivered; });
+        lazy.SetCell("Z1"_pos, "2");
+        ASSERT_EQUAL(changes.size(), 2u);
+        ASSERT(changes[1].pos == "Z2"_pos && changes[1].new_value == CellInterface::Value(3.0));
+    }
+
+    void TestRangeReferences()
+    {
+        // Разбор и печать: углы диапазона упорядочиваются, функция от
+        // обычного выражения печатается как есть
+        auto expression = [](std::string text)
+        {
+            return ParseFormula(std::move(text))->GetExpression();
+        };
+        ASSERT_EQUAL(expression("SUM(A1:C3)"), "SUM(A1:C3)");
+        ASSERT_EQUAL(expression("SUM(C3:A1)+1"), "SUM(A1:C3)+1");
+        ASSERT_EQUAL(expression("-MIN(A1:A2)*(2+MAX(B1))"), "-MIN(A1:A2)*(2+MAX(B1))");
+        ASSERT_EQUAL(expression("MAX((A1+2))*3"), "MAX(A1+2)*3");
+        const auto formula = ParseFormula("SUM(B2:B3)+MAX(A1:C3)+SUM(B3:B2)+D4");
+        ASSERT(formula->GetReferencedCells() == std::vector<Position>{"D4"_pos});
+        ASSERT((formula->GetReferencedRanges() ==
+                std::vector<CellRange>{{"A1"_pos, "C3"_pos}, {"B2"_pos, "B3"_pos}}));
+        for (const char *invalid : {"A1:B2", "A1:B2+1", "-A1:B2", "AVG(A1:B2)", "SUM(A1:B2", "SUM(A1:ZZZZ1)"})
+        {
+            ASSERT(Throws<FormulaException>([&]
+                                            { ParseFormula(invalid); }));
+        }
+
+        // Учитывается каждая ячейка диапазона, пустые и несуществующие - как
+        // ноль; ячейки под диапазоном не создаются
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "'4");
+        sheet.SetCell("B1"_pos, "=-2");
+        sheet.SetCell("D1"_pos, "=SUM(A1:B3)");
+        sheet.SetCell("D2"_pos, "=MIN(A1:B2)");
+        sheet.SetCell("D3"_pos, "=MAX(A1:A3)");
+        sheet.SetCell("D4"_pos, "=MIN(A1:A2)");
+        sheet.SetCell("D5"_pos, "=MAX(B1:B2)*2");
+        auto value = [&sheet](Position pos)
+        {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        ASSERT(value("D1"_pos) == CellInterface::Value(3.0));
+        ASSERT(value("D2"_pos) == CellInterface::Value(-2.0));
+        ASSERT(value("D3"_pos) == CellInterface::Value(4.0));
+        ASSERT(value("D4"_pos) == CellInterface::Value(1.0));
+        ASSERT(value("D5"_pos) == CellInterface::Value(0.0));
+        ASSERT(sheet.GetCell("A3"_pos) == nullptr && sheet.GetCell("B2"_pos) == nullptr);
+        ASSERT(sheet.GetCell("D1"_pos)->GetReferencedCells().empty());
+
+        // Правка ячейки диапазона, в том числе новой, пересчитывает формулу
+        sheet.SetCell("A3"_pos, "10");
+        ASSERT(value("D1"_pos) == CellInterface::Value(13.0));
+        ASSERT(value("D3"_pos) == CellInterface::Value(10.0));
+        sheet.SetCell("B2"_pos, "=-A3");
+        ASSERT(value("D2"_pos) == CellInterface::Value(-10.0));
+        sheet.ClearCell("B2"_pos);
+        sheet.ClearCell("A3"_pos);
+        ASSERT(value("D1"_pos) == CellInterface::Value(3.0));
+        ASSERT(value("D2"_pos) == CellInterface::Value(-2.0));
+
+        // Из нескольких ошибок диапазона возвращается первая по строкам
+        sheet.SetCell("A2"_pos, "text");
+        sheet.SetCell("B1"_pos, "=1/0");
+        ASSERT(value("D1"_pos) == CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT(value("D3"_pos) == CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        sheet.SetCell("B1"_pos, "=-2");
+        sheet.SetCell("A2"_pos, "4");
+
+        // Циклы через диапазоны, в том числе из пакета, отклоняются
+        // целиком
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("C1"_pos, "=SUM(B1:C2)"); }));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=D1"); }));
+        sheet.SetCell("E1"_pos, "=D1+1");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("B3"_pos, "=E1"); }));
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr && sheet.GetCell("B3"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        // Ссылка на себя рядом с диапазоном - тоже цикл, даже когда на
+        // ячейку никто не ссылается
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("J1"_pos, "=J1+SUM(K1:K2)"); }));
+        ASSERT(sheet.GetCell("J1"_pos) == nullptr);
+        sheet.SetCell("J2"_pos, "5");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("J2"_pos, "=SUM(K1:K2)*J2"); }));
+        ASSERT_EQUAL(sheet.GetCell("J2"_pos)->GetText(), "5");
+        sheet.BeginBatch();
+        sheet.SetCell("C5"_pos, "=SUM(C6:C7)");
+        sheet.SetCell("C7"_pos, "=C5");
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.Commit(); }));
+        ASSERT(sheet.GetCell("C5"_pos) == nullptr && sheet.GetCell("C7"_pos) == nullptr);
+
+        // Новая формула в диапазоне ссылается на ячейку, стоявшую в порядке
+        // позже формулы диапазона: порядок перестраивается
+        sheet.SetCell("F1"_pos, "=SUM(G1:G3)");
+        sheet.SetCell("H1"_pos, "=E1*2");
+        sheet.SetCell("G2"_pos, "=H1");
+        ASSERT(value("F1"_pos) == CellInterface::Value(8.0));
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(value("F1"_pos) == CellInterface::Value(10.0));
+        auto order = [&sheet](Position pos)
+        {
+            return static_cast<const Cell *>(sheet.GetCell(pos))->GetTopologicalOrder();
+        };
+        ASSERT(order("G2"_pos) < order("F1"_pos));
+        ASSERT(Throws<CircularDependencyException>([&]
+                                                   { sheet.SetCell("A1"_pos, "=F1"); }));
+
+        // Диапазон на всю высоту листа не создаёт ячеек
+        Sheet tall;
+        tall.SetCell("H1"_pos, "=SUM(A1:G16384)");
+        tall.SetCell("I1"_pos, "=MAX(A1:G16384)");
+        tall.SetCell("C9000"_pos, "5");
+        tall.SetCell("G16384"_pos, "=C9000*2");
+        ASSERT(tall.GetCell("H1"_pos)->GetValue() == CellInterface::Value(15.0));
+        ASSERT(tall.GetCell("I1"_pos)->GetValue() == CellInterface::Value(10.0));
+        ASSERT(tall.GetCell("A1"_pos) == nullptr);
+        ASSERT(tall.GetPrintableSize() == (Size{16384, 9}));
+
+        // Скомпилированная программа и обход дерева сходятся
+        const SheetArgs args = [](Position pos) -> CellArg
+        {
+            if (pos == "B2"_pos)
+            {
+                return FormulaError(FormulaError::Category::Value);
+            }
+            return static_cast<double>(pos.row * 3 - pos.col);
+        };
+        for (const char *text : {"SUM(A1:C3)", "MIN(A1:C1)*MAX(A3:C5)-SUM(D1:D1)", "SUM(A2:C3)", "MAX(A1)+MIN(2)"})
+        {
+            const FormulaAST ast = ParseFormulaAST(text);
+            ASSERT(ast.Execute(args) == ast.ExecuteTree(args));
+        }
+        // Программа из снимка не может сослаться на чужой диапазон
+        const ASTImpl::Instruction fold[] = {{ASTImpl::Instruction::Op::SumRange, 0, 0},
+                                             {ASTImpl::Instruction::Op::MaxRange, 1, 0}};
+        const CellRange ranges[] = {{"A1"_pos, "B2"_pos}, {"B2"_pos, "A1"_pos}};
+        ASSERT(IsValidProgram({fold, 1, 2, ranges, 1}, 0));
+        ASSERT(!IsValidProgram({fold + 1, 1, 2, ranges, 1}, 0));
+        ASSERT(!IsValidProgram({fold, 1, 2, ranges, 2}, 0));
+    }
+
+    void TestRangeRecalcModes()
+    {
+        // Правки с диапазонами в разных режимах пересчёта дают те же
+        // значения, что таблица, построенная заново по итоговым текстам
+        Sheet serial;
+        Sheet parallel;
+        parallel.SetRecalcThreads(4);
+        Sheet async;
+        async.SetAsyncRecalc(true);
+        Sheet lazy;
+        lazy.SetLazyRecalc(true);
+        const std::vector<Sheet *> sheets{&serial, &parallel, &async, &lazy};
+        std::mt19937 random;
+        auto random_pos = [&random]
+        {
+            return Position{int(random() % 12), int(random() % 6)};
+        };
+        auto values = [](Sheet &sheet)
+        {
+            sheet.WaitForRecalc();
+            std::ostringstream output;
+            sheet.PrintValues(output);
+            return output.str();
+        };
+        for (int i = 0; i < 2000; ++i)
+        {
+            const Position pos = random_pos();
+            const int kind = random() % 7;
+            std::string text;
+            if (kind == 0)
+            {
+                text = std::to_string(random() % 5);
+            }
+            else if (kind == 1)
+            {
+                text = "=" + random_pos().ToString() + (random() % 4 == 0 ? "/" : "-") + random_pos().ToString();
+            }
+            else if (kind == 2)
+            {
+                text = "=" + random_pos().ToString() + "+1";
+            }
+            else if (kind < 6)
+            {
+                const char *functions[] = {"SUM", "MIN", "MAX"};
+                const CellRange range{random_pos(), random_pos()};
+                text = "="s + functions[kind - 3] + "(" + range.first.ToString() + ":" + range.last.ToString() +
+                       ")*0.5";
+            }
+            for (Sheet *sheet : sheets)
+            {
+                try
+                {
+                    if (text.empty())
+                    {
+                        sheet->ClearCell(pos);
+                    }
+                    else
+                    {
+                        sheet->SetCell(pos, text);
+                    }
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+            if (i % 100 == 99)
+            {
+                const std::string expected = values(serial);
+                for (Sheet *sheet : sheets)
+                {
+                    ASSERT_EQUAL(values(*sheet), expected);
+                }
+            }
+        }
+
+        std::ostringstream texts;
+        serial.PrintTexts(texts);
+        std::istringstream input(texts.str());
+        Sheet rebuilt;
+        rebuilt.ImportTexts(input, 1);
+        const std::string expected = values(rebuilt);
+        for (Sheet *sheet : sheets)
+        {
+            ASSERT_EQUAL(values(*sheet), expected);
+        }
+
+        // Снимок восстанавливает формулы с диапазонами, и правки после
+        // загрузки пересчитывают их так же
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test_ranges.bin").string();
+        {
+            std::ofstream output(path, std::ios::binary | std::ios::trunc);
+            serial.SaveSnapshot(output);
+        }
+        Sheet loaded;
+        loaded.LoadSnapshot(path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(values(loaded), expected);
+        for (int i = 0; i < 200; ++i)
+        {
+            const Position pos = random_pos();
+            const std::string text = std::to_string(random() % 5);
+            for (Sheet *sheet : {&serial, &loaded})
+            {
+                try
+                {
+                    sheet->SetCell(pos, text);
+                }
+                catch (const CircularDependencyException &)
+                {
+                }
+            }
+        }
+        ASSERT_EQUAL(values(loaded), values(serial));
+    }
+
+} // namespace
+
+namespace bench
+{
+    // Ячейка с номером index при заполнении таблицы по строкам начиная со второй
+    Position NthCell(size_t index)
+    {
+        return {static_cast<int>(1 + index % (Position::MAX_ROWS - 1)),
+                static_cast<int>(index / (Position::MAX_ROWS - 1))};
+    }
+
+    // Правка одной ячейки, на которую ссылаются formulas формул, при разном
+    // числе потоков пересчёта
+    void ParallelRecalc(size_t formulas = 1'000'000)
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        {
+            LOG_DURATION_STREAM("build "s + std::to_string(formulas) + " formulas"s, std::cout);
+            for (size_t i = 0; i < formulas; ++i)
+            {
+                sheet.SetCell(NthCell(i), "=(A1+" + std::to_string(i % 100) + ")/(A1*A1+1)");
+            }
+        }
+
+        const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        int value = 2;
+        for (size_t threads = 1; threads <= cores; threads *= 2)
+        {
+            sheet.SetRecalcThreads(threads);
+            LOG_DURATION_STREAM("recalc, threads: "s + std::to_string(threads), std::cout);
+            sheet.SetCell("A1"_pos, std::to_string(value++));
+        }
+    }
+
+    // Вычисление разобранных формул скомпилированной программой и обходом
+    // дерева. Формулы перемешаны в памяти, как в большой таблице
+    void FormulaExecute(size_t formulas = 300'000, size_t rounds = 5)
+    {
+        const std::vector<std::string> shapes = {
+            "A1+B2*C3-D4/(E5+1)",
+            "-(A1+1)*(B1-2)/(C1*C1+1)+D1*2.5-E1",
+            "((A1+A2)*(A3+A4)+(A5+A6)*(A7+A8))/((B1+B2)*(B3+B4)+1)",
+        };
+        std::vector<FormulaAST> asts;
+        asts.reserve(formulas);
+        for (size_t i = 0; i < formulas; ++i)
+        {
+            asts.push_back(ParseFormulaAST(shapes[i % shapes.size()]));
+        }
+        std::vector<const FormulaAST *> order;
+        for (const auto &ast : asts)
+        {
+            order.push_back(&ast);
+        }
+        std::shuffle(order.begin(), order.end(), std::mt19937{});
+
+        const SheetArgs args = [](Position pos) -> CellArg
+        {
+            return static_cast<double>(pos.row + pos.col);
+        };
+        double tree_sum = 0;
+        double bytecode_sum = 0;
+        {
+            LOG_DURATION_STREAM("tree", std::cout);
+            for (size_t round = 0; round < rounds; ++round)
+            {
+                for (const FormulaAST *ast : order)
+                {
+                    tree_sum += std::get<double>(ast->ExecuteTree(args));
+                }
+            }
+        }
+        {
+            LOG_DURATION_STREAM("bytecode", std::cout);
+            for (size_t round = 0; round < rounds; ++round)
+            {
+                for (const FormulaAST *ast : order)
+                {
+                    bytecode_sum += std::get<double>(ast->Execute(args));
+                }
+            }
+        }
+        ASSERT_EQUAL(tree_sum, bytecode_sum);
+
+        // Значения ячеек, найденные заранее, как при пересчёте таблицы
+        std::map<Position, CellArg> values;
+        std::vector<std::vector<const CellArg *>> bound(formulas);
+        for (size_t i = 0; i < formulas; ++i)
+        {
+            for (Position pos : asts[i].GetUniqueCells())
+            {
+                auto it = values.emplace(pos, args(pos)).first;
+                bound[i].push_back(&it->second);
+            }
+        }
+        std::vector<std::pair<const FormulaAST *, const CellArg *const *>> bound_order;
+        for (const FormulaAST *ast : order)
+        {
+            bound_order.emplace_back(ast, bound[ast - asts.data()].data());
+        }
+        const SheetArgsRanges ranges(args);
+        double bound_sum = 0;
+        {
+            LOG_DURATION_STREAM("bytecode, bound cells", std::cout);
+            for (size_t round = 0; round < rounds; ++round)
+            {
+                for (const auto &[ast, cells] : bound_order)
+                {
+                    bound_sum += std::get<double>(ast->Execute(cells, ranges));
+                }
+            }
+        }
+        ASSERT_EQUAL(tree_sum, bound_sum);
+    }
+
+    // Ошибка в ячейке, от которой транзитивно зависят dependents формул:
+    // пересчёт разносит её по всем формулам, а следующая правка убирает
+    void ErrorCascade(size_t dependents = 100'000, size_t rounds = 3)
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (size_t i = 0; i < dependents; ++i)
+        {
+            // Формулы образуют двоичное дерево с корнем в A1
+            const std::string parent = i == 0 ? "A1"s : NthCell((i - 1) / 2).ToString();
+            sheet.SetCell(NthCell(i), "=" + parent + "+1");
+        }
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            {
+                LOG_DURATION_STREAM("error", std::cout);
+                sheet.SetCell("A1"_pos, "meow");
+            }
+            {
+                LOG_DURATION_STREAM("number", std::cout);
+                sheet.SetCell("A1"_pos, "1");
+            }
+        }
+        ASSERT(std::holds_alternative<double>(sheet.GetCell(NthCell(dependents - 1))->GetValue()));
+    }
+
+    // Числа, хранящиеся текстом, как после импорта: разбор при установке
+    // и чтение формулами, в том числе через интерфейс таблицы
+    void TextArguments(size_t cells = 10'000, size_t rounds = 100)
+    {
+        Sheet sheet;
+        {
+            LOG_DURATION_STREAM("set "s + std::to_string(cells) + " numeric texts"s, std::cout);
+            for (size_t i = 0; i < cells; ++i)
+            {
+                sheet.SetCell(NthCell(i), std::to_string(i % 1000) + ".25");
+            }
+        }
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        for (size_t i = 0; i < cells; ++i)
+        {
+            formulas.push_back(ParseFormula(NthCell(i).ToString() + "*2"));
+        }
+        double sum = 0;
+        {
+            LOG_DURATION_STREAM("evaluate through SheetInterface", std::cout);
+            for (size_t round = 0; round < rounds; ++round)
+            {
+                for (const auto &formula : formulas)
+                {
+                    sum += std::get<double>(formula->Evaluate(sheet));
+                }
+            }
+        }
+        ASSERT(sum > 0);
+    }
+
+    // Занятая память кучи в байтах, если её можно узнать
+    size_t HeapInUse()
+    {
+#ifdef __GLIBC__
+        return mallinfo2().uordblks;
+#else
+        return 0;
+#endif
+    }
+
+    // Хранение плотного прямоугольника ячеек в блоках и в прежней хеш-таблице
+    // указателей: заполнение, поиск по строкам и в случайном порядке, память
+    void CellStorage(int rows = 16'000, int cols = 64)
+    {
+        std::vector<Position> positions;
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                positions.push_back({row, col});
+            }
+        }
+        std::vector<Position> shuffled = positions;
+        std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937{});
+        const std::string cells = std::to_string(positions.size()) + " cells"s;
+
+        size_t found = 0;
+        {
+            // У каждого варианта своя таблица: её пул содержимого ячеек
+            // учитывается в занятой памяти
+            const size_t heap = HeapInUse();
+            Sheet sheet;
+            std::unordered_map<Position, std::unique_ptr<Cell>> map;
+            {
+                LOG_DURATION_STREAM("map: insert "s + cells, std::cout);
+                for (Position pos : positions)
+                {
+                    map.emplace(pos, std::make_unique<Cell>(sheet, pos));
+                }
+            }
+            std::cout << "map: heap bytes per cell: "s << (HeapInUse() - heap) / positions.size() << std::endl;
+            {
+                LOG_DURATION_STREAM("map: find by rows", std::cout);
+                for (Position pos : positions)
+                {
+                    found += map.find(pos)->second->IsReferenced() ? 0 : 1;
+                }
+            }
+            {
+                LOG_DURATION_STREAM("map: find shuffled", std::cout);
+                for (Position pos : shuffled)
+                {
+                    found += map.find(pos)->second->IsReferenced() ? 0 : 1;
+                }
+            }
+        }
+        {
+            const size_t heap = HeapInUse();
+            Sheet sheet;
+            ::CellStorage storage;
+            {
+                LOG_DURATION_STREAM("tiles: insert "s + cells, std::cout);
+                for (Position pos : positions)
+                {
+                    storage.Emplace(sheet, pos);
+                }
+            }
+            std::cout << "tiles: heap bytes per cell: "s << (HeapInUse() - heap) / positions.size() << std::endl;
+            std::cout << "tiles: of them in tiles: "s << storage.GetMemoryUsage() / positions.size() << std::endl;
+            {
+                LOG_DURATION_STREAM("tiles: find by rows", std::cout);
+                for (Position pos : positions)
+                {
+                    found += storage.Find(pos)->IsReferenced() ? 0 : 1;
+                }
+            }
+            {
+                LOG_DURATION_STREAM("tiles: find shuffled", std::cout);
+                for (Position pos : shuffled)
+                {
+                    found += storage.Find(pos)->IsReferenced() ? 0 : 1;
+                }
+            }
+        }
+        ASSERT_EQUAL(found, 4 * positions.size());
+    }
+
+    // Опрос размера области печати, как при перерисовке интерфейса, на
+    // таблице из cells ячеек, половина из которых - формулы
+    void PrintableSize(size_t cells = 100'000, size_t polls = 1000)
+    {
+        Sheet sheet;
+        for (size_t i = 0; i < cells; ++i)
+        {
+            sheet.SetCell(NthCell(i), i % 2 ? "=A1+" + std::to_string(i) : std::to_string(i));
+        }
+        size_t area = 0;
+        {
+            LOG_DURATION_STREAM(std::to_string(polls) + " polls"s, std::cout);
+            for (size_t poll = 0; poll < polls; ++poll)
+            {
+                Size size = sheet.GetPrintableSize();
+                area += size.rows * size.cols;
+            }
+        }
+        ASSERT(area > 0);
+    }
+
+    // Число обращений к куче на одну правку: при первом заполнении, при
+    // перезаписи и очистке заполненной области, при правке формулы
+    void EditAllocations(int rows = 1000, int cols = 20)
+    {
+        Sheet sheet;
+        const size_t edits = rows * cols;
+        auto measure = [edits](const std::string &name, const auto &edit)
+        {
+            const size_t before = GetHeapAllocationCount();
+            edit();
+            std::cout << name << ": "s << double(GetHeapAllocationCount() - before) / edits << " allocations per edit"s
+                      << std::endl;
+        };
+        auto fill = [&](const std::string &text)
+        {
+            for (int row = 0; row < rows; ++row)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    sheet.SetCell({row, col}, text);
+                }
+            }
+        };
+        measure("first fill", [&]
+                { fill("1.5"); });
+        measure("overwrite", [&]
+                { fill("meow"); });
+        measure("clear", [&]
+                {
+                    for (int row = 0; row < rows; ++row)
+                    {
+                        for (int col = 0; col < cols; ++col)
+                        {
+                            sheet.ClearCell({row, col});
+                        }
+                    } });
+        measure("refill", [&]
+                { fill("2.5"); });
+        measure("formula", [&]
+                {
+                    for (size_t i = 0; i < edits; ++i)
+                    {
+                        sheet.SetCell({rows, 0}, "=A" + std::to_string(i % rows + 1) + "*2+B1");
+                    } });
+    }
+
+    // Построение формул, каждая из которых добавляет ссылки в граф
+    // зависимостей: длинной цепочки и широкого графа, где каждая формула
+    // ссылается на много ячеек предыдущего слоя
+    void DependencyGraph(size_t chain = 1'000'000, size_t layers = 100, size_t width = 1000, size_t fan_in = 16)
+    {
+        {
+            Sheet sheet;
+            {
+                LOG_DURATION_STREAM("build chain of "s + std::to_string(chain) + " cells"s, std::cout);
+                for (size_t i = 1; i < chain; ++i)
+                {
+                    sheet.SetCell(NthCell(i), "=" + NthCell(i - 1).ToString() + "+1");
+                }
+            }
+            LOG_DURATION_STREAM("reject cycle through the chain"s, std::cout);
+            try
+            {
+                sheet.SetCell(NthCell(0), "=" + NthCell(chain - 1).ToString());
+            }
+            catch (const CircularDependencyException &)
+            {
+            }
+        }
+
+        Sheet sheet;
+        std::mt19937 random;
+        for (size_t i = 0; i < width; ++i)
+        {
+            sheet.SetCell(NthCell(i), std::to_string(i));
+        }
+        const size_t heap = HeapInUse();
+        {
+            LOG_DURATION_STREAM("build "s + std::to_string(layers) + " layers of "s + std::to_string(width) +
+                                    " formulas with "s + std::to_string(fan_in) + " references each"s,
+                                std::cout);
+            for (size_t layer = 1; layer < layers; ++layer)
+            {
+                for (size_t i = 0; i < width; ++i)
+                {
+                    std::string formula = "=0";
+                    for (size_t ref = 0; ref < fan_in; ++ref)
+                    {
+                        formula += "+" + NthCell((layer - 1) * width + random() % width).ToString();
+                    }
+                    sheet.SetCell(NthCell(layer * width + i), formula);
+                }
+            }
+        }
+        std::cout << "heap bytes per formula: "s << (HeapInUse() - heap) / ((layers - 1) * width) << std::endl;
+    }
+
+    // Загрузка формул по одной и одним пакетом: цепочки, заданной от начала
+    // (каждая правка пересчитывает одну формулу), и заданной с конца (каждая
+    // правка пересчитывает всё уже загруженное продолжение)
+    void BatchLoad(size_t forward = 500'000, size_t backward = 20'000)
+    {
+        auto load = [](size_t formulas, bool from_end, bool batch)
+        {
+            Sheet sheet;
+            LOG_DURATION_STREAM((batch ? "batch, "s : "one by one, "s) + std::to_string(formulas) +
+                                    (from_end ? " formulas from the end"s : " formulas from the start"s),
+                                std::cout);
+            if (batch)
+            {
+                sheet.BeginBatch();
+            }
+            for (size_t i = 0; i < formulas; ++i)
+            {
+                const size_t index = from_end ? formulas - i : i + 1;
+                sheet.SetCell(NthCell(index), "=" + NthCell(index - 1).ToString() + "+1");
+            }
+            if (batch)
+            {
+                sheet.Commit();
+            }
+        };
+        for (bool batch : {false, true})
+        {
+            load(forward, false, batch);
+            load(backward, true, batch);
+        }
+    }
+
+    // Тексты таблицы rows x cols в формате PrintTexts, где половина ячеек -
+    // числа, а половина - формулы от соседей слева и сверху
+    std::string GridTexts(int rows, int cols)
+    {
+        std::string texts;
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                if (col > 0)
+                {
+                    texts += '\t';
+                }
+                if (row == 0 || col % 2 == 0)
+                {
+                    texts += std::to_string(row + col);
+                }
+                else
+                {
+                    texts += "=(" + Position{row, col - 1}.ToString() + "+" + Position{row - 1, col}.ToString() + ")/2";
+                }
+            }
+            texts += '\n';
+        }
+        return texts;
+    }
+
+    // Загрузка таблицы GridTexts вызовами SetCell по одному и ImportTexts при
+    // разном числе потоков разбора
+    void ImportTexts(int rows = 1000, int cols = 1000)
+    {
+        const std::string texts = GridTexts(rows, cols);
+        const std::string cells = std::to_string(rows * cols) + " cells"s;
+
+        {
+            Sheet sheet;
+            LOG_DURATION_STREAM("SetCell, "s + cells, std::cout);
+            std::istringstream input(texts);
+            std::string line;
+            for (int row = 0; std::getline(input, line); ++row)
+            {
+                std::istringstream fields(line);
+                std::string text;
+                for (int col = 0; std::getline(fields, text, '\t'); ++col)
+                {
+                    sheet.SetCell({row, col}, text);
+                }
+            }
+        }
+        const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t threads = 1; threads <= cores; threads *= 2)
+        {
+            Sheet sheet;
+            LOG_DURATION_STREAM("ImportTexts, "s + cells + ", threads: "s + std::to_string(threads), std::cout);
+            std::istringstream input(texts);
+            sheet.ImportTexts(input, threads);
+        }
+    }
+
+    // Сохранение таблицы GridTexts в снимок и загрузка из него в сравнении с
+    // загрузкой текстов
+    void Snapshot(int rows = 1000, int cols = 1000)
+    {
+        const std::string texts = GridTexts(rows, cols);
+        const std::string cells = std::to_string(rows * cols) + " cells"s;
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench_snapshot.bin").string();
+        {
+            Sheet sheet;
+            {
+                LOG_DURATION_STREAM("ImportTexts, "s + cells, std::cout);
+                std::istringstream input(texts);
+                sheet.ImportTexts(input, 1);
+            }
+            LOG_DURATION_STREAM("SaveSnapshot, "s + cells, std::cout);
+            std::ofstream output(path, std::ios::binary);
+            sheet.SaveSnapshot(output);
+        }
+        std::cout << "snapshot size: "s << std::filesystem::file_size(path) << " bytes, texts: "s << texts.size()
+                  << " bytes"s << std::endl;
+        {
+            Sheet sheet;
+            LOG_DURATION_STREAM("LoadSnapshot, "s + cells, std::cout);
+            sheet.LoadSnapshot(path);
+        }
+        std::filesystem::remove(path);
+    }
+
+    // Скорость правок SetCell без журнала и с журналом при каждой политике
+    // записи на диск. С fsync на каждую правку их меньше: она в разы дороже
+    void EditLog(int edits = 200000, int synced_edits = 2000)
+    {
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench_edits.log").string();
+        auto run = [&path](const std::string &name, std::optional<EditLogOptions::Sync> sync, int count)
+        {
+            std::filesystem::remove(path);
+            Sheet sheet;
+            if (sync)
+            {
+                EditLogOptions options;
+                options.sync = *sync;
+                sheet.OpenLog(path, options);
+            }
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                // Число и формула от него попеременно в квадрате 100 x 100
+                Position pos{i / 2 % 100, i / 200 % 100 * 2 + i % 2};
+                sheet.SetCell(pos, i % 2 ? "=" + Position{pos.row, pos.col - 1}.ToString() + "*2" : std::to_string(i));
+            }
+            sheet.CloseLog();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << name << ": "s << static_cast<long long>(count / elapsed.count()) << " edits/s"s << std::endl;
+        };
+        run("no log"s, std::nullopt, edits);
+        run("log, no fsync"s, EditLogOptions::Sync::None, edits);
+        run("log, fsync per group"s, EditLogOptions::Sync::Group, edits);
+        run("log, fsync per edit"s, EditLogOptions::Sync::Always, synced_edits);
+        std::filesystem::remove(path);
+    }
+
+    // Вывод таблицы rows x cols из чисел, формул и текста в файл: по полосам
+    // на разном числе потоков и последовательно, в сравнении с записью в
+    // файл тех же байтов одним куском
+    void Print(int rows = 10000, int cols = 100)
+    {
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                Position pos{row, col};
+                switch (col % 4)
+                {
+                case 0:
+                    sheet.SetCell(pos, std::to_string(row * 0.37 + col));
+                    break;
+                case 1:
+                case 2:
+                    sheet.SetCell(pos, "=" + Position{row, col - 1}.ToString() + "/3+" + std::to_string(col));
+                    break;
+                default:
+                    sheet.SetCell(pos, "text " + std::to_string(row));
+                }
+            }
+        }
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench_print.txt").string();
+        const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t threads = 1; threads <= std::max<size_t>(cores, 2); threads *= 2)
+        {
+            for (bool texts : {false, true})
+            {
+                std::ofstream output(path, std::ios::binary);
+                LOG_DURATION_STREAM((texts ? "ExportTexts, "s : "ExportValues, "s) + std::to_string(rows * cols) +
+                                        " cells, threads: "s + std::to_string(threads),
+                                    std::cout);
+                texts ? sheet.ExportTexts(output, threads) : sheet.ExportValues(output, threads);
+            }
+        }
+        for (bool texts : {false, true})
+        {
+            const std::string name = texts ? "PrintTexts"s : "PrintValues"s;
+            std::string printed;
+            {
+                std::ofstream output(path, std::ios::binary);
+                LOG_DURATION_STREAM(name + ", "s + std::to_string(rows * cols) + " cells"s, std::cout);
+                texts ? sheet.PrintTexts(output) : sheet.PrintValues(output);
+            }
+            {
+                std::ostringstream output;
+                texts ? sheet.PrintTexts(output) : sheet.PrintValues(output);
+                printed = output.str();
+            }
+            std::ofstream output(path, std::ios::binary);
+            LOG_DURATION_STREAM("write of the same "s + std::to_string(printed.size()) + " bytes"s, std::cout);
+            output.write(printed.data(), static_cast<std::streamsize>(printed.size()));
+            output.flush();
+        }
+        std::filesystem::remove(path);
+    }
+
+    // Чтение значений формул из нескольких потоков, пока другой поток правит
+    // таблицу: через ReadValue и, для сравнения, через GetCell под общей
+    // блокировкой, которую правки берут монопольно
+    void ConcurrentReads(int cells = 100000, std::chrono::milliseconds duration = 500ms)
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 0; i < cells; ++i)
+        {
+            sheet.SetCell(NthCell(i), i % 100 == 0 ? "=A1+" + std::to_string(i) : "=" + std::to_string(i) + "/3");
+        }
+        sheet.EnableConcurrentReads();
+        std::shared_mutex mutex;
+        const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (bool locked : {false, true})
+        {
+            for (size_t threads = 1; threads <= std::max<size_t>(cores, 2); threads *= 2)
+            {
+                std::atomic<bool> done = false;
+                std::atomic<size_t> reads = 0;
+                size_t edits = 0;
+                std::vector<std::thread> readers;
+                for (size_t r = 0; r < threads; ++r)
+                {
+                    readers.emplace_back([&, r]
+                                         {
+                                             std::mt19937 random(static_cast<unsigned>(r));
+                                             size_t count = 0;
+                                             double sum = 0;
+                                             while (!done)
+                                             {
+                                                 const Position pos = NthCell(random() % cells);
+                                                 CellInterface::Value value;
+                                                 if (locked)
+                                                 {
+                                                     std::shared_lock lock(mutex);
+                                                     value = sheet.GetCell(pos)->GetValue();
+                                                 }
+                                                 else
+                                                 {
+                                                     value = sheet.ReadValue(pos);
+                                                 }
+                                                 sum += std::get<double>(value);
+                                                 ++count;
+                                             }
+                                             // Сумма не даёт компилятору выбросить чтение
+                                             reads += count + (sum < 0);
+                                         });
+                }
+                const auto start = std::chrono::steady_clock::now();
+                while (std::chrono::steady_clock::now() - start < duration)
+                {
+                    std::unique_lock lock(mutex, std::defer_lock);
+                    if (locked)
+                    {
+                        lock.lock();
+                    }
+                    sheet.SetCell("A1"_pos, std::to_string(++edits % 1000));
+                }
+                done = true;
+                for (auto &reader : readers)
+                {
+                    reader.join();
+                }
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << (locked ? "GetCell under a lock"s : "ReadValue"s) << ", readers: "s << threads << ": "s
+                          << static_cast<long long>(reads / elapsed.count()) << " reads/s, "s
+                          << static_cast<long long>(edits / elapsed.count()) << " edits/s"s << std::endl;
+            }
+        }
+    }
+
+    // Снимки Sheet::Snapshot: первый строит дерево видов, последующие стоят
+    // O(1). Правки сравниваются без снимков и со снимком перед каждой из них
+    void SheetSnapshots(int cells = 300000, int edits = 100000)
+    {
+        Sheet sheet;
+        for (int i = 0; i < cells; ++i)
+        {
+            sheet.SetCell(NthCell(i), i % 2 ? "=" + NthCell(i - 1).ToString() + "*2" : std::to_string(i));
+        }
+        auto edit = [&sheet, cells](int i)
+        {
+            sheet.SetCell(NthCell(static_cast<size_t>(i) * 7919 % cells / 2 * 2), std::to_string(i));
+        };
+        {
+            LOG_DURATION_STREAM(std::to_string(edits) + " edits without snapshots"s, std::cout);
+            for (int i = 0; i < edits; ++i)
+            {
+                edit(i);
+            }
+        }
+        {
+            LOG_DURATION_STREAM("first snapshot of "s + std::to_string(cells) + " cells"s, std::cout);
+            sheet.Snapshot();
+        }
+        {
+            LOG_DURATION_STREAM(std::to_string(edits) + " snapshots"s, std::cout);
+            for (int i = 0; i < edits; ++i)
+            {
+                sheet.Snapshot();
+            }
+        }
+        {
+            LOG_DURATION_STREAM(std::to_string(edits) + " edits, each after a snapshot"s, std::cout);
+            std::shared_ptr<const SheetView> view;
+            for (int i = 0; i < edits; ++i)
+            {
+                view = sheet.Snapshot();
+                edit(i);
+            }
+        }
+        {
+            LOG_DURATION_STREAM(std::to_string(edits) + " edits, snapshots kept, one per 1000 edits"s, std::cout);
+            std::vector<std::shared_ptr<const SheetView>> views;
+            for (int i = 0; i < edits; ++i)
+            {
+                if (i % 1000 == 0)
+                {
+                    views.push_back(sheet.Snapshot());
+                }
+                edit(i);
+            }
+        }
+    }
+
+    // Время SetCell ячейки, от которой зависят dependents формул, с
+    // синхронным и асинхронным пересчётом: среднее и худшее из edits правок
+    void AsyncRecalc(int edits = 200)
+    {
+        for (int dependents : {1000, 10000, 100000})
+        {
+            for (bool async : {false, true})
+            {
+                Sheet sheet;
+                sheet.SetCell("A1"_pos, "0");
+                for (int i = 0; i < dependents; ++i)
+                {
+                    sheet.SetCell(NthCell(i), "=A1+" + std::to_string(i));
+                }
+                sheet.SetAsyncRecalc(async);
+                std::chrono::duration<double, std::micro> total{0};
+                std::chrono::duration<double, std::micro> worst{0};
+                for (int i = 1; i <= edits; ++i)
+                {
+                    const auto start = std::chrono::steady_clock::now();
+                    sheet.SetCell("A1"_pos, std::to_string(i));
+                    const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                    total += elapsed;
+                    worst = std::max(worst, elapsed);
+                }
+                const auto start = std::chrono::steady_clock::now();
+                sheet.WaitForRecalc();
+                const std::chrono::duration<double, std::milli> drained = std::chrono::steady_clock::now() - start;
+                std::cout << (async ? "async"s : "sync"s) << ", dependents: "s << dependents << ": SetCell "s
+                          << static_cast<long long>(total.count() / edits) << " us on average, "s
+                          << static_cast<long long>(worst.count()) << " us at worst; then waited "s
+                          << static_cast<long long>(drained.count()) << " ms for recalculation"s << std::endl;
+            }
+        }
+    }
+
+    void ChangeNotifications(int edits = 100)
+    {
+        // Фронтенд узнаёт, что изменилось после правки: полным обходом
+        // таблицы или подпиской
+        for (int cells : {10000, 100000})
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "0");
+            for (int i = 0; i < cells; ++i)
+            {
+                sheet.SetCell(NthCell(i), i % 1000 == 0 ? "=A1+" + std::to_string(i) : std::to_string(i));
+            }
+            std::map<Position, CellInterface::Value> seen;
+            const Size size = sheet.GetPrintableSize();
+            size_t changed = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 1; i <= edits; ++i)
+            {
+                sheet.SetCell("A1"_pos, std::to_string(i));
+                for (int row = 0; row < size.rows; ++row)
+                {
+                    for (int col = 0; col < size.cols; ++col)
+                    {
+                        const Position pos{row, col};
+                        const CellInterface *cell = sheet.GetCell(pos);
+                        CellInterface::Value value = cell ? cell->GetValue() : CellInterface::Value();
+                        auto [it, inserted] = seen.try_emplace(pos, value);
+                        if (!inserted && !(it->second == value))
+                        {
+                            it->second = std::move(value);
+                            ++changed;
+                        }
+                    }
+                }
+            }
+            const std::chrono::duration<double, std::micro> rescan = std::chrono::steady_clock::now() - start;
+
+            size_t pushed = 0;
+            const size_t subscription = sheet.Subscribe([&pushed](const std::vector<Sheet::CellChange> &changes)
+                                                        { pushed += changes.size(); });
+            start = std::chrono::steady_clock::now();
+            for (int i = 1; i <= edits; ++i)
+            {
+                sheet.SetCell("A1"_pos, std::to_string(edits + i));
+            }
+            const std::chrono::duration<double, std::micro> subscribed = std::chrono::steady_clock::now() - start;
+            sheet.Unsubscribe(subscription);
+            std::cout << "cells: "s << cells << ": edit and rescan "s << static_cast<long long>(rescan.count() / edits)
+                      << " us (" << changed / edits << " changes), edit with subscription "s
+                      << static_cast<long long>(subscribed.count() / edits) << " us (" << pushed / edits
+                      << " changes)"s << std::endl;
+        }
+    }
+
+    void EarlyCutoff(int edits = 100)
+    {
+        // A1 -> B1 = A1*0 -> dependents зависимых B1. Правка A1 значения B1
+        // не меняет, правка B1 - меняет значения всех зависимых
+        for (int dependents : {1000, 10000, 100000})
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "0");
+            sheet.SetCell("B1"_pos, "=A1*0");
+            for (int i = 0; i < dependents; ++i)
+            {
+                sheet.SetCell(NthCell(i), "=B1+" + std::to_string(i));
+            }
+            for (const bool cut_off : {true, false})
+            {
+                size_t recalculated = 0;
+                const auto start = std::chrono::steady_clock::now();
+                for (int i = 1; i <= edits; ++i)
+                {
+                    if (cut_off)
+                    {
+                        sheet.SetCell("A1"_pos, std::to_string(i));
+                    }
+                    else
+                    {
+                        sheet.SetCell("B1"_pos, "=A1*0+" + std::to_string(i));
+                    }
+                    recalculated += sheet.GetLastRecalcCount();
+                }
+                const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << "dependents: "s << dependents << (cut_off ? ", unchanged B1: "s : ", changed B1: "s)
+                          << static_cast<long long>(elapsed.count() / edits) << " us per edit, "s
+                          << recalculated / edits << " formulas recalculated"s << std::endl;
+            }
+        }
+    }
+
+    void LazyRecalc(int edits = 100)
+    {
+        // Правка ячейки с dependents зависимыми и чтение одной из них
+        for (int dependents : {1000, 10000, 100000})
+        {
+            for (bool lazy : {false, true})
+            {
+                Sheet sheet;
+                sheet.SetCell("A1"_pos, "0");
+                for (int i = 0; i < dependents; ++i)
+                {
+                    sheet.SetCell(NthCell(i), "=A1+" + std::to_string(i));
+                }
+                sheet.SetLazyRecalc(lazy);
+                std::chrono::duration<double, std::micro> writes{0};
+                std::chrono::duration<double, std::micro> reads{0};
+                for (int i = 1; i <= edits; ++i)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    sheet.SetCell("A1"_pos, std::to_string(i));
+                    writes += std::chrono::steady_clock::now() - start;
+                    start = std::chrono::steady_clock::now();
+                    const CellInterface::Value value = sheet.GetCell(NthCell(i))->GetValue();
+                    reads += std::chrono::steady_clock::now() - start;
+                    if (!(value == CellInterface::Value(2.0 * i)))
+                    {
+                        std::cout << "wrong value"s << std::endl;
+                    }
+                }
+                const auto start = std::chrono::steady_clock::now();
+                std::ostringstream values;
+                sheet.PrintValues(values);
+                const std::chrono::duration<double, std::milli> printed = std::chrono::steady_clock::now() - start;
+                std::cout << (lazy ? "lazy"s : "eager"s) << ", dependents: "s << dependents << ": SetCell "s
+                          << static_cast<long long>(writes.count() / edits) << " us, read of a dependent "s
+                          << static_cast<long long>(reads.count() / edits) << " us on average; then printed in "s
+                          << static_cast<long long>(printed.count()) << " ms"s << std::endl;
+            }
+        }
+    }
+
+    void RangeRefs(int windows = 10000, int width = 100, int edits = 100)
+    {
+        // Скользящие суммы по width ячейкам столбца A: диапазоном и той же
+        // суммой, расписанной по ячейкам, у которой на каждую ячейку по ребру
+        for (const bool ranges : {true, false})
+        {
+            Sheet sheet;
+            for (int row = 0; row < windows + width; ++row)
+            {
+                sheet.SetCell({row, 0}, std::to_string(row % 7));
+            }
+            const size_t allocations = GetHeapAllocationCount();
+            auto start = std::chrono::steady_clock::now();
+            for (int row = 0; row < windows; ++row)
+            {
+                std::string text = "="s;
+                if (ranges)
+                {
+                    text += "SUM(" + Position{row, 0}.ToString() + ":" + Position{row + width - 1, 0}.ToString() + ")";
+                }
+                else
+                {
+                    for (int i = 0; i < width; ++i)
+                    {
+                        text += (i == 0 ? ""s : "+"s) + Position{row + i, 0}.ToString();
+                    }
+                }
+                sheet.SetCell({row, 2}, text);
+            }
+            const std::chrono::duration<double, std::milli> built = std::chrono::steady_clock::now() - start;
+            const size_t built_allocations = GetHeapAllocationCount() - allocations;
+
+            size_t recalculated = 0;
+            start = std::chrono::steady_clock::now();
+            for (int i = 1; i <= edits; ++i)
+            {
+                sheet.SetCell({windows / 2 + i % width, 0}, std::to_string(i));
+                recalculated += sheet.GetLastRecalcCount();
+            }
+            const std::chrono::duration<double, std::micro> written = std::chrono::steady_clock::now() - start;
+            std::cout << (ranges ? "ranges"s : "single cells"s) << ": "s << windows << " sums of "s << width
+                      << " cells built in "s << static_cast<long long>(built.count()) << " ms with "s
+                      << built_allocations << " allocations; SetCell "s
+                      << static_cast<long long>(written.count() / edits) << " us, "s << recalculated / edits
+                      << " formulas recalculated"s << std::endl;
+        }
+
+        // Одна формула над всей высотой листа и правки под ней
+        Sheet sheet;
+        sheet.SetCell("H1"_pos, "=SUM(A1:G16384)");
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < edits; ++i)
+        {
+            sheet.SetCell({1 + i * 97 % (Position::MAX_ROWS - 1), i % 7}, std::to_string(i));
+        }
+        const std::chrono::duration<double, std::micro> written = std::chrono::steady_clock::now() - start;
+        std::cout << "SUM(A1:G16384): SetCell "s << static_cast<long long>(written.count() / edits) << " us"s
+                  << std::endl;
+    }
+
+    void Run(const std::string &name)
+    {
+        const std::map<std::string, void (*)()> benchmarks = {
+            {"parallel_recalc", []
+             { ParallelRecalc(); }},
+            {"formula_execute", []
+             { FormulaExecute(); }},
+            {"error_cascade", []
+             { ErrorCascade(); }},
+            {"text_arguments", []
+             { TextArguments(); }},
+            {"cell_storage", []
+             { CellStorage(); }},
+            {"printable_size", []
+             { PrintableSize(); }},
+            {"edit_allocations", []
+             { EditAllocations(); }},
+            {"dependency_graph", []
+             { DependencyGraph(); }},
+            {"batch_load", []
+             { BatchLoad(); }},
+            {"import_texts", []
+             { ImportTexts(); }},
+            {"snapshot", []
+             { Snapshot(); }},
+            {"edit_log", []
+             { EditLog(); }},
+            {"print", []
+             { Print(); }},
+            {"concurrent_reads", []
+             { ConcurrentReads(); }},
+            {"sheet_snapshots", []
+             { SheetSnapshots(); }},
+            {"async_recalc", []
+             { AsyncRecalc(); }},
+            {"change_notifications", []
+             { ChangeNotifications(); }},
+            {"early_cutoff", []
+             { EarlyCutoff(); }},
+            {"lazy_recalc", []
+             { LazyRecalc(); }},
+            {"range_refs", []
+             { RangeRefs(); }},
+        };
+        for (const auto &[bench_name, bench] : benchmarks)
+        {
+            if (name.empty() || name == bench_name)
+            {
+                std::cout << "=== " << bench_name << " ===" << std::endl;
+                bench();
+            }
+        }
+    }
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    // Бенчмарки запускаются отдельно: spreadsheet --bench [имя]
+    if (argc > 1 && argv[1] == "--bench"s)
+    {
+        bench::Run(argc > 2 ? argv[2] : "");
+        return 0;
+    }
+
+    TestRunner tr;
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestMemoizedDiamond);
+    RUN_TEST(tr, TestMemoizedChain);
+    RUN_TEST(tr, TestReferencedValues);
+    RUN_TEST(tr, TestTextArguments);
+    RUN_TEST(tr, TestCellStorage);
+    RUN_TEST(tr, TestSparseCellMemory);
+    RUN_TEST(tr, TestPrintableSize);
+    RUN_TEST(tr, TestSteadyStateAllocations);
+    RUN_TEST(tr, TestLongChainRecalc);
+    RUN_TEST(tr, TestIncrementalCycleDetection);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestBatchCommit);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestFormulaBytecode);
+    RUN_TEST(tr, TestParallelRecalc);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestEditLog);
+    RUN_TEST(tr, TestPrintOutput);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestAsyncRecalc);
+    RUN_TEST(tr, TestChangeNotifications);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestLazyRecalc);
+    RUN_TEST(tr, TestRangeReferences);
+    RUN_TEST(tr, TestRangeRecalcModes);
+}
\ No newline at end of file
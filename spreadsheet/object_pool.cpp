@@ -0,0 +1,52 @@
+#include "object_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+FixedSizePool::FixedSizePool(size_t block_size)
+    // Блок должен вмещать указатель списка свободных
+    : block_size_((std::max(block_size, sizeof(FreeBlock)) + sizeof(Unit) - 1) / sizeof(Unit) * sizeof(Unit))
+{
+}
+
+void *FixedSizePool::Allocate()
+{
+    if (!free_)
+    {
+        const size_t units = block_size_ / sizeof(Unit);
+        chunks_.emplace_back(new Unit[units * BLOCKS_PER_CHUNK]);
+        Unit *chunk = chunks_.back().get();
+        // Блоки новой пачки выдаются по порядку адресов
+        for (size_t i = BLOCKS_PER_CHUNK; i-- > 0;)
+        {
+            free_ = new (chunk + i * units) FreeBlock{free_};
+        }
+    }
+    FreeBlock *block = free_;
+    free_ = block->next;
+    ++used_;
+    return block;
+}
+
+void FixedSizePool::Deallocate(void *block)
+{
+    assert(used_ > 0);
+    free_ = new (block) FreeBlock{free_};
+    --used_;
+}
+
+size_t FixedSizePool::GetBlockSize() const
+{
+    return block_size_;
+}
+
+size_t FixedSizePool::GetUsedCount() const
+{
+    return used_;
+}
+
+size_t FixedSizePool::GetChunkCount() const
+{
+    return chunks_.size();
+}
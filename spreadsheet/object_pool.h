@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Пул блоков памяти одного размера. Память берётся у кучи пачками по
+// BLOCKS_PER_CHUNK блоков и возвращается только при уничтожении пула:
+// освобождённый блок попадает в список свободных и отдаётся следующему
+// запросу. Объекты в блоках создаёт и уничтожает вызывающий код; к моменту
+// уничтожения пула все они должны быть уничтожены. Пул не потокобезопасен
+class FixedSizePool
+{
+public:
+    static constexpr size_t BLOCKS_PER_CHUNK = 256;
+
+    explicit FixedSizePool(size_t block_size);
+
+    FixedSizePool(const FixedSizePool &) = delete;
+    FixedSizePool &operator=(const FixedSizePool &) = delete;
+
+    void *Allocate();
+    void Deallocate(void *block);
+
+    size_t GetBlockSize() const;
+    // Число выданных и ещё не возвращённых блоков
+    size_t GetUsedCount() const;
+    // Сколько раз пул обращался к куче
+    size_t GetChunkCount() const;
+
+private:
+    // Свободный блок хранит указатель на следующий свободный
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+    // Единица, из которых состоят блоки: так каждый блок выровнен
+    // для любого объекта
+    struct alignas(std::max_align_t) Unit
+    {
+        unsigned char bytes[alignof(std::max_align_t)];
+    };
+
+    size_t block_size_;
+    std::vector<std::unique_ptr<Unit[]>> chunks_;
+    FreeBlock *free_ = nullptr;
+    size_t used_ = 0;
+};
@@ -0,0 +1,271 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+    // Приоритеты узлов детерминированы: одинаковые правки строят одинаковые
+    // деревья
+    std::uint32_t MixPriority(std::uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+} // namespace
+
+RangeIndex::RangeIndex()
+    : nodes_(1)
+{
+}
+
+void RangeIndex::Add(CellRange range, CellId formula)
+{
+    assert(range.IsValid());
+    auto [it, inserted] = rect_ids_.emplace(range, 0);
+    if (!inserted)
+    {
+        auto &formulas = rects_[it->second].formulas;
+        assert(std::find(formulas.begin(), formulas.end(), formula) == formulas.end());
+        formulas.push_back(formula);
+        return;
+    }
+
+    std::uint32_t rect;
+    if (free_rects_.empty())
+    {
+        rect = static_cast<std::uint32_t>(rects_.size());
+        rects_.emplace_back();
+    }
+    else
+    {
+        rect = free_rects_.back();
+        free_rects_.pop_back();
+    }
+    it->second = rect;
+    rects_[rect].range = range;
+    rects_[rect].formulas.assign(1, formula);
+
+    if (roots_.empty())
+    {
+        roots_.assign(2 * LEAVES, NIL);
+    }
+    ForEachCanonical(range, [this, rect](std::uint32_t &tree)
+                     { Insert(tree, rect); });
+}
+
+void RangeIndex::Remove(CellRange range, CellId formula)
+{
+    auto it = rect_ids_.find(range);
+    assert(it != rect_ids_.end());
+    const std::uint32_t rect = it->second;
+    auto &formulas = rects_[rect].formulas;
+    auto pos = std::find(formulas.begin(), formulas.end(), formula);
+    assert(pos != formulas.end());
+    *pos = formulas.back();
+    formulas.pop_back();
+    if (!formulas.empty())
+    {
+        return;
+    }
+
+    ForEachCanonical(range, [this, rect](std::uint32_t &tree)
+                     { Erase(tree, rect); });
+    formulas.shrink_to_fit();
+    free_rects_.push_back(rect);
+    rect_ids_.erase(it);
+}
+
+bool RangeIndex::IsEmpty() const
+{
+    return rect_ids_.empty();
+}
+
+void RangeIndex::FindCovering(Position pos, std::vector<CellId> &formulas) const
+{
+    ForEachCovering(pos, [this, &formulas](std::uint32_t rect)
+                    {
+                        const auto &rect_formulas = rects_[rect].formulas;
+                        formulas.insert(formulas.end(), rect_formulas.begin(), rect_formulas.end());
+                        return true; });
+}
+
+bool RangeIndex::Covers(Position pos) const
+{
+    bool covers = false;
+    ForEachCovering(pos, [&covers](std::uint32_t)
+                    {
+                        covers = true;
+                        return false; });
+    return covers;
+}
+
+size_t RangeIndex::GetRangeCount() const
+{
+    return rect_ids_.size();
+}
+
+size_t RangeIndex::GetMemoryUsage() const
+{
+    size_t usage = sizeof(*this) + roots_.capacity() * sizeof(std::uint32_t) + nodes_.capacity() * sizeof(Node) +
+                   free_nodes_.capacity() * sizeof(std::uint32_t) + rects_.capacity() * sizeof(Rect) +
+                   free_rects_.capacity() * sizeof(std::uint32_t);
+    for (const Rect &rect : rects_)
+    {
+        usage += rect.formulas.capacity() * sizeof(CellId);
+    }
+    // Узел std::map: значение и три указателя с цветом
+    usage += rect_ids_.size() * (sizeof(std::pair<const CellRange, std::uint32_t>) + 4 * sizeof(void *));
+    return usage;
+}
+
+template <typename Visit>
+void RangeIndex::ForEachCanonical(CellRange range, const Visit &visit)
+{
+    // Снизу вверх по полуинтервалу листов [l, r)
+    for (int l = range.first.row + LEAVES, r = range.last.row + LEAVES + 1; l < r; l >>= 1, r >>= 1)
+    {
+        if (l & 1)
+        {
+            visit(roots_[l++]);
+        }
+        if (r & 1)
+        {
+            visit(roots_[--r]);
+        }
+    }
+}
+
+template <typename Visit>
+bool RangeIndex::Stab(std::uint32_t tree, int col, const Visit &visit) const
+{
+    while (tree != NIL && nodes_[tree].max_last_col >= col)
+    {
+        const Node &node = nodes_[tree];
+        if (!Stab(node.left, col, visit))
+        {
+            return false;
+        }
+        if (node.first_col > col)
+        {
+            // Правее только интервалы, начинающиеся ещё дальше
+            return true;
+        }
+        if (node.last_col >= col && !visit(node.rect))
+        {
+            return false;
+        }
+        tree = node.right;
+    }
+    return true;
+}
+
+template <typename Visit>
+void RangeIndex::ForEachCovering(Position pos, const Visit &visit) const
+{
+    if (roots_.empty())
+    {
+        return;
+    }
+    for (int i = pos.row + LEAVES; i >= 1; i >>= 1)
+    {
+        if (!Stab(roots_[i], pos.col, visit))
+        {
+            return;
+        }
+    }
+}
+
+void RangeIndex::Insert(std::uint32_t &tree, std::uint32_t rect)
+{
+    std::uint32_t node;
+    if (free_nodes_.empty())
+    {
+        node = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    else
+    {
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+    }
+    const CellRange &range = rects_[rect].range;
+    Node &created = nodes_[node];
+    created = Node{};
+    created.first_col = range.first.col;
+    created.last_col = range.last.col;
+    created.max_last_col = range.last.col;
+    created.rect = rect;
+    created.priority = MixPriority(++priority_seed_);
+
+    std::uint32_t less;
+    std::uint32_t rest;
+    Split(tree, KeyOf(node), less, rest);
+    tree = Merge(Merge(less, node), rest);
+}
+
+void RangeIndex::Erase(std::uint32_t &tree, std::uint32_t rect)
+{
+    const Key key{rects_[rect].range.first.col, rect};
+    std::uint32_t less;
+    std::uint32_t rest;
+    Split(tree, key, less, rest);
+    std::uint32_t node;
+    std::uint32_t greater;
+    Split(rest, Key{key.first, key.second + 1}, node, greater);
+    assert(node != NIL && nodes_[node].left == NIL && nodes_[node].right == NIL);
+    free_nodes_.push_back(node);
+    tree = Merge(less, greater);
+}
+
+RangeIndex::Key RangeIndex::KeyOf(std::uint32_t node) const
+{
+    return {nodes_[node].first_col, nodes_[node].rect};
+}
+
+void RangeIndex::Update(std::uint32_t node)
+{
+    Node &n = nodes_[node];
+    n.max_last_col = std::max({n.last_col, nodes_[n.left].max_last_col, nodes_[n.right].max_last_col});
+}
+
+void RangeIndex::Split(std::uint32_t tree, Key key, std::uint32_t &less, std::uint32_t &rest)
+{
+    if (tree == NIL)
+    {
+        less = rest = NIL;
+        return;
+    }
+    if (KeyOf(tree) < key)
+    {
+        Split(nodes_[tree].right, key, nodes_[tree].right, rest);
+        less = tree;
+    }
+    else
+    {
+        Split(nodes_[tree].left, key, less, nodes_[tree].left);
+        rest = tree;
+    }
+    Update(tree);
+}
+
+std::uint32_t RangeIndex::Merge(std::uint32_t left, std::uint32_t right)
+{
+    if (left == NIL || right == NIL)
+    {
+        return left == NIL ? right : left;
+    }
+    if (nodes_[left].priority > nodes_[right].priority)
+    {
+        nodes_[left].right = Merge(nodes_[left].right, right);
+        Update(left);
+        return left;
+    }
+    nodes_[right].left = Merge(left, nodes_[right].left);
+    Update(right);
+    return right;
+}
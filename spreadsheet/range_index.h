@@ -0,0 +1,107 @@
+#pragma once
+
+#include "common.h"
+#include "dependency_graph.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Диапазоны, на которые ссылаются формулы таблицы. Формула зависит от
+// каждой ячейки своего диапазона, но рёбер к ним не заводит: по позиции
+// изменённой ячейки индекс находит формулы, чьи диапазоны её накрывают.
+//
+// Индекс - дерево отрезков над строками листа, в каждом узле которого лежит
+// дерево интервалов над столбцами (декартово дерево по левому краю,
+// дополненное наибольшим правым краем поддерева). Диапазон раскладывается
+// на O(log R) канонических узлов своих строк и попадает в дерево каждого
+// из них. Поиск проходит путь от листа строки к корню и в каждом узле на
+// пути ищет интервалы, содержащие столбец: O(log R * log n + k) для k
+// найденных диапазонов. Одинаковые диапазоны разных формул хранятся один
+// раз вместе со списком формул
+class RangeIndex
+{
+public:
+    using CellId = DependencyGraph::CellId;
+
+    RangeIndex();
+
+    // Добавляет ссылку формулы formula на диапазон range. Одна формула
+    // ссылается на один диапазон не больше одного раза
+    void Add(CellRange range, CellId formula);
+    // Удаляет ранее добавленную ссылку
+    void Remove(CellRange range, CellId formula);
+
+    bool IsEmpty() const;
+    // Дописывает в formulas формулы, диапазоны которых содержат pos.
+    // Формула с несколькими такими диапазонами попадает туда несколько раз
+    void FindCovering(Position pos, std::vector<CellId> &formulas) const;
+    // Накрыта ли pos хотя бы одним диапазоном
+    bool Covers(Position pos) const;
+
+    // Число различных диапазонов
+    size_t GetRangeCount() const;
+    // Память под деревья и списки формул, в байтах
+    size_t GetMemoryUsage() const;
+
+private:
+    // Узел дерева интервалов одного узла дерева отрезков
+    struct Node
+    {
+        int first_col = 0;
+        int last_col = 0;
+        // Наибольший last_col в поддереве
+        int max_last_col = -1;
+        std::uint32_t rect = 0;
+        std::uint32_t priority = 0;
+        std::uint32_t left = NIL;
+        std::uint32_t right = NIL;
+    };
+
+    struct Rect
+    {
+        CellRange range;
+        std::vector<CellId> formulas;
+    };
+
+    // Ключ узла: левый край и номер диапазона, чтобы ключи не совпадали
+    using Key = std::pair<int, std::uint32_t>;
+
+    // Нулевой узел - общий пустой лист
+    static constexpr std::uint32_t NIL = 0;
+    // Листы дерева отрезков - строки листа
+    static constexpr int LEAVES = Position::MAX_ROWS;
+
+    // Вызывает visit(rect, tree) для каждого канонического узла строк
+    // диапазона; tree - корень дерева интервалов узла
+    template <typename Visit>
+    void ForEachCanonical(CellRange range, const Visit &visit);
+    // Вызывает visit(rect) для каждого диапазона дерева tree, содержащего
+    // столбец col, пока visit не вернёт false
+    template <typename Visit>
+    bool Stab(std::uint32_t tree, int col, const Visit &visit) const;
+    // Обходит диапазоны, накрывающие pos, пока visit не вернёт false
+    template <typename Visit>
+    void ForEachCovering(Position pos, const Visit &visit) const;
+
+    void Insert(std::uint32_t &tree, std::uint32_t rect);
+    void Erase(std::uint32_t &tree, std::uint32_t rect);
+    Key KeyOf(std::uint32_t node) const;
+    void Update(std::uint32_t node);
+    // Делит дерево на узлы с ключами меньше key и остальные
+    void Split(std::uint32_t tree, Key key, std::uint32_t &less, std::uint32_t &rest);
+    // Сливает деревья, все ключи left которых меньше ключей right
+    std::uint32_t Merge(std::uint32_t left, std::uint32_t right);
+
+    // Корни деревьев интервалов узлов дерева отрезков; заводятся при
+    // первом диапазоне
+    std::vector<std::uint32_t> roots_;
+    std::vector<Node> nodes_;
+    std::vector<std::uint32_t> free_nodes_;
+    std::vector<Rect> rects_;
+    std::vector<std::uint32_t> free_rects_;
+    std::map<CellRange, std::uint32_t> rect_ids_;
+    std::uint32_t priority_seed_ = 0;
+};
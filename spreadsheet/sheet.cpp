@@ -2,15 +2,45 @@
 
 #include "cell.h"
 #include "common.h"
+#include "snapshot.h"
 
 #include <algorithm> // Для std::max и std::distance
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <exception>
+#include <filesystem>
+#include <fstream>
 #include <optional>
+#include <stdexcept>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+Sheet::Sheet() : impl_pool_(Cell::GetImplBlockSize(false)), formula_impl_pool_(Cell::GetImplBlockSize(true))
+{
+}
+
+Sheet::~Sheet()
+{
+    SetAsyncRecalc(false);
+}
+
+Sheet::WriteLock::WriteLock(Sheet &sheet) : sheet_(sheet), lock_(sheet.write_mutex_, std::defer_lock)
+{
+    ++sheet.waiting_writers_;
+    lock_.lock();
+    if (--sheet.waiting_writers_ == 0 && sheet.IsAsyncRecalc())
+    {
+        sheet.writers_cv_.notify_all();
+    }
+}
+
+Sheet::WriteLock::~WriteLock()
+{
+    sheet_.DeliverChanges(lock_);
+}
 
 void Sheet::SetCell(Position pos, std::string text)
 {
@@ -18,37 +48,53 @@ void Sheet::SetCell(Position pos, std::string text)
     {
         throw InvalidPositionException("Invalid position"s);
     }
-    auto cell = cells_.find(pos);
-    if (cell == cells_.end())
+    WriteLock lock(*this);
+    if (batch_)
     {
-        cells_.emplace(pos, std::make_unique<Cell>(*this));
-        cells_[pos]->Set(text);
+        batch_->emplace_back(pos, std::move(text));
+        return;
     }
-    else
+    // Правка остаётся в журнале, только если удалась
+    EditLogTransaction logged(log_.get());
+    logged.Append(pos, text);
+    std::vector<BatchEdit> undo;
+    SaveUndo(undo, pos);
+    const bool is_formula = Cell::IsFormulaText(text);
+    Cell *cell = cells_.Find(pos);
+    const bool was_empty = !cell || cell->IsEmpty();
+    if (!cell)
     {
-        if (!cells_.at(pos)->GetDependedCells().empty())
-        {
-            cells_.at(pos)->InvalidateCache();
-        }
-        // Сохраняем указатель на оригинальную ячейку
-        // auto old_cell = std::move(cells_.at(pos));
-        // cells_.erase(pos);
-        // cells_.emplace(pos, std::make_unique<Cell>(*this));
+        cell = cells_.Emplace(*this, pos);
         try
         {
-            cells_[pos]->Set(text);
+            cell->Set(std::move(text));
         }
-        catch (const CircularDependencyException &)
+        catch (...)
         {
-            // Если была попытка создать цикл, откатываем изменения
-            // cells_.erase(pos);
-            // cells_.emplace(pos, std::move(old_cell));
+            // Некорректная формула не должна оставлять после себя пустую ячейку
+            cells_.Erase(pos);
             throw;
         }
     }
-    // if ((pos.row < cells_.size()) && (pos.col < cells_[pos.row].size()))
-    // {
-    // }
+    else
+    {
+        cell->Set(std::move(text));
+    }
+    UpdatePrintableArea(pos, was_empty, cell->IsEmpty());
+    if (recalc_thread_.joinable())
+    {
+        // Формула могла переставить ячейки, на которые ссылается
+        MarkStale(cell, is_formula);
+    }
+    else if (lazy_recalc_)
+    {
+        MarkEdited(cell);
+    }
+    else
+    {
+        Recalculate(cell);
+    }
+    CommitLogged(logged, std::move(undo));
 }
 
 const CellInterface *Sheet::GetCell(Position pos) const
@@ -57,8 +103,7 @@ const CellInterface *Sheet::GetCell(Position pos) const
     {
         throw InvalidPositionException("Invalid position"s);
     }
-    auto it = cells_.find(pos);
-    return it == cells_.end() ? nullptr : it->second.get();
+    return cells_.Find(pos);
 }
 
 CellInterface *Sheet::GetCell(Position pos)
@@ -67,8 +112,7 @@ CellInterface *Sheet::GetCell(Position pos)
     {
         throw InvalidPositionException("Invalid position"s);
     }
-    auto it = cells_.find(pos);
-    return it == cells_.end() ? nullptr : it->second.get();
+    return cells_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos)
@@ -77,124 +121,1576 @@ void Sheet::ClearCell(Position pos)
     {
         throw InvalidPositionException("Invalid position"s);
     }
-    // if (static_cast<size_t>(pos.row) < cells_.size() && static_cast<size_t>(pos.col) < cells_[pos.row].size())
-    // {
-    // cells_[pos.row][pos.col].reset();
-    if (cells_[pos])
+    WriteLock lock(*this);
+    if (batch_)
+    {
+        batch_->emplace_back(pos, std::nullopt);
+        return;
+    }
+    Cell *cell = cells_.Find(pos);
+    if (!cell)
+    {
+        return;
+    }
+    EditLogTransaction logged(log_.get());
+    logged.Append(pos, std::nullopt);
+    std::vector<BatchEdit> undo;
+    SaveUndo(undo, pos);
+    const bool was_empty = cell->IsEmpty();
+    cell->Clear();
+    UpdatePrintableArea(pos, was_empty, true);
+    if (recalc_thread_.joinable())
+    {
+        MarkStale(cell, false);
+    }
+    else if (lazy_recalc_)
+    {
+        MarkEdited(cell);
+    }
+    else
+    {
+        Recalculate(cell);
+    }
+    CommitLogged(logged, std::move(undo));
+    // Ячейку, на которую ссылаются формулы, оставляем пустой: на неё
+    // указывают их списки зависимостей. Ячейка в диапазоне формулы
+    // остаётся и тогда, когда её правку ещё обработает отложенный пересчёт
+    const bool deferred = recalc_thread_.joinable() || lazy_recalc_;
+    if (!cell->IsReferenced() && !(deferred && range_index_.Covers(pos)))
+    {
+        stale_cells_.erase(pos);
+        lazy_edits_.erase(pos);
+        cells_.Erase(pos);
+    }
+}
+
+void Sheet::BeginBatch()
+{
+    WriteLock lock(*this);
+    if (batch_)
+    {
+        throw std::logic_error("Batch is already open"s);
+    }
+    batch_.emplace();
+}
+
+void Sheet::Commit()
+{
+    WriteLock lock(*this);
+    if (!batch_)
+    {
+        throw std::logic_error("No batch to commit"s);
+    }
+    FinishRecalc();
+    std::vector<BatchEdit> edits = std::move(*batch_);
+    batch_.reset();
+    EditLogTransaction logged(log_.get());
+    std::vector<BatchEdit> undo;
+    for (const auto &[pos, text] : edits)
+    {
+        logged.Append(pos, text);
+        SaveUndo(undo, pos);
+    }
+    ApplyBatch(std::move(edits));
+    CommitLogged(logged, std::move(undo));
+}
+
+void Sheet::Rollback()
+{
+    WriteLock lock(*this);
+    batch_.reset();
+}
+
+bool Sheet::IsInBatch() const
+{
+    return batch_.has_value();
+}
+
+void Sheet::OpenLog(const std::string &path, EditLogOptions options)
+{
+    WriteLock lock(*this);
+    if (log_)
+    {
+        throw std::logic_error("Edit log is already open"s);
+    }
+    log_ = std::make_unique<EditLog>(path, options);
+}
+
+void Sheet::CloseLog()
+{
+    WriteLock lock(*this);
+    if (log_)
+    {
+        log_->Flush();
+        log_.reset();
+    }
+}
+
+void Sheet::FlushLog()
+{
+    WriteLock lock(*this);
+    if (log_)
+    {
+        log_->Flush();
+    }
+}
+
+const EditLog *Sheet::GetLog() const
+{
+    return log_.get();
+}
+
+void Sheet::Checkpoint(const std::string &snapshot_path)
+{
+    WriteLock lock(*this);
+    // В снимок попадают только пересчитанные значения
+    FinishRecalc();
+    // Снимок сначала целиком ложится на диск рядом и только потом занимает
+    // место прежнего. Сбой до очистки журнала оставляет новый снимок с
+    // прежним журналом, что при восстановлении даёт то же состояние
+    const std::string temporary = snapshot_path + ".tmp"s;
     {
-        if (cells_[pos]->GetDependedCells().empty())
+        std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+        if (!output)
         {
-            cells_.erase(pos);
+            throw SnapshotException("Cannot create snapshot "s + temporary);
         }
-        else
+        WriteSnapshot(output);
+        output.close();
+        if (!output)
         {
-            cells_[pos]->Clear();
+            throw SnapshotException("Cannot write snapshot "s + temporary);
         }
     }
-    // }
+    SyncPath(temporary);
+    std::filesystem::rename(temporary, snapshot_path);
+    const std::filesystem::path directory = std::filesystem::absolute(snapshot_path).parent_path();
+    SyncPath(directory.string());
+    if (log_)
+    {
+        log_->Reset();
+    }
 }
 
-Size Sheet::GetPrintableSize() const
+void Sheet::Recover(const std::string &snapshot_path, const std::string &log_path)
 {
-    Size size{0, 0};
-    for (const auto &[pos, cell_ptr] : cells_)
+    WriteLock lock(*this);
+    if (log_)
+    {
+        throw std::logic_error("Cannot recover while the edit log is open"s);
+    }
+    if (std::filesystem::exists(snapshot_path))
+    {
+        ReadSnapshot(snapshot_path);
+    }
+    else if (cells_.GetSize() != 0 || batch_)
+    {
+        throw std::logic_error("Can only recover into an empty sheet"s);
+    }
+    std::vector<BatchEdit> edits = EditLog::Read(log_path);
+    if (!edits.empty())
+    {
+        FinishRecalc();
+        ApplyBatch(std::move(edits));
+    }
+}
+
+void Sheet::ApplyBatch(std::vector<BatchEdit> edits)
+{
+    // Остаётся последняя правка каждой ячейки
+    std::stable_sort(edits.begin(), edits.end(), [](const BatchEdit &lhs, const BatchEdit &rhs)
+                     { return lhs.first < rhs.first; });
+    auto last = std::unique(edits.rbegin(), edits.rend(), [](const BatchEdit &lhs, const BatchEdit &rhs)
+                            { return lhs.first == rhs.first; });
+    edits.erase(edits.begin(), last.base());
+
+    const std::int64_t first_order = first_order_;
+    const std::int64_t last_order = last_order_;
+    std::vector<Position> positions;
+    positions.reserve(edits.size());
+    for (const auto &[pos, text] : edits)
+    {
+        positions.push_back(pos);
+    }
+
+    // Разбор всех формул до первого изменения ячеек
+    std::vector<Cell *> cells;
+    std::vector<Cell::Content> contents;
+    std::vector<bool> was_empty;
+    cells.reserve(edits.size());
+    contents.reserve(edits.size());
+    try
     {
-        if (cell_ptr && !cell_ptr->GetText().empty())
+        for (auto &[pos, text] : edits)
         {
-            size.rows = std::max(size.rows, pos.row + 1);
-            size.cols = std::max(size.cols, pos.col + 1);
+            Cell *cell = cells_.Find(pos);
+            was_empty.push_back(!cell || cell->IsEmpty());
+            cell = cell ? cell : cells_.Emplace(*this, pos);
+            cells.push_back(cell);
+            contents.emplace_back(*cell, text ? std::move(*text) : std::string());
         }
     }
+    catch (...)
+    {
+        contents.clear();
+        EraseCreatedCells(positions, first_order, last_order);
+        throw;
+    }
 
-    return size;
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        cells[i]->Swap(contents[i]);
+    }
+    if (!RecalculateEdited(cells))
+    {
+        // Прежнее содержимое возвращается вместе со ссылками; ячейки, на
+        // которые ссылались только новые формулы, удаляются
+        for (size_t i = cells.size(); i-- > 0;)
+        {
+            cells[i]->Swap(contents[i]);
+        }
+        for (const Cell::Content &content : contents)
+        {
+            EraseCreatedCells(content.GetReferencedCells(), first_order, last_order);
+        }
+        contents.clear();
+        EraseCreatedCells(positions, first_order, last_order);
+        throw CircularDependencyException("Circular dependency detected"s);
+    }
+    contents.clear();
+
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        UpdatePrintableArea(positions[i], was_empty[i], cells[i]->IsEmpty());
+        if (!edits[i].second && !cells[i]->IsReferenced())
+        {
+            cells_.Erase(positions[i]);
+        }
+    }
 }
 
-void Sheet::PrintValues(std::ostream &output) const
+void Sheet::SaveUndo(std::vector<BatchEdit> &undo, Position pos) const
+{
+    if (!log_)
+    {
+        return;
+    }
+    const Cell *cell = cells_.Find(pos);
+    undo.emplace_back(pos, cell && !cell->IsEmpty() ? std::optional(cell->GetText()) : std::nullopt);
+}
+
+void Sheet::CommitLogged(EditLogTransaction &logged, std::vector<BatchEdit> undo)
 {
-    // Size size = GetPrintableSize();
-    // for (int i = 0; i < size.rows; ++i)
-    // {
-    //     for (int j = 0; j < size.cols; ++j)
-    //     {
-    //         if (i < static_cast<int>(cells_.size()) && j < static_cast<int>(cells_[i].size()) && cells_[i][j])
-    //         {
-    //             auto value = cells_[i][j]->GetValue();
-    //             std::visit([&output](auto &&arg)
-    //                        {
-    //                 if constexpr (std::is_same_v<std::decay_t<decltype(arg)>, FormulaError>) {
-    //                     output << "#ARITHM!";
-    //                 } else {
-    //                     output << arg;
-    //                 } }, value);
-    //         }
-    //         if (j < size.cols - 1)
-    //         {
-    //             output << '\t';
-    //         }
-    //     }
-    //     output << '\n';
-    // }
-
-    Size size = GetPrintableSize();
-    for (int i = 0; i < size.rows; ++i)
-    {
-        for (int j = 0; j < size.cols; ++j)
-        {
-            Position pos{i, j};
-            auto cell = GetCell(pos);
-            if (cell)
-            {
-                CellInterface::Value value = cell->GetValue();
-                std::visit(
-                    [&output](const auto &arg)
+    try
+    {
+        logged.Commit();
+    }
+    catch (const EditLogException &)
+    {
+        // Прежние тексты были корректны вместе, поэтому откат не находит
+        // циклов, а слушатели не увидят изменений отменённой правки
+        FinishRecalc();
+        ApplyBatch(std::move(undo));
+        throw;
+    }
+}
+
+void Sheet::ImportTexts(std::istream &input, size_t threads)
+{
+    WriteLock lock(*this);
+    if (batch_)
+    {
+        throw std::logic_error("Cannot import into an open batch"s);
+    }
+    FinishRecalc();
+    // Поля читаются порциями по IMPORT_CHUNK ячеек: формулы порции
+    // разбираются параллельно, после чего ячейки заполняются по порядку
+    const size_t IMPORT_CHUNK = 1 << 14;
+    const size_t PARSE_CHUNK = 256;
+
+    const std::int64_t first_order = first_order_;
+    const std::int64_t last_order = last_order_;
+    // Изменённые загрузкой ячейки; у существовавших до неё хранится прежнее
+    // содержимое для отката
+    struct Imported
+    {
+        Cell *cell;
+        std::optional<Cell::Content> old;
+        bool was_empty;
+    };
+    std::vector<Imported> imported;
+    EditLogTransaction logged(log_.get());
+    std::vector<BatchEdit> undo;
+    auto rollback = [&]
+    {
+        std::vector<Position> created;
+        for (auto it = imported.rbegin(); it != imported.rend(); ++it)
+        {
+            Cell *cell = it->cell;
+            for (Position pos : cell->GetReferencedCells())
+            {
+                created.push_back(pos);
+            }
+            const bool is_empty = cell->IsEmpty();
+            if (it->old)
+            {
+                cell->Swap(*it->old);
+            }
+            else
+            {
+                Cell::Content empty(*cell, std::string());
+                cell->Swap(empty);
+                created.push_back(cell->pos_);
+            }
+            UpdatePrintableArea(cell->pos_, is_empty, it->was_empty);
+        }
+        imported.clear();
+        EraseCreatedCells(created, first_order, last_order);
+    };
+
+    std::unique_ptr<ThreadPool> pool = threads > 1 ? std::make_unique<ThreadPool>(threads) : nullptr;
+    std::vector<std::pair<Position, std::string>> fields;
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    std::vector<std::exception_ptr> errors;
+    auto parse = [&fields, &formulas, &errors](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const std::string &text = fields[i].second;
+            if (!Cell::IsFormulaText(text))
+            {
+                continue;
+            }
+            // Задачи пула не бросают исключений: ошибка передаётся вызывающему
+            try
+            {
+                formulas[i] = ParseFormula(text.substr(1));
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::string line;
+    int row = 0;
+    bool more = true;
+    try
+    {
+        while (more)
+        {
+            fields.clear();
+            while (fields.size() < IMPORT_CHUNK && (more = static_cast<bool>(std::getline(input, line))))
+            {
+                int col = 0;
+                for (size_t begin = 0; begin <= line.size(); ++col)
+                {
+                    size_t end = std::min(line.find('\t', begin), line.size());
+                    if (end > begin)
                     {
-                        if constexpr (std::is_same_v<std::decay_t<decltype(arg)>, FormulaError>)
-                        {
-                            output << "#ARITHM!";
-                        }
-                        else
+                        Position pos{row, col};
+                        if (!pos.IsValid())
                         {
-                            output << arg;
+                            throw InvalidPositionException("Invalid position"s);
                         }
-                    },
-                    value);
+                        fields.emplace_back(pos, line.substr(begin, end - begin));
+                    }
+                    begin = end + 1;
+                }
+                ++row;
+            }
+
+            formulas.clear();
+            formulas.resize(fields.size());
+            errors.assign(fields.size(), nullptr);
+            if (pool)
+            {
+                pool->ParallelFor(fields.size(), PARSE_CHUNK, parse);
+            }
+            else
+            {
+                parse(0, fields.size());
+            }
+            for (const auto &error : errors)
+            {
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
             }
-            if (j < size.cols - 1)
+
+            for (size_t i = 0; i < fields.size(); ++i)
             {
-                output << '\t';
+                auto &[pos, text] = fields[i];
+                logged.Append(pos, text);
+                SaveUndo(undo, pos);
+                Cell *cell = cells_.Find(pos);
+                const bool was_empty = !cell || cell->IsEmpty();
+                const bool existed = cell != nullptr;
+                if (!existed)
+                {
+                    cell = cells_.Emplace(*this, pos);
+                }
+                auto content = formulas[i] ? Cell::Content(*cell, std::move(formulas[i]))
+                                           : Cell::Content(*cell, std::move(text));
+                cell->Swap(content);
+                imported.push_back({cell, existed ? std::optional(std::move(content)) : std::nullopt, was_empty});
+                UpdatePrintableArea(pos, was_empty, cell->IsEmpty());
             }
         }
-        output << '\n';
     }
+    catch (...)
+    {
+        rollback();
+        throw;
+    }
+
+    std::vector<Cell *> cells;
+    cells.reserve(imported.size());
+    for (const Imported &entry : imported)
+    {
+        cells.push_back(entry.cell);
+    }
+    if (!RecalculateEdited(cells))
+    {
+        rollback();
+        throw CircularDependencyException("Circular dependency detected"s);
+    }
+    CommitLogged(logged, std::move(undo));
 }
 
-void Sheet::PrintTexts(std::ostream &output) const
+void Sheet::EraseCreatedCells(const std::vector<Position> &positions, std::int64_t first_order,
+                              std::int64_t last_order)
+{
+    // Ячейки, созданные после запоминания границ, получили номера вне них
+    for (Position pos : positions)
+    {
+        const Cell *cell = cells_.Find(pos);
+        if (cell && (cell->order_ < first_order || cell->order_ > last_order) && !cell->IsReferenced())
+        {
+            cells_.Erase(pos);
+        }
+    }
+}
+
+bool Sheet::RecalculateEdited(const std::vector<Cell *> &cells)
+{
+    if (!SortDirtyCells(cells, dirty_))
+    {
+        return false;
+    }
+    // Затронутые ячейки переносятся в конец порядка: ссылки на них извне
+    // ведут из ячеек с меньшими номерами
+    for (Cell *cell : dirty_)
+    {
+        cell->order_ = ++last_order_;
+    }
+    last_recalc_count_ = 0;
+    RecalculateSorted(cells);
+    evaluation_count_ += last_recalc_count_;
+    return true;
+}
+
+void Sheet::RecalculateSorted(const std::vector<Cell *> &roots, Cell *recalculated)
+{
+    // Пересчитываются roots и ячейки, у которых изменилось значение хотя бы
+    // одной ссылки: изменившиеся помечаются номером changed
+    const std::uint64_t outdated = ++traversal_mark_;
+    for (Cell *cell : roots)
+    {
+        cell->mark_ = outdated;
+    }
+    const std::uint64_t changed = ++traversal_mark_;
+    if (recalculated)
+    {
+        recalculated->mark_ = changed;
+    }
+    for (Cell *cell : dirty_)
+    {
+        if (cell == recalculated || (cell->mark_ != outdated && !HasChangedRefs(*cell, changed)))
+        {
+            continue;
+        }
+        NoteChange(*cell);
+        if (Reevaluate(*cell, last_recalc_count_))
+        {
+            cell->mark_ = changed;
+        }
+        PublishCell(*cell);
+    }
+}
+
+bool Sheet::SortDirtyCells(const std::vector<Cell *> &roots, std::vector<Cell *> &order)
 {
-    Size size = GetPrintableSize();
-    for (int i = 0; i < size.rows; ++i)
+    // Сначала собираем ячейки, зависящие от roots, затем упорядочиваем их
+    // алгоритмом Кана: ячейка выходит, когда вышли все её ссылки из этого
+    // множества. Ячейки цикла не выходят никогда
+    const std::uint64_t mark = ++traversal_mark_;
+    std::vector<Cell *> stack;
+    std::vector<Cell *> dirty;
+    std::vector<Cell *> deps;
+    // Зависимые ячейки: из графа и формулы, диапазоны которых её содержат
+    auto get_deps = [this, &deps](const Cell *cell) -> const std::vector<Cell *> &
+    {
+        deps.clear();
+        for (auto id : graph_.GetDeps(cell->id_))
+        {
+            deps.push_back(graph_.GetCell(id));
+        }
+        cell->AppendRangeDependents(deps);
+        return deps;
+    };
+    for (Cell *root : roots)
+    {
+        if (root->mark_ != mark)
+        {
+            root->mark_ = mark;
+            stack.push_back(root);
+        }
+    }
+    while (!stack.empty())
     {
-        for (int j = 0; j < size.cols; ++j)
+        Cell *cell = stack.back();
+        stack.pop_back();
+        dirty.push_back(cell);
+        for (Cell *dep : get_deps(cell))
         {
-            Position pos{i, j};
-            auto cell = GetCell(pos);
-            if (cell)
+            if (dep->mark_ != mark)
             {
-                output << cell->GetText();
+                dep->mark_ = mark;
+                stack.push_back(dep);
             }
-            if (j < size.cols - 1)
+        }
+    }
+
+    // Число ещё не вышедших ссылок каждой ячейки множества, по номеру узла.
+    // После упорядочивания без цикла все счётчики снова нулевые
+    pending_refs_.resize(graph_.GetNodeCount());
+    for (const Cell *cell : dirty)
+    {
+        for (const Cell *dep : get_deps(cell))
+        {
+            ++pending_refs_[dep->id_];
+        }
+    }
+    order.clear();
+    for (Cell *cell : dirty)
+    {
+        if (pending_refs_[cell->id_] == 0)
+        {
+            order.push_back(cell);
+        }
+    }
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        for (Cell *dep : get_deps(order[i]))
+        {
+            if (--pending_refs_[dep->id_] == 0)
             {
-                output << "\t";
+                order.push_back(dep);
             }
-            // else
-            // {
-            //     output << "\t";
-            // }
-            // if (j < size.rows - 1)
-            // {
-            //     output << "\t";
-            // }
         }
-        output << "\n";
+    }
+    if (order.size() != dirty.size())
+    {
+        for (const Cell *cell : dirty)
+        {
+            pending_refs_[cell->id_] = 0;
+        }
+        return false;
+    }
+    return true;
+}
+
+Size Sheet::GetPrintableSize() const
+{
+    Size size{0, 0};
+    if (!row_counts_.empty())
+    {
+        size.rows = row_counts_.rbegin()->first + 1;
+        size.cols = col_counts_.rbegin()->first + 1;
+    }
+    return size;
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool was_empty, bool is_empty)
+{
+    if (was_empty == is_empty)
+    {
+        return;
+    }
+    auto update = [is_empty](std::map<int, size_t> &counts, int index)
+    {
+        if (!is_empty)
+        {
+            ++counts[index];
+            return;
+        }
+        auto it = counts.find(index);
+        if (--it->second == 0)
+        {
+            counts.erase(it);
+        }
+    };
+    update(row_counts_, pos.row);
+    update(col_counts_, pos.col);
+}
+
+void Sheet::PrintValues(std::ostream &output) const
+{
+    PrintCells(output, false);
+}
+
+void Sheet::PrintTexts(std::ostream &output) const
+{
+    PrintCells(output, true);
+}
+
+void Sheet::PrintCells(std::ostream &output, bool texts) const
+{
+    auto lock = LockValues();
+    if (!texts)
+    {
+        VerifyEdited();
+    }
+    // Буфер живёт между вызовами, так что печать не выделяет памяти
+    static thread_local std::string buffer;
+    buffer.clear();
+    const Size size = GetPrintableSize();
+    PrintRows(&output, buffer, 0, size.rows, size, texts);
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    buffer.clear();
+}
+
+void Sheet::ExportValues(std::ostream &output, size_t threads) const
+{
+    ExportCells(output, false, threads);
+}
+
+void Sheet::ExportTexts(std::ostream &output, size_t threads) const
+{
+    ExportCells(output, true, threads);
+}
+
+void Sheet::ExportCells(std::ostream &output, bool texts, size_t threads) const
+{
+    const Size size = GetPrintableSize();
+    const int band_count = (size.rows + EXPORT_BAND_ROWS - 1) / EXPORT_BAND_ROWS;
+    if (threads <= 1 || band_count <= 1)
+    {
+        PrintCells(output, texts);
+        return;
+    }
+    // Блокировка вызывающего потока закрывает значения и от пересчёта, пока
+    // их читают потоки пула
+    auto lock = LockValues();
+    if (!texts)
+    {
+        VerifyEdited();
+    }
+
+    // Полосы идут волнами по нескольку на поток. Пока пул форматирует
+    // следующую волну в одни буферы, вызывающий поток пишет предыдущую из
+    // других, так что запись не простаивает форматирование и наоборот
+    const int wave = static_cast<int>(threads) * 2;
+    ThreadPool pool(threads);
+    std::vector<std::string> ready(wave);
+    std::vector<std::string> formatting(wave);
+    auto submit = [&](int first_band)
+    {
+        for (int band = first_band; band < std::min(first_band + wave, band_count); ++band)
+        {
+            pool.Submit([this, &formatting, band, first_band, size, texts]
+                        {
+                            std::string &buffer = formatting[band - first_band];
+                            buffer.clear();
+                            const int first_row = band * EXPORT_BAND_ROWS;
+                            PrintRows(nullptr, buffer, first_row, std::min(first_row + EXPORT_BAND_ROWS, size.rows),
+                                      size, texts);
+                        });
+        }
+    };
+    submit(0);
+    pool.Wait();
+    for (int first_band = 0; first_band < band_count; first_band += wave)
+    {
+        std::swap(ready, formatting);
+        if (first_band + wave < band_count)
+        {
+            submit(first_band + wave);
+        }
+        for (int band = first_band; band < std::min(first_band + wave, band_count); ++band)
+        {
+            const std::string &buffer = ready[band - first_band];
+            output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        }
+        pool.Wait();
+    }
+}
+
+void Sheet::PrintRows(std::ostream *output, std::string &buffer, int first_row, int last_row, Size size,
+                      bool texts) const
+{
+    // Состояние обхода передаётся обработчику одним указателем, чтобы
+    // std::function не выделял под него память
+    struct RowPrinter
+    {
+        std::string &buffer;
+        int cols;
+        bool texts;
+        // Столбец, в котором стоит вывод; табуляция отделяет его от следующего
+        int col = 0;
+    } printer{buffer, size.cols, texts};
+    for (int row = first_row; row < last_row; ++row)
+    {
+        int &col = printer.col;
+        col = 0;
+        cells_.ForEachInRow(row, [&printer](int cell_col, const Cell &cell)
+                            {
+                                // Пустые ячейки под ссылками могут лежать вне области печати
+                                if (cell_col >= printer.cols)
+                                {
+                                    return;
+                                }
+                                printer.buffer.append(cell_col - printer.col, '\t');
+                                printer.col = cell_col;
+                                printer.texts ? cell.AppendText(printer.buffer) : cell.AppendValue(printer.buffer);
+                            });
+        buffer.append(size.cols - 1 - col, '\t');
+        buffer += '\n';
+        if (output && buffer.size() >= PRINT_CHUNK)
+        {
+            output->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+    }
+}
+
+size_t Sheet::GetEvaluationCount() const
+{
+    return evaluation_count_;
+}
+
+size_t Sheet::GetCellMemoryUsage() const
+{
+    return cells_.GetMemoryUsage();
+}
+
+size_t Sheet::GetLastRecalcCount() const
+{
+    return last_recalc_count_;
+}
+
+Cell *Sheet::GetOrCreateCell(Position pos)
+{
+    Cell *cell = cells_.Find(pos);
+    if (!cell)
+    {
+        cell = cells_.Emplace(*this, pos);
+        cell->order_ = --first_order_;
+    }
+    return cell;
+}
+
+void Sheet::SetRecalcThreads(size_t threads)
+{
+    WriteLock lock(*this);
+    if (threads <= 1)
+    {
+        recalc_pool_.reset();
+    }
+    else if (threads != GetRecalcThreads())
+    {
+        recalc_pool_ = std::make_unique<ThreadPool>(threads);
+    }
+}
+
+size_t Sheet::GetRecalcThreads() const
+{
+    return recalc_pool_ ? recalc_pool_->GetThreadCount() : 1;
+}
+
+void Sheet::Recalculate(Cell *root)
+{
+    if (recalc_pool_)
+    {
+        RecalculateParallel(root);
+        return;
+    }
+    // Ячейки выходят из кучи по возрастанию номера, а зависимые стоят в
+    // порядке позже своих ссылок, поэтому каждая ячейка вычисляется после
+    // всех изменившихся ячеек, на которые ссылается. В кучу попадают только
+    // зависимые ячеек, значение которых изменилось, так что пересчёт
+    // останавливается на формулах с прежним значением
+    last_recalc_count_ = 0;
+    static thread_local std::vector<Cell *> range_deps;
+    const std::uint64_t queued = ++traversal_mark_;
+    recalc_queue_.assign(1, {root->order_, root});
+    root->mark_ = queued;
+    while (!recalc_queue_.empty())
+    {
+        std::pop_heap(recalc_queue_.begin(), recalc_queue_.end(), std::greater<>());
+        Cell *cell = recalc_queue_.back().second;
+        recalc_queue_.pop_back();
+        NoteChange(*cell);
+        const bool changed = Reevaluate(*cell, last_recalc_count_);
+        PublishCell(*cell);
+        if (!changed)
+        {
+            continue;
+        }
+        const DependencyGraph::Range deps = graph_.GetDeps(cell->id_);
+        range_deps.clear();
+        cell->AppendRangeDependents(range_deps);
+        if (recalc_queue_.size() + deps.size() + range_deps.size() > RECALC_QUEUE_LIMIT)
+        {
+            // Большую волну дешевле упорядочить целиком обходом в глубину,
+            // чем проводить через кучу. Вся она стоит в порядке позже уже
+            // пересчитанных ячеек
+            std::vector<Cell *> roots{cell};
+            for (const auto &[order, queued_cell] : recalc_queue_)
+            {
+                roots.push_back(queued_cell);
+            }
+            recalc_queue_.clear();
+            Cell::GetDirtyCells(roots, dirty_);
+            RecalculateSorted(roots, cell);
+            break;
+        }
+        auto enqueue = [this, queued](Cell *dep)
+        {
+            if (dep->mark_ != queued)
+            {
+                dep->mark_ = queued;
+                recalc_queue_.emplace_back(dep->order_, dep);
+                std::push_heap(recalc_queue_.begin(), recalc_queue_.end(), std::greater<>());
+            }
+        };
+        for (auto id : deps)
+        {
+            enqueue(graph_.GetCell(id));
+        }
+        for (Cell *dep : range_deps)
+        {
+            enqueue(dep);
+        }
+    }
+    evaluation_count_ += last_recalc_count_;
+}
+
+bool Sheet::HasChangedRefs(const Cell &cell, std::uint64_t changed) const
+{
+    // Просмотр ячеек диапазона стоит столько же, сколько его свёртка,
+    // поэтому формула с диапазонами вычисляется заново в любом случае
+    const FormulaInterface *formula = cell.GetFormula();
+    if (formula && formula->GetProgram().range_count != 0)
+    {
+        return true;
+    }
+    const DependencyGraph::Range refs = graph_.GetRefs(cell.id_);
+    return std::any_of(refs.begin(), refs.end(), [this, changed](DependencyGraph::CellId id)
+                       { return graph_.GetCell(id)->mark_ == changed; });
+}
+
+bool Sheet::Reevaluate(Cell &cell, size_t &evaluated)
+{
+    if (!cell.GetFormula())
+    {
+        return true;
+    }
+    const FormulaInterface::Value previous = cell.value_;
+    cell.Recalculate();
+    ++evaluated;
+    // Числа сравниваются побитово: 0 и -0 печатаются по-разному
+    if (std::holds_alternative<double>(previous) && std::holds_alternative<double>(cell.value_))
+    {
+        return std::memcmp(&std::get<double>(previous), &std::get<double>(cell.value_), sizeof(double)) != 0;
+    }
+    return !(previous == cell.value_);
+}
+
+void Sheet::RecalculateParallel(Cell *root)
+{
+    // Уровни, меньшие порога, дешевле вычислить в текущем потоке, чем
+    // раздавать пулу; крупные раздаются отрезками по CHUNK ячеек
+    const size_t PARALLEL_THRESHOLD = 1024;
+    const size_t CHUNK = 256;
+
+    // Ячейка уровня пересчитывается, только если изменилось значение хотя
+    // бы одной её ссылки; изменившиеся ячейки помечаются номером changed
+    std::atomic<size_t> recalculated = 0;
+    std::vector<Cell *> outdated;
+    std::vector<char> changed_flags;
+    const auto levels = root->GetDirtyLevels();
+    const std::uint64_t changed = ++traversal_mark_;
+    for (const auto &level : levels)
+    {
+        outdated.clear();
+        for (Cell *cell : level)
+        {
+            if (cell == root || HasChangedRefs(*cell, changed))
+            {
+                NoteChange(*cell);
+                outdated.push_back(cell);
+            }
+        }
+        changed_flags.assign(outdated.size(), 0);
+        auto body = [&outdated, &changed_flags, &recalculated](size_t begin, size_t end)
+        {
+            size_t count = 0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                changed_flags[i] = Reevaluate(*outdated[i], count);
+            }
+            recalculated += count;
+        };
+        if (outdated.size() < PARALLEL_THRESHOLD)
+        {
+            body(0, outdated.size());
+        }
+        else
+        {
+            recalc_pool_->ParallelFor(outdated.size(), CHUNK, body);
+        }
+        for (size_t i = 0; i < outdated.size(); ++i)
+        {
+            if (changed_flags[i])
+            {
+                outdated[i]->mark_ = changed;
+            }
+            PublishCell(*outdated[i]);
+        }
+    }
+    last_recalc_count_ = recalculated;
+    evaluation_count_ += last_recalc_count_;
+}
+
+void Sheet::EnableConcurrentReads()
+{
+    WriteLock lock(*this);
+    if (slots_)
+    {
+        return;
+    }
+    slots_ = std::make_unique<ValueSlots>();
+    cells_.ForEach([this](Position, const Cell &cell)
+                   { PublishCell(cell); });
+}
+
+bool Sheet::IsConcurrentReadEnabled() const
+{
+    return slots_ != nullptr;
+}
+
+CellInterface::Value Sheet::ReadValue(Position pos) const
+{
+    const ValueSlots::Value value = LoadValue(pos);
+    switch (value.kind)
+    {
+    case ValueSlots::Kind::Number:
+        return value.number;
+    case ValueSlots::Kind::Error:
+        return FormulaError(value.error);
+    case ValueSlots::Kind::Text:
+    {
+        // Текст не помещается в слот и читается из ячейки, пока правки ждут.
+        // К этому времени ячейка могла измениться, тогда читается новое
+        std::shared_lock lock(write_mutex_);
+        const Cell *cell = cells_.Find(pos);
+        return cell ? cell->GetCachedValue() : CellInterface::Value();
+    }
+    default:
+        return CellInterface::Value();
+    }
+}
+
+std::uint64_t Sheet::GetValueVersion(Position pos) const
+{
+    return LoadValue(pos).version;
+}
+
+ValueSlots::Value Sheet::LoadValue(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    if (!slots_)
+    {
+        throw std::logic_error("Concurrent reads are not enabled"s);
+    }
+    return slots_->Load(pos);
+}
+
+void Sheet::SetAsyncRecalc(bool enabled)
+{
+    if (enabled == IsAsyncRecalc())
+    {
+        return;
+    }
+    if (enabled && lazy_recalc_)
+    {
+        throw std::logic_error("Asynchronous recalculation is incompatible with lazy recalculation"s);
+    }
+    if (enabled)
+    {
+        EnableConcurrentReads();
+        WriteLock lock(*this);
+        stop_recalc_ = false;
+        recalc_thread_ = std::thread([this]
+                                     { RunRecalc(); });
+        return;
+    }
+    {
+        WriteLock lock(*this);
+        FinishRecalc();
+        stop_recalc_ = true;
+    }
+    stale_cv_.notify_all();
+    recalc_thread_.join();
+}
+
+bool Sheet::IsAsyncRecalc() const
+{
+    return recalc_thread_.joinable();
+}
+
+std::shared_lock<std::shared_mutex> Sheet::LockValues() const
+{
+    if (!IsAsyncRecalc())
+    {
+        return std::shared_lock<std::shared_mutex>(write_mutex_, std::defer_lock);
+    }
+    return std::shared_lock<std::shared_mutex>(write_mutex_);
+}
+
+bool Sheet::IsStale(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    std::shared_lock lock(write_mutex_);
+    return IsStaleLocked(pos);
+}
+
+CellInterface::Value Sheet::WaitForValue(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    if (lazy_recalc_)
+    {
+        const Cell *cell = cells_.Find(pos);
+        return cell ? cell->GetValue() : CellInterface::Value();
+    }
+    std::shared_lock lock(write_mutex_);
+    recalculated_cv_.wait(lock, [this, pos]
+                          { return !IsStaleLocked(pos); });
+    const Cell *cell = cells_.Find(pos);
+    return cell ? cell->GetCachedValue() : CellInterface::Value();
+}
+
+void Sheet::WaitForRecalc() const
+{
+    if (lazy_recalc_)
+    {
+        VerifyEdited();
+        return;
+    }
+    std::shared_lock lock(write_mutex_);
+    recalculated_cv_.wait(lock, [this]
+                          { return stale_cells_.empty(); });
+}
+
+void Sheet::MarkStale(Cell *cell, bool reordered)
+{
+    last_recalc_count_ = 0;
+    PublishCell(*cell);
+    stale_order_changed_ = stale_order_changed_ || reordered;
+    // Текст без зависимых пересчитывать незачем: его значение уже известно
+    if (!cell->GetFormula() && !cell->HasDependents())
+    {
+        return;
+    }
+    // Значение правленой ячейки могло измениться ещё при установке текста,
+    // поэтому её зависимые пересчитываются в любом случае
+    const auto [it, inserted] = stale_cells_.try_emplace(cell->pos_, true);
+    it->second = true;
+    if (inserted)
+    {
+        stale_queue_.emplace(cell->order_, cell->pos_);
+    }
+    stale_cv_.notify_one();
+}
+
+void Sheet::RecalculateStale(size_t limit)
+{
+    if (stale_order_changed_)
+    {
+        stale_queue_ = {};
+        for (const auto &[pos, edited] : stale_cells_)
+        {
+            if (const Cell *cell = cells_.Find(pos))
+            {
+                stale_queue_.emplace(cell->order_, pos);
+            }
+        }
+        stale_order_changed_ = false;
+    }
+    // Очередь выдаёт ячейки по возрастанию номера, а зависимые стоят в
+    // порядке позже своих ссылок, поэтому каждая ячейка вычисляется после
+    // всех устаревших ячеек, на которые ссылается
+    std::vector<Cell *> deps;
+    for (size_t count = 0; count < limit && !stale_queue_.empty(); ++count)
+    {
+        const Position pos = stale_queue_.top().second;
+        stale_queue_.pop();
+        Cell *cell = cells_.Find(pos);
+        const auto stale = stale_cells_.find(pos);
+        // Удалённые и уже пересчитанные ячейки пропускаются
+        if (stale == stale_cells_.end() || !cell)
+        {
+            continue;
+        }
+        const bool edited = stale->second;
+        stale_cells_.erase(stale);
+        NoteChange(*cell);
+        const bool changed = Reevaluate(*cell, evaluation_count_);
+        PublishCell(*cell);
+        // Зависимые ячейки, значение которой не изменилось, остаются верными
+        if (!changed && !edited)
+        {
+            continue;
+        }
+        deps.clear();
+        for (auto dep : graph_.GetDeps(cell->id_))
+        {
+            deps.push_back(graph_.GetCell(dep));
+        }
+        cell->AppendRangeDependents(deps);
+        for (const Cell *dependent : deps)
+        {
+            if (stale_cells_.try_emplace(dependent->pos_, false).second)
+            {
+                stale_queue_.emplace(dependent->order_, dependent->pos_);
+            }
+        }
+    }
+    // Ячейки, удалённые после того, как попали в очередь
+    if (stale_queue_.empty())
+    {
+        stale_cells_.clear();
+    }
+}
+
+void Sheet::FinishRecalc()
+{
+    if (!stale_cells_.empty())
+    {
+        RecalculateStale(std::numeric_limits<size_t>::max());
+        recalculated_cv_.notify_all();
+    }
+    VerifyEdited();
+}
+
+bool Sheet::IsStaleLocked(Position pos) const
+{
+    if (lazy_recalc_)
+    {
+        const Cell *cell = cells_.Find(pos);
+        return cell && !IsVerified(*cell);
+    }
+    if (stale_cells_.empty())
+    {
+        return false;
+    }
+    // Значение текста известно сразу, устаревать может только формула
+    const Cell *cell = cells_.Find(pos);
+    if (!cell || !cell->GetFormula())
+    {
+        return false;
+    }
+    // Обход ячеек, от которых зависит значение cell
+    std::vector<const Cell *> stack{cell};
+    std::unordered_set<const Cell *> visited{cell};
+    while (!stack.empty())
+    {
+        const Cell *current = stack.back();
+        stack.pop_back();
+        if (stale_cells_.count(current->pos_) != 0)
+        {
+            return true;
+        }
+        auto reach = [&stack, &visited](const Cell &referenced)
+        {
+            if (visited.insert(&referenced).second)
+            {
+                stack.push_back(&referenced);
+            }
+            return true;
+        };
+        for (auto ref : graph_.GetRefs(current->id_))
+        {
+            reach(*graph_.GetCell(ref));
+        }
+        current->ForEachRangeMember(reach);
+    }
+    return false;
+}
+
+void Sheet::RunRecalc()
+{
+    std::unique_lock lock(write_mutex_);
+    while (true)
+    {
+        stale_cv_.wait(lock, [this]
+                       { return stop_recalc_ || !stale_cells_.empty(); });
+        if (stop_recalc_)
+        {
+            return;
+        }
+        RecalculateStale(RECALC_SLICE);
+        recalculated_cv_.notify_all();
+        DeliverChanges(lock);
+        // Ждущие правки проходят раньше следующей порции
+        lock.lock();
+        writers_cv_.wait(lock, [this]
+                         { return waiting_writers_ == 0; });
+    }
+}
+
+void Sheet::SetLazyRecalc(bool enabled)
+{
+    WriteLock lock(*this);
+    if (enabled == lazy_recalc_)
+    {
+        return;
+    }
+    if (enabled && recalc_thread_.joinable())
+    {
+        throw std::logic_error("Lazy recalculation is incompatible with asynchronous recalculation"s);
+    }
+    if (enabled)
+    {
+        // Пока режим был выключен, значения всех ячеек оставались верными
+        verified_epoch_ = ++edit_epoch_;
+    }
+    else
+    {
+        VerifyEdited();
+    }
+    lazy_recalc_ = enabled;
+}
+
+bool Sheet::IsLazyRecalc() const
+{
+    return lazy_recalc_;
+}
+
+void Sheet::MarkEdited(Cell *cell)
+{
+    last_recalc_count_ = 0;
+    ++edit_epoch_;
+    // Значение текста меняется при установке, а формулу вычислит проверка
+    if (cell->GetFormula())
+    {
+        cell->verified_epoch_ = Cell::UNVERIFIED;
+    }
+    else
+    {
+        cell->changed_epoch_ = edit_epoch_;
+    }
+    PublishCell(*cell);
+    lazy_edits_.insert(cell->pos_);
+    // Слушателям нужны изменения каждой правки
+    if (!subscriptions_.empty())
+    {
+        VerifyEdited();
+    }
+}
+
+std::uint64_t Sheet::GetVerifiedEpoch(const Cell &cell) const
+{
+    if (cell.verified_epoch_ == Cell::UNVERIFIED)
+    {
+        return 0;
+    }
+    return std::max(cell.verified_epoch_, verified_epoch_);
+}
+
+bool Sheet::IsVerified(const Cell &cell) const
+{
+    return !cell.GetFormula() || GetVerifiedEpoch(cell) == edit_epoch_;
+}
+
+void Sheet::Verify(Cell &cell)
+{
+    const std::uint64_t verified = GetVerifiedEpoch(cell);
+    const DependencyGraph::Range refs = graph_.GetRefs(cell.id_);
+    const bool outdated = verified == 0 ||
+                          std::any_of(refs.begin(), refs.end(), [this, verified](DependencyGraph::CellId id)
+                                      { return graph_.GetCell(id)->changed_epoch_ > verified; }) ||
+                          !cell.ForEachRangeMember([verified](const Cell &member)
+                                                   { return member.changed_epoch_ <= verified; });
+    if (outdated)
+    {
+        NoteChange(cell);
+        if (Reevaluate(cell, evaluation_count_))
+        {
+            cell.changed_epoch_ = edit_epoch_;
+        }
+        PublishCell(cell);
+    }
+    cell.verified_epoch_ = edit_epoch_;
+}
+
+void Sheet::VerifyCell(Position pos)
+{
+    Cell *cell = cells_.Find(pos);
+    if (!cell || IsVerified(*cell))
+    {
+        return;
+    }
+    // Обход в глубину по ссылкам: ячейка подтверждается, когда
+    // подтверждены все её ссылки. Подтверждённые ячейки не обходятся
+    // повторно, так что общие ссылки проверяются один раз за эпоху
+    verify_stack_.assign(1, {cell, 0});
+    while (!verify_stack_.empty())
+    {
+        auto &[current, next] = verify_stack_.back();
+        const DependencyGraph::Range refs = graph_.GetRefs(current->id_);
+        if (next < refs.size())
+        {
+            Cell *ref = graph_.GetCell(refs[next++]);
+            if (!IsVerified(*ref))
+            {
+                verify_stack_.emplace_back(ref, 0);
+            }
+            continue;
+        }
+        if (next == refs.size())
+        {
+            // Ячейки диапазонов кладутся на стек все сразу. Ячейка, попавшая
+            // туда дважды, подтверждается один раз
+            ++next;
+            Cell *owner = current;
+            owner->ForEachRangeMember([this](Cell &member)
+                                      {
+                                          if (!IsVerified(member))
+                                          {
+                                              verify_stack_.emplace_back(&member, 0);
+                                          }
+                                          return true; });
+            if (verify_stack_.back().first != owner)
+            {
+                continue;
+            }
+        }
+        Cell *verified = verify_stack_.back().first;
+        if (!IsVerified(*verified))
+        {
+            Verify(*verified);
+        }
+        verify_stack_.pop_back();
+    }
+}
+
+void Sheet::VerifyEdited() const
+{
+    if (lazy_edits_.empty())
+    {
+        return;
+    }
+    // Значения ячеек - кэш, который проверка приводит в соответствие
+    // правкам. Константной таблица в ленивом режиме не бывает: режим
+    // включается неконстантным методом
+    Sheet &sheet = const_cast<Sheet &>(*this);
+    std::vector<Cell *> roots;
+    roots.reserve(lazy_edits_.size());
+    for (Position pos : lazy_edits_)
+    {
+        if (Cell *cell = sheet.cells_.Find(pos))
+        {
+            roots.push_back(cell);
+        }
+    }
+    sheet.lazy_edits_.clear();
+    // В топологическом порядке ссылки каждой ячейки подтверждены раньше неё,
+    // а ячейки вне обхода правки не затронули
+    Cell::GetDirtyCells(roots, sheet.dirty_);
+    for (Cell *cell : sheet.dirty_)
+    {
+        if (!IsVerified(*cell))
+        {
+            sheet.Verify(*cell);
+        }
+    }
+    sheet.verified_epoch_ = edit_epoch_;
+}
+
+size_t Sheet::Subscribe(ChangeListener listener, std::optional<Region> region)
+{
+    if (region && (!region->first.IsValid() || !region->last.IsValid()))
+    {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    WriteLock lock(*this);
+    // Дальше ленивый режим подтверждает значения каждой правкой, а
+    // накопленные до подписки правки слушателю не доставляются
+    VerifyEdited();
+    subscriptions_.emplace(++last_subscription_,
+                           std::make_shared<const Subscription>(Subscription{std::move(listener), region}));
+    return last_subscription_;
+}
+
+void Sheet::Unsubscribe(size_t subscription)
+{
+    WriteLock lock(*this);
+    subscriptions_.erase(subscription);
+    if (subscriptions_.empty())
+    {
+        changed_cells_.clear();
+    }
+}
+
+void Sheet::NoteChange(const Cell &cell)
+{
+    if (subscriptions_.empty() || changed_cells_.count(cell.pos_) != 0)
+    {
+        return;
+    }
+    changed_cells_.emplace(cell.pos_, cell.GetCachedValue());
+}
+
+void Sheet::DeliverChanges(std::unique_lock<std::shared_mutex> &lock)
+{
+    bool queued = false;
+    if (!changed_cells_.empty())
+    {
+        Delivery delivery;
+        for (auto &[pos, old_value] : changed_cells_)
+        {
+            const Cell *cell = cells_.Find(pos);
+            CellInterface::Value new_value = cell ? cell->GetCachedValue() : CellInterface::Value();
+            // Отменённая правка или пересчёт с тем же результатом
+            if (!(new_value == old_value))
+            {
+                delivery.changes.push_back({pos, std::move(old_value), std::move(new_value)});
+            }
+        }
+        changed_cells_.clear();
+        std::sort(delivery.changes.begin(), delivery.changes.end(), [](const CellChange &lhs, const CellChange &rhs)
+                  { return lhs.pos < rhs.pos; });
+        for (const auto &[id, subscription] : subscriptions_)
+        {
+            delivery.subscriptions.push_back(subscription);
+        }
+        if (!delivery.changes.empty())
+        {
+            // Очередь пополняется под блокировкой правки, поэтому доставки
+            // стоят в ней в порядке правок
+            std::lock_guard guard(delivery_mutex_);
+            deliveries_.push_back(std::move(delivery));
+            queued = true;
+        }
+    }
+    lock.unlock();
+    // Чужие доставки разбирают те, кто их поставил
+    if (!queued)
+    {
+        return;
+    }
+
+    std::unique_lock guard(delivery_mutex_);
+    // Правка, сделанная слушателем, попадает сюда же и доставляется тем
+    // циклом, который его вызвал
+    if (delivering_)
+    {
+        return;
+    }
+    delivering_ = true;
+    std::vector<CellChange> visible;
+    while (!deliveries_.empty())
+    {
+        Delivery delivery = std::move(deliveries_.front());
+        deliveries_.pop_front();
+        guard.unlock();
+        for (const auto &subscription : delivery.subscriptions)
+        {
+            if (!subscription->region)
+            {
+                subscription->listener(delivery.changes);
+                continue;
+            }
+            visible.clear();
+            for (const CellChange &change : delivery.changes)
+            {
+                if (subscription->region->Contains(change.pos))
+                {
+                    visible.push_back(change);
+                }
+            }
+            if (!visible.empty())
+            {
+                subscription->listener(visible);
+            }
+        }
+        guard.lock();
+    }
+    delivering_ = false;
+}
+
+std::shared_ptr<const SheetView> Sheet::Snapshot()
+{
+    WriteLock lock(*this);
+    VerifyEdited();
+    if (!versions_)
+    {
+        versions_ = std::make_unique<CellVersions>();
+        cells_.ForEach([this](Position, const Cell &cell)
+                       { PublishCell(cell); });
+    }
+    return versions_->Freeze(GetPrintableSize());
+}
+
+void Sheet::PublishCell(const Cell &cell)
+{
+    const bool is_formula = cell.GetFormula() != nullptr;
+    if (slots_)
+    {
+        if (!is_formula)
+        {
+            cell.IsEmpty() ? slots_->StoreEmpty(cell.pos_) : slots_->StoreText(cell.pos_);
+        }
+        else if (const double *number = std::get_if<double>(&cell.value_))
+        {
+            slots_->StoreNumber(cell.pos_, *number);
+        }
+        else
+        {
+            slots_->StoreError(cell.pos_, std::get<FormulaError>(cell.value_).GetCategory());
+        }
+    }
+    if (versions_ && !versions_->IsViewed())
+    {
+        // Правку больше некому увидеть: версии освобождаются, и следующий
+        // снимок построит их заново
+        versions_.reset();
+    }
+    if (versions_)
+    {
+        if (cell.IsEmpty())
+        {
+            versions_->Erase(cell.pos_);
+        }
+        else if (cell.text_changed_ || !is_formula || !versions_->SetValue(cell.pos_, cell.value_))
+        {
+            versions_->Set(cell.pos_, cell.GetText(), is_formula ? &cell.value_ : nullptr);
+        }
+        cell.text_changed_ = false;
     }
 }
 
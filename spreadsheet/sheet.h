@@ -1,17 +1,38 @@
 #pragma once
 
 // #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "edit_log.h"
+#include "object_pool.h"
+#include "range_index.h"
+#include "sheet_view.h"
+#include "thread_pool.h"
+#include "value_slots.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <map>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 class Cell;
 
 class Sheet : public SheetInterface
 {
 public:
+    Sheet();
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
@@ -28,8 +49,399 @@ public:
 
     // Можете дополнить ваш класс нужными полями и методами
 
+    // Количество вычислений формул с момента создания таблицы
+    size_t GetEvaluationCount() const;
+    // Количество формул, пересчитанных последней правкой
+    size_t GetLastRecalcCount() const;
+    // Память хранилища ячеек в байтах: каталог и места под ячейки, без
+    // содержимого самих ячеек
+    size_t GetCellMemoryUsage() const;
+
+    // Задаёт число потоков пересчёта. При значении больше единицы формулы,
+    // не зависящие друг от друга, вычисляются параллельно на пуле потоков
+    // таблицы. Результат совпадает с последовательным пересчётом
+    void SetRecalcThreads(size_t threads);
+    size_t GetRecalcThreads() const;
+
+    // Пакетная правка. Между BeginBatch и Commit вызовы SetCell и ClearCell
+    // только запоминаются (позиция проверяется сразу), а чтение и печать
+    // видят таблицу без них. Commit применяет правки разом: разбирает
+    // формулы, один раз проверяет циклы по новым ссылкам и один раз
+    // пересчитывает затронутые формулы. Если формула некорректна или правки
+    // замыкают цикл, таблица остаётся такой, какой была до BeginBatch, а
+    // исключение пробрасывается. Пакет завершается в любом случае
+    void BeginBatch();
+    void Commit();
+    // Отбрасывает запомненные правки
+    void Rollback();
+    bool IsInBatch() const;
+
+    // Загружает тексты ячеек в формате PrintTexts: строки таблицы через
+    // перевод строки, ячейки строки через табуляцию, начиная с A1. Пустые
+    // поля не меняют ячеек. Поток читается порциями, формулы порции
+    // разбираются на threads потоках. Граф зависимостей строится по ходу
+    // чтения, а циклы проверяются и формулы пересчитываются один раз в
+    // конце. При ошибке таблица остаётся такой, какой была до загрузки
+    void ImportTexts(std::istream &input, size_t threads = std::thread::hardware_concurrency());
+
+    // Печатают то же, что PrintValues и PrintTexts, байт в байт, разбивая
+    // область печати на полосы строк: полосы форматируются параллельно на
+    // threads потоках, каждая в свой буфер, и пишутся в поток по порядку.
+    // Таблицу при этом можно только читать, в том числе из других потоков
+    void ExportValues(std::ostream &output, size_t threads = std::thread::hardware_concurrency()) const;
+    void ExportTexts(std::ostream &output, size_t threads = std::thread::hardware_concurrency()) const;
+
+    // Двоичный снимок таблицы (формат описан в snapshot.h): тексты ячеек,
+    // скомпилированные формулы с их ссылками и вычисленные значения.
+    // Записывается потоком, ячейка за ячейкой; правки открытого пакета в
+    // снимок не попадают
+    void SaveSnapshot(std::ostream &output) const;
+    // Загружает снимок в пустую таблицу. Файл отображается в память, и
+    // формулы выполняют программы прямо из неё: ничего не разбирается и
+    // не пересчитывается, значения берутся из снимка. Бросает
+    // SnapshotException, если файл не прочитать или он повреждён; таблица
+    // при этом остаётся пустой
+    void LoadSnapshot(const std::string &path);
+
+    // Журнал правок (edit_log.h). Пока он открыт, каждая удавшаяся правка -
+    // SetCell, ClearCell, Commit пакета, ImportTexts - дописывается в него
+    // отдельной транзакцией и попадает на диск согласно options
+    void OpenLog(const std::string &path, EditLogOptions options = {});
+    // Записывает накопленные правки и закрывает журнал
+    void CloseLog();
+    // Записывает накопленные правки, не дожидаясь группы
+    void FlushLog();
+    const EditLog *GetLog() const;
+    // Контрольная точка: сохраняет снимок таблицы в snapshot_path через
+    // временный файл, так что прежний снимок заменяется только целиком, и
+    // очищает открытый журнал - его правки теперь в снимке
+    void Checkpoint(const std::string &snapshot_path);
+    // Восстанавливает пустую таблицу после сбоя: загружает снимок, если он
+    // есть, и применяет правки журнала одним пакетом, с одной проверкой
+    // циклов и одним пересчётом. Правки журнала задают тексты ячеек целиком,
+    // поэтому журнал, не очищенный после записи снимка, применяется к нему
+    // без вреда. Журнал при этом не открывается
+    void Recover(const std::string &snapshot_path, const std::string &log_path);
+
+    // Чтение значений из многих потоков одновременно с правками. Правки -
+    // методы, меняющие таблицу, пакет или журнал, - выполняются по одной,
+    // даже если вызваны из разных потоков. После EnableConcurrentReads
+    // каждая удавшаяся правка публикует значения затронутых ячеек, и
+    // ReadValue читает последнее опубликованное значение ячейки из любого
+    // потока: числа и ошибки формул - без блокировок, текст - под общей
+    // блокировкой, которую правка держит до своего завершения. Значения
+    // правки, завершившейся исключением, не публикуются. Ничего не
+    // вычисляется при чтении: формулы пересчитывает сама правка. Остальные
+    // методы чтения, включая GetCell и печать, можно вызывать только тогда,
+    // когда правок нет
+    void EnableConcurrentReads();
+    bool IsConcurrentReadEnabled() const;
+    // Пустая или отсутствующая ячейка читается как пустая строка
+    CellInterface::Value ReadValue(Position pos) const;
+    // Растёт с каждой публикацией значения ячейки, 0 - публикаций не было.
+    // Позволяет читателю дёшево узнать, изменилось ли значение
+    std::uint64_t GetValueVersion(Position pos) const;
+
+    // Согласованный вид таблицы (sheet_view.h): тексты и значения всех ячеек
+    // после последней завершённой правки. Первый вызов копирует ячейки в
+    // постоянное дерево за O(n), дальше таблица поддерживает его каждой
+    // правкой, и снимок стоит O(1). Когда последний выданный вид отпущен,
+    // первая же правка освобождает дерево и снова ничего не платит за виды,
+    // а следующий снимок опять стоит O(n). Можно вызывать из любого потока
+    // одновременно с правками
+    std::shared_ptr<const SheetView> Snapshot();
+
+    // Асинхронный пересчёт. В этом режиме SetCell и ClearCell только меняют
+    // ячейку, проверяют циклы и отмечают её устаревшей, а формулы
+    // пересчитывает фоновый поток таблицы порциями по RECALC_SLICE ячеек,
+    // пропуская ждущие правки между порциями. Поэтому время правки не
+    // зависит от числа зависящих от ячейки формул. Режим включает чтение из
+    // других потоков: ReadValue и Snapshot дают последние вычисленные
+    // значения, IsStale говорит, могут ли они отставать. Значения из
+    // GetCell, печать и SaveSnapshot читаются под блокировкой, совместной с
+    // ReadValue, поэтому их можно читать во время пересчёта, но формулы
+    // согласованы с правками только после WaitForRecalc.
+    // Пакеты, загрузка и контрольная точка сначала дожидаются пересчёта и
+    // выполняются как обычно; выключение режима тоже его дожидается
+    void SetAsyncRecalc(bool enabled);
+    bool IsAsyncRecalc() const;
+    // Может ли значение ячейки отставать от сделанных правок: она сама или
+    // ячейка, от которой она зависит, ещё ждёт пересчёта
+    bool IsStale(Position pos) const;
+    // Дожидается, пока значение ячейки перестанет отставать, и возвращает его
+    CellInterface::Value WaitForValue(Position pos) const;
+    // Дожидается пересчёта всех сделанных правок
+    void WaitForRecalc() const;
+
+    // Ленивый пересчёт. В этом режиме SetCell и ClearCell только меняют
+    // ячейку, проверяют циклы и сдвигают эпоху правок таблицы, а зависимые
+    // формулы не трогают. Формула проверяется, когда читают её значение
+    // через GetCell: ячейка помнит эпоху, к которой её значение подтверждено,
+    // и эпоху, в которую оно последний раз изменилось. Значение,
+    // подтверждённое в текущую эпоху, читается сразу; иначе сначала так же
+    // подтверждаются ячейки, на которые ссылается формула, и она вычисляется
+    // заново, только если одна из них изменилась после её подтверждения.
+    // Поэтому правка стоит O(1), а пересчёт достаётся только читаемым
+    // ячейкам и тому, от чего они зависят. Печать, экспорт, снимки и
+    // пакеты сначала подтверждают всё, что затронули правки; с подписками
+    // это делает каждая правка, чтобы слушатели получили изменения. ReadValue
+    // даёт последние подтверждённые значения, IsStale говорит, может ли
+    // значение отставать. Значения читаются только из потока правок.
+    // Несовместим с асинхронным пересчётом: включение одного режима при
+    // другом бросает std::logic_error. Выключение подтверждает всё
+    void SetLazyRecalc(bool enabled);
+    bool IsLazyRecalc() const;
+
+    // Изменение видимого значения ячейки (GetValue); значение удалённой
+    // ячейки - пустая строка
+    struct CellChange
+    {
+        Position pos;
+        CellInterface::Value old_value;
+        CellInterface::Value new_value;
+    };
+
+    // Прямоугольник ячеек от first до last включительно
+    using Region = CellRange;
+
+    // Слушатель получает изменения одной правки по возрастанию позиции.
+    // Не должен бросать исключений
+    using ChangeListener = std::function<void(const std::vector<CellChange> &changes)>;
+
+    // Подписывает listener на изменения значений ячеек: после каждой
+    // удавшейся правки, пакета или загрузки - и в асинхронном режиме после
+    // каждой порции фонового пересчёта - он получает ячейки, чьё значение
+    // стало другим, с прежним и новым значением. Если задан region, только
+    // ячейки из него; правки, не изменившие в нём ничего, не доставляются.
+    // Изменения собираются по ходу пересчёта, без обхода таблицы.
+    // Слушателей вызывают после того, как правка отпустила таблицу, так что
+    // из них можно читать и править её. Доставки идут в порядке правок по
+    // одной: их выполняет поток, сделавший одну из правок, или поток
+    // фонового пересчёта. Возвращает номер подписки для Unsubscribe
+    size_t Subscribe(ChangeListener listener, std::optional<Region> region = std::nullopt);
+    // Доставки, начатые до отписки, ещё могут дойти до слушателя
+    void Unsubscribe(size_t subscription);
+
 private:
-    // Хранит указатели на ячейки
+    friend class Cell;
+
+    static constexpr size_t PRINT_CHUNK = 1 << 16;
+    // Строк в полосе параллельной печати
+    static constexpr int EXPORT_BAND_ROWS = 256;
+    // Ячеек, которые фоновый пересчёт вычисляет, не пропуская правок
+    static constexpr size_t RECALC_SLICE = 1024;
+    // Ячеек в куче Recalculate, сверх которых оставшийся пересчёт
+    // упорядочивается целиком
+    static constexpr size_t RECALC_QUEUE_LIMIT = 64;
+
+    // Монопольная блокировка правки. Фоновый пересчёт, увидев ждущую
+    // правку, уступает ей таблицу после текущей порции
+    class WriteLock
+    {
+    public:
+        explicit WriteLock(Sheet &sheet);
+        // Доставляет изменения правки слушателям, отпустив таблицу
+        ~WriteLock();
+
+    private:
+        Sheet &sheet_;
+        std::unique_lock<std::shared_mutex> lock_;
+    };
+
+    struct Subscription
+    {
+        ChangeListener listener;
+        std::optional<Region> region;
+    };
+
+    // Изменения одной правки для доставки и подписки на момент правки
+    struct Delivery
+    {
+        std::vector<CellChange> changes;
+        std::vector<std::shared_ptr<const Subscription>> subscriptions;
+    };
+
+    // Правка пакета; отсутствие текста означает очистку ячейки
+    using BatchEdit = std::pair<Position, std::optional<std::string>>;
+
+    // Возвращает ячейку, создавая пустую, если её ещё нет. Используется для
+    // ячеек, на которые ссылаются формулы. Новая ячейка ни на что не ссылается
+    // и ставится в начало топологического порядка
+    Cell *GetOrCreateCell(Position pos);
+    // Пересчитывает формулы, устаревшие после изменения ячейки root: каждую
+    // не больше одного раза, в топологическом порядке. Пересчёт не идёт
+    // дальше ячейки, значение которой осталось прежним
+    void Recalculate(Cell *root);
+    void RecalculateParallel(Cell *root);
+    // Вычисляет формулу cell заново, увеличивая evaluated, и возвращает,
+    // изменилось ли значение, которое читают ссылающиеся на неё формулы.
+    // Текст и пустая ячейка получают значение при установке, поэтому для
+    // них ответ всегда true
+    static bool Reevaluate(Cell &cell, size_t &evaluated);
+    // Помечена ли номером changed хотя бы одна ячейка, на которую ссылается cell
+    bool HasChangedRefs(const Cell &cell, std::uint64_t changed) const;
+    // Учитывает в области печати, что ячейка pos стала пустой или непустой
+    void UpdatePrintableArea(Position pos, bool was_empty, bool is_empty);
+    // Применяет правки пакета, последняя правка ячейки побеждает
+    void ApplyBatch(std::vector<BatchEdit> edits);
+    // Запоминает в undo прежний текст ячейки pos, если открыт журнал
+    void SaveUndo(std::vector<BatchEdit> &undo, Position pos) const;
+    // Завершает транзакцию журнала уже применённой правки. Если журнал не
+    // удалось записать, возвращает ячейкам тексты из undo, чтобы таблица не
+    // разошлась с журналом, и бросает исключение дальше
+    void CommitLogged(EditLogTransaction &logged, std::vector<BatchEdit> undo);
+    // Удаляет ячейки positions, созданные после того, как границами
+    // топологического порядка были first_order и last_order, если на них не
+    // ссылаются формулы
+    void EraseCreatedCells(const std::vector<Position> &positions, std::int64_t first_order,
+                           std::int64_t last_order);
+    // Печатает значения или тексты ячеек области печати
+    void PrintCells(std::ostream &output, bool texts) const;
+    void ExportCells(std::ostream &output, bool texts, size_t threads) const;
+    // Дописывает в buffer строки [first_row, last_row) области печати size,
+    // обходя только существующие ячейки. Если задан output, накопленное
+    // уходит в него кусками по PRINT_CHUNK байт
+    void PrintRows(std::ostream *output, std::string &buffer, int first_row, int last_row, Size size,
+                   bool texts) const;
+    // Упорядочивает изменённые ячейки cells и зависящие от них, ставит их в
+    // конец топологического порядка и пересчитывает сами cells и те ячейки,
+    // у которых изменилось значение хотя бы одной ссылки. Возвращает false,
+    // ничего не меняя, если среди них есть цикл
+    bool RecalculateEdited(const std::vector<Cell *> &cells);
+    // Пересчитывает ячейки dirty_, упорядоченные топологически от roots:
+    // сами roots и те, у которых изменилось значение хотя бы одной ссылки.
+    // recalculated - ячейка из roots, уже пересчитанная с новым значением
+    void RecalculateSorted(const std::vector<Cell *> &roots, Cell *recalculated = nullptr);
+    // Записывает в order ячейки roots и все зависящие от них, упорядоченные
+    // топологически. Возвращает false, если среди них есть цикл
+    bool SortDirtyCells(const std::vector<Cell *> &roots, std::vector<Cell *> &order);
+    // LoadSnapshot без блокировки правок
+    void ReadSnapshot(const std::string &path);
+    // SaveSnapshot без блокировки значений
+    void WriteSnapshot(std::ostream &output) const;
+    // Публикует изменённую ячейку для ReadValue и видов Snapshot, если они
+    // включены. Только из потока правки
+    void PublishCell(const Cell &cell);
+    // Опубликованное значение ячейки pos
+    ValueSlots::Value LoadValue(Position pos) const;
+    // Отмечает изменённую ячейку устаревшей для фонового пересчёта.
+    // reordered - правка могла переставить ячейки в топологическом порядке
+    void MarkStale(Cell *cell, bool reordered);
+    // Пересчитывает не больше limit устаревших ячеек по топологическому
+    // порядку, отмечая устаревшими их зависимые
+    void RecalculateStale(size_t limit);
+    // Дожидается, пока фоновый пересчёт не догонит правки, пересчитывая
+    // оставшееся в текущем потоке
+    void FinishRecalc();
+    bool IsStaleLocked(Position pos) const;
+    // В асинхронном режиме берёт таблицу совместно, чтобы читать значения
+    // ячеек, которые пишет фоновый пересчёт; иначе блокировка пустая. Не для
+    // потока, который таблицу уже держит
+    std::shared_lock<std::shared_mutex> LockValues() const;
+    // Тело фонового потока пересчёта
+    void RunRecalc();
+    // Отмечает правку ячейки в ленивом режиме: сдвигает эпоху правок, не
+    // пересчитывая зависимых
+    void MarkEdited(Cell *cell);
+    // Эпоха, к которой подтверждено значение ячейки; 0 - формулу надо
+    // вычислить заново
+    std::uint64_t GetVerifiedEpoch(const Cell &cell) const;
+    // Подтверждено ли значение ячейки в текущую эпоху
+    bool IsVerified(const Cell &cell) const;
+    // Подтверждает формулу cell, ссылки которой уже подтверждены: вычисляет
+    // её заново, если она правлена или одна из ссылок изменилась позже
+    void Verify(Cell &cell);
+    // Подтверждает ячейку pos и всё, от чего она зависит, без рекурсии
+    void VerifyCell(Position pos);
+    // Подтверждает все ячейки, затронутые правками ленивого режима. Значения
+    // формул - кэш, поэтому метод константный
+    void VerifyEdited() const;
+    // Запоминает значение ячейки до её первого изменения правкой, если есть
+    // подписки
+    void NoteChange(const Cell &cell);
+    // Ставит изменения правки в очередь доставки, отпускает lock и, если
+    // никто другой не доставляет, доставляет очередь слушателям
+    void DeliverChanges(std::unique_lock<std::shared_mutex> &lock);
+
+
+    // Пулы содержимого ячеек: текста и пустых значений и отдельно формул.
+    // Объявлены до ячеек, чтобы пережить их
+    FixedSizePool impl_pool_;
+    FixedSizePool formula_impl_pool_;
+    // Ссылки формул и обратные им связи. Тоже переживает ячейки
+    DependencyGraph graph_;
+    // Диапазоны формул: зависимости от ячеек диапазонов хранятся здесь, а
+    // не рёбрами графа
+    RangeIndex range_index_;
+    // Хранит ячейки
     // std::vector<std::vector<std::unique_ptr<CellInterface>>> cells_;
-    std::unordered_map<Position, std::unique_ptr<Cell>> cells_;
+    CellStorage cells_;
+    // Число непустых ячеек в каждой строке и в каждом столбце, где они есть.
+    // Последние ключи задают размер области печати
+    std::map<int, size_t> row_counts_;
+    std::map<int, size_t> col_counts_;
+    size_t evaluation_count_ = 0;
+    size_t last_recalc_count_ = 0;
+    // Номер последнего обхода зависимых ячеек и список ячеек, найденных
+    // им для пересчёта
+    std::uint64_t traversal_mark_ = 0;
+    std::vector<Cell *> dirty_;
+    // Куча ячеек, ждущих пересчёта в Recalculate, по номеру в порядке
+    std::vector<std::pair<std::int64_t, Cell *>> recalc_queue_;
+    // Границы топологического порядка ячеек: ячейки, созданные для ссылок,
+    // получают номера перед первой, остальные - после последней
+    std::int64_t first_order_ = 0;
+    std::int64_t last_order_ = 0;
+    // Пул потоков параллельного пересчёта; пуст в последовательном режиме
+    std::unique_ptr<ThreadPool> recalc_pool_;
+    // Счётчики для упорядочивания в SortDirtyCells, по номеру узла графа
+    std::vector<std::uint32_t> pending_refs_;
+    // Правки открытого пакета
+    std::optional<std::vector<BatchEdit>> batch_;
+    // Открытый журнал правок
+    std::unique_ptr<EditLog> log_;
+    // Правки берут её монопольно, чтение текста в ReadValue и значений в
+    // асинхронном режиме - совместно
+    mutable std::shared_mutex write_mutex_;
+    // Опубликованные значения ячеек; пусто, пока чтение из других потоков
+    // не включено
+    std::unique_ptr<ValueSlots> slots_;
+    // Ячейки для видов Snapshot; пусто до первого снимка и после того, как
+    // последний вид отпущен
+    std::unique_ptr<CellVersions> versions_;
+    // Ячейки, ждущие фонового пересчёта, с признаком правки самой ячейки, и
+    // очередь из них по номеру в топологическом порядке. Очередь
+    // перестраивается, если правка могла этот порядок изменить
+    std::unordered_map<Position, bool> stale_cells_;
+    std::priority_queue<std::pair<std::int64_t, Position>, std::vector<std::pair<std::int64_t, Position>>,
+                        std::greater<>>
+        stale_queue_;
+    bool stale_order_changed_ = false;
+    // Ленивый пересчёт: включён ли он, эпоха правок, эпоха, к которой
+    // подтверждены значения всех ячеек, и ячейки, правленые с тех пор
+    bool lazy_recalc_ = false;
+    std::uint64_t edit_epoch_ = 0;
+    std::uint64_t verified_epoch_ = 0;
+    std::unordered_set<Position> lazy_edits_;
+    // Стек обхода VerifyCell: ячейка и номер следующей её ссылки
+    std::vector<std::pair<Cell *, size_t>> verify_stack_;
+    // Правки, ждущие write_mutex_
+    std::atomic<size_t> waiting_writers_ = 0;
+    // Будит фоновый пересчёт, когда появляется работа, и ждущих его, когда
+    // он продвинулся
+    mutable std::condition_variable_any stale_cv_;
+    mutable std::condition_variable_any recalculated_cv_;
+    // Будит фоновый пересчёт, когда ждущих правок не осталось
+    std::condition_variable_any writers_cv_;
+    bool stop_recalc_ = false;
+    std::thread recalc_thread_;
+    // Подписки по номерам
+    std::map<size_t, std::shared_ptr<const Subscription>> subscriptions_;
+    size_t last_subscription_ = 0;
+    // Прежние значения ячеек, изменённых текущей правкой
+    std::unordered_map<Position, CellInterface::Value> changed_cells_;
+    // Очередь доставки; delivering_ - её разбирает какой-то поток
+    std::mutex delivery_mutex_;
+    std::deque<Delivery> deliveries_;
+    bool delivering_ = false;
 };
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include "sheet_view.h"
+
+#include <array>
+#include <iostream>
+#include <optional>
+#include <utility>
+
+struct SheetView::CellState
+{
+    std::shared_ptr<const std::string> text;
+    std::optional<FormulaInterface::Value> value;
+};
+
+template <typename Child, int SHIFT>
+struct SheetView::Node
+{
+    using ChildType = Child;
+
+    // Узел покрывает блок SIDE x SIDE детей, каждый из которых покрывает
+    // блок 2^shift x 2^shift ячеек
+    static constexpr int SIDE = 16;
+    static constexpr int CHILD_SHIFT = SHIFT;
+    static constexpr bool IS_LEAF = SHIFT == 0;
+
+    explicit Node(std::uint64_t generation) : generation(generation) {}
+
+    static int IndexOf(Position pos)
+    {
+        return (pos.row >> SHIFT & (SIDE - 1)) * SIDE + (pos.col >> SHIFT & (SIDE - 1));
+    }
+
+    // Версия, в которой создан узел
+    std::uint64_t generation;
+    std::array<std::shared_ptr<const Child>, SIDE * SIDE> children;
+};
+
+static_assert(Position::MAX_ROWS <= 1 << 14 && Position::MAX_COLS <= 1 << 14,
+              "the root of a sheet view covers 2^14 x 2^14 cells");
+
+namespace
+{
+    // Находит ячейку pos в поддереве node
+    template <typename N>
+    auto FindIn(const N &node, Position pos)
+    {
+        const auto *child = node.children[N::IndexOf(pos)].get();
+        if constexpr (N::IS_LEAF)
+        {
+            return child;
+        }
+        else
+        {
+            return child ? FindIn(*child, pos) : nullptr;
+        }
+    }
+
+    // Обходит ячейки строки row в поддереве node по возрастанию столбца;
+    // first_col - первый столбец поддерева
+    template <typename N, typename Visit>
+    void VisitRow(const N &node, int row, int first_col, Visit &visit)
+    {
+        const int first = (row >> N::CHILD_SHIFT & (N::SIDE - 1)) * N::SIDE;
+        for (int i = 0; i < N::SIDE; ++i)
+        {
+            const auto &child = node.children[first + i];
+            if (!child)
+            {
+                continue;
+            }
+            const int col = first_col + (i << N::CHILD_SHIFT);
+            if constexpr (N::IS_LEAF)
+            {
+                visit(col, *child);
+            }
+            else
+            {
+                VisitRow(*child, row, col, visit);
+            }
+        }
+    }
+} // namespace
+
+SheetView::SheetView(std::shared_ptr<const Root> root, Size size) : root_(std::move(root)), size_(size)
+{
+}
+
+CellInterface::Value SheetView::GetValue(Position pos) const
+{
+    const CellState *cell = Find(pos);
+    if (!cell)
+    {
+        return CellInterface::Value();
+    }
+    if (cell->value)
+    {
+        return std::visit([](auto value)
+                          { return CellInterface::Value(value); },
+                          *cell->value);
+    }
+    const std::string &text = *cell->text;
+    if (!text.empty() && text.front() == ESCAPE_SIGN)
+    {
+        return text.substr(1);
+    }
+    return text;
+}
+
+std::string SheetView::GetText(Position pos) const
+{
+    const CellState *cell = Find(pos);
+    return cell ? *cell->text : std::string();
+}
+
+Size SheetView::GetPrintableSize() const
+{
+    return size_;
+}
+
+void SheetView::PrintValues(std::ostream &output) const
+{
+    PrintCells(output, false);
+}
+
+void SheetView::PrintTexts(std::ostream &output) const
+{
+    PrintCells(output, true);
+}
+
+const SheetView::CellState *SheetView::Find(Position pos) const
+{
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("Invalid position");
+    }
+    return FindIn(*root_, pos);
+}
+
+void SheetView::PrintCells(std::ostream &output, bool texts) const
+{
+    // Как Sheet::PrintRows, но по дереву вида
+    std::string buffer;
+    int col = 0;
+    auto print = [this, &buffer, &col, texts](int cell_col, const CellState &cell)
+    {
+        if (cell_col >= size_.cols)
+        {
+            return;
+        }
+        buffer.append(cell_col - col, '\t');
+        col = cell_col;
+        if (texts || !cell.value)
+        {
+            const std::string &text = *cell.text;
+            const bool escaped = !texts && !text.empty() && text.front() == ESCAPE_SIGN;
+            buffer.append(text, escaped ? 1 : 0);
+        }
+        else
+        {
+            AppendFormulaValue(*cell.value, buffer);
+        }
+    };
+    for (int row = 0; row < size_.rows; ++row)
+    {
+        col = 0;
+        VisitRow(*root_, row, 0, print);
+        buffer.append(size_.cols - 1 - col, '\t');
+        buffer += '\n';
+    }
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+CellVersions::CellVersions() : root_(std::make_shared<SheetView::Root>(generation_))
+{
+}
+
+CellVersions::~CellVersions() = default;
+
+void CellVersions::Set(Position pos, std::string text, const FormulaInterface::Value *value)
+{
+    auto state = std::make_shared<SheetView::CellState>();
+    state->text = std::make_shared<const std::string>(std::move(text));
+    if (value)
+    {
+        state->value = *value;
+    }
+    Store(pos, std::move(state));
+}
+
+bool CellVersions::SetValue(Position pos, const FormulaInterface::Value &value)
+{
+    const SheetView::CellState *old = FindIn(*root_, pos);
+    if (!old)
+    {
+        return false;
+    }
+    auto state = std::make_shared<SheetView::CellState>();
+    state->text = old->text;
+    state->value = value;
+    Store(pos, std::move(state));
+    return true;
+}
+
+void CellVersions::Erase(Position pos)
+{
+    Store(pos, nullptr);
+}
+
+std::shared_ptr<const SheetView> CellVersions::Freeze(Size size)
+{
+    // Дальше текущее дерево только читается: правки копируют его узлы
+    ++generation_;
+    std::shared_ptr<const SheetView> view(new SheetView(root_, size));
+    last_view_ = view;
+    frozen_ = true;
+    return view;
+}
+
+bool CellVersions::IsViewed() const
+{
+    return !frozen_ || !last_view_.expired();
+}
+
+void CellVersions::Store(Position pos, std::shared_ptr<const SheetView::CellState> state)
+{
+    if (root_->generation != generation_)
+    {
+        root_ = std::make_shared<SheetView::Root>(*root_);
+        root_->generation = generation_;
+    }
+    Update(*root_, pos, std::move(state));
+}
+
+template <typename N>
+void CellVersions::Update(N &node, Position pos, std::shared_ptr<const SheetView::CellState> state)
+{
+    auto &child = node.children[N::IndexOf(pos)];
+    if constexpr (N::IS_LEAF)
+    {
+        child = std::move(state);
+    }
+    else
+    {
+        using Child = typename N::ChildType;
+        if (!child)
+        {
+            if (!state)
+            {
+                return;
+            }
+            child = std::make_shared<Child>(generation_);
+        }
+        else if (child->generation != generation_)
+        {
+            // Узел виден снимку: правка идёт в его копию
+            auto copy = std::make_shared<Child>(*child);
+            copy->generation = generation_;
+            child = std::move(copy);
+        }
+        // Узел текущей версии создан здесь же неконстантным
+        Update(const_cast<Child &>(*child), pos, std::move(state));
+    }
+}
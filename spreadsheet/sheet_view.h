@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+
+// Неизменяемый вид таблицы на момент Sheet::Snapshot: тексты и значения
+// всех ячеек, согласованные между собой. Вид не ссылается на таблицу,
+// читается из любого числа потоков и освобождается вместе с последним
+// указателем на него.
+//
+// Ячейки лежат в постоянном (persistent) дереве: лист хранит блок
+// 16 x 16 ячеек, каждый внутренний узел - 16 x 16 детей. Вид держит корень,
+// а правка таблицы после снимка копирует только путь от корня до листа
+// изменённой ячейки; остальные узлы остаются общими у всех видов и самой
+// таблицы. Поэтому снимок стоит O(1), а память растёт с числом изменённых
+// после него ячеек
+class SheetView
+{
+public:
+    // Как GetValue и GetText ячейки таблицы; пустая или отсутствующая
+    // ячейка - пустая строка
+    CellInterface::Value GetValue(Position pos) const;
+    std::string GetText(Position pos) const;
+
+    Size GetPrintableSize() const;
+    // Печатают то же, что PrintValues и PrintTexts таблицы в момент снимка
+    void PrintValues(std::ostream &output) const;
+    void PrintTexts(std::ostream &output) const;
+
+private:
+    friend class CellVersions;
+
+    // Непустая ячейка: её текст и, у формулы, значение. Текст общий у
+    // состояний ячейки, различающихся только значением
+    struct CellState;
+    template <typename Child, int SHIFT>
+    struct Node;
+    using Leaf = Node<CellState, 0>;
+    using Branch = Node<Leaf, 4>;
+    using Trunk = Node<Branch, 8>;
+    using Root = Node<Trunk, 12>;
+
+    SheetView(std::shared_ptr<const Root> root, Size size);
+
+    const CellState *Find(Position pos) const;
+    void PrintCells(std::ostream &output, bool texts) const;
+
+    std::shared_ptr<const Root> root_;
+    Size size_;
+};
+
+// Изменяемая сторона видов: таблица записывает сюда каждую изменённую
+// ячейку. Узлы, созданные после последнего снимка, меняются на месте,
+// а попавшие в снимок копируются при первом изменении
+class CellVersions
+{
+public:
+    CellVersions();
+    ~CellVersions();
+
+    CellVersions(const CellVersions &) = delete;
+    CellVersions &operator=(const CellVersions &) = delete;
+
+    // value задаётся для формулы, для текста - nullptr
+    void Set(Position pos, std::string text, const FormulaInterface::Value *value);
+    // Меняет значение формулы, оставляя её текст общим с прежним
+    // состоянием. Возвращает false, если ячейки pos в версиях нет
+    bool SetValue(Position pos, const FormulaInterface::Value &value);
+    void Erase(Position pos);
+
+    // Замораживает текущую версию ячеек и возвращает её вид
+    std::shared_ptr<const SheetView> Freeze(Size size);
+    // Жив ли вид, выданный последним Freeze; до первого Freeze версии ещё
+    // строятся и считаются нужными. Более старые виды от версий не зависят:
+    // их деревья уже заморожены
+    bool IsViewed() const;
+
+private:
+    // Кладёт состояние ячейки в текущую версию; nullptr удаляет ячейку
+    void Store(Position pos, std::shared_ptr<const SheetView::CellState> state);
+    template <typename N>
+    void Update(N &node, Position pos, std::shared_ptr<const SheetView::CellState> state);
+
+    std::shared_ptr<SheetView::Root> root_;
+    std::weak_ptr<const SheetView> last_view_;
+    bool frozen_ = false;
+    // Номер текущей версии: узлы с меньшим номером принадлежат снимкам
+    std::uint64_t generation_ = 0;
+};
@@ -0,0 +1,399 @@
+#include "snapshot.h"
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SNAPSHOT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define SNAPSHOT_MMAP 0
+#endif
+
+using namespace std::literals;
+
+namespace
+{
+    using Instruction = ASTImpl::Instruction;
+
+    // Содержимое файла снимка: отображение в память или, где его нет,
+    // прочитанный целиком буфер, выровненный так же
+    class SnapshotFile
+    {
+    public:
+        explicit SnapshotFile(const std::string &path)
+        {
+#if SNAPSHOT_MMAP
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd >= 0)
+            {
+                struct stat info;
+                if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+                {
+                    const auto size = static_cast<size_t>(info.st_size);
+                    void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (data != MAP_FAILED)
+                    {
+                        data_ = static_cast<const char *>(data);
+                        size_ = size;
+                        mapped_ = true;
+                    }
+                }
+                ::close(fd);
+                if (mapped_)
+                {
+                    return;
+                }
+            }
+#endif
+            std::ifstream input(path, std::ios::binary | std::ios::ate);
+            if (!input)
+            {
+                throw SnapshotException("Cannot open snapshot "s + path);
+            }
+            size_ = static_cast<size_t>(input.tellg());
+            buffer_ = std::make_unique<std::uint64_t[]>(size_ / sizeof(std::uint64_t) + 1);
+            input.seekg(0);
+            if (!input.read(reinterpret_cast<char *>(buffer_.get()), static_cast<std::streamsize>(size_)))
+            {
+                throw SnapshotException("Cannot read snapshot "s + path);
+            }
+            data_ = reinterpret_cast<const char *>(buffer_.get());
+        }
+
+        ~SnapshotFile()
+        {
+#if SNAPSHOT_MMAP
+            if (mapped_)
+            {
+                ::munmap(const_cast<char *>(data_), size_);
+            }
+#endif
+        }
+
+        SnapshotFile(const SnapshotFile &) = delete;
+        SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+        const char *GetData() const
+        {
+            return data_;
+        }
+
+        size_t GetSize() const
+        {
+            return size_;
+        }
+
+    private:
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+        bool mapped_ = false;
+        std::unique_ptr<std::uint64_t[]> buffer_;
+    };
+
+    [[noreturn]] void Corrupt(const std::string &what)
+    {
+        throw SnapshotException("Corrupt snapshot: "s + what);
+    }
+
+    size_t AlignRecord(size_t size)
+    {
+        return (size + 7) & ~size_t{7};
+    }
+
+    void Write(std::ostream &output, const void *data, size_t size)
+    {
+        output.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    }
+
+    void WriteInstruction(std::ostream &output, const Instruction &instruction)
+    {
+        // Поля копируются по одному, чтобы байты выравнивания были нулями
+        char bytes[sizeof(Instruction)] = {};
+        std::memcpy(bytes + offsetof(Instruction, op), &instruction.op, sizeof(instruction.op));
+        std::memcpy(bytes + offsetof(Instruction, operand), &instruction.operand, sizeof(instruction.operand));
+        std::memcpy(bytes + offsetof(Instruction, number), &instruction.number, sizeof(instruction.number));
+        Write(output, bytes, sizeof(bytes));
+    }
+
+    bool IsValidError(std::uint8_t error)
+    {
+        return error <= static_cast<std::uint8_t>(FormulaError::Category::Arithmetic);
+    }
+} // namespace
+
+void Sheet::SaveSnapshot(std::ostream &output) const
+{
+    auto lock = LockValues();
+    WriteSnapshot(output);
+}
+
+void Sheet::WriteSnapshot(std::ostream &output) const
+{
+    VerifyEdited();
+    // Пустые ячейки нужны снимку, только если на них ссылаются формулы
+    std::vector<const Cell *> cells;
+    cells.reserve(cells_.GetSize());
+    cells_.ForEach([&cells](Position, const Cell &cell)
+                   {
+                       if (!cell.IsEmpty() || cell.IsReferenced())
+                       {
+                           cells.push_back(&cell);
+                       }
+                   });
+    std::sort(cells.begin(), cells.end(), [](const Cell *lhs, const Cell *rhs)
+              { return lhs->order_ < rhs->order_; });
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.cell_size = sizeof(SnapshotCell);
+    header.instruction_size = sizeof(Instruction);
+    header.cell_count = cells.size();
+    Write(output, &header, sizeof(header));
+
+    const char padding[8] = {};
+    for (const Cell *cell : cells)
+    {
+        SnapshotCell record{};
+        record.row = cell->pos_.row;
+        record.col = cell->pos_.col;
+        if (const auto *error = std::get_if<FormulaError>(&cell->value_))
+        {
+            record.is_error = 1;
+            record.error = static_cast<std::uint8_t>(error->GetCategory());
+        }
+        else
+        {
+            record.value = std::get<double>(cell->value_);
+        }
+
+        std::string text;
+        std::vector<Position> refs;
+        std::vector<CellRange> ranges;
+        FormulaProgram program;
+        if (const FormulaInterface *formula = cell->GetFormula())
+        {
+            record.kind = SnapshotCell::Kind::Formula;
+            text = formula->GetExpression();
+            refs = formula->GetReferencedCells();
+            ranges = formula->GetReferencedRanges();
+            program = formula->GetProgram();
+        }
+        else
+        {
+            record.kind = cell->IsEmpty() ? SnapshotCell::Kind::Empty : SnapshotCell::Kind::Text;
+            text = cell->GetText();
+        }
+        record.text_size = static_cast<std::uint32_t>(text.size());
+        record.ref_count = static_cast<std::uint32_t>(refs.size());
+        record.range_count = static_cast<std::uint32_t>(ranges.size());
+        record.program_size = static_cast<std::uint32_t>(program.size);
+        record.stack_size = static_cast<std::uint32_t>(program.stack_size);
+
+        Write(output, &record, sizeof(record));
+        Write(output, refs.data(), refs.size() * sizeof(Position));
+        Write(output, ranges.data(), ranges.size() * sizeof(CellRange));
+        for (size_t i = 0; i < program.size; ++i)
+        {
+            WriteInstruction(output, program.code[i]);
+        }
+        Write(output, text.data(), text.size());
+        Write(output, padding, AlignRecord(text.size()) - text.size());
+    }
+    if (!output)
+    {
+        throw SnapshotException("Cannot write snapshot"s);
+    }
+}
+
+void Sheet::LoadSnapshot(const std::string &path)
+{
+    WriteLock lock(*this);
+    FinishRecalc();
+    ReadSnapshot(path);
+}
+
+void Sheet::ReadSnapshot(const std::string &path)
+{
+    if (batch_)
+    {
+        throw std::logic_error("Cannot load a snapshot into an open batch"s);
+    }
+    if (cells_.GetSize() != 0)
+    {
+        throw std::logic_error("A snapshot can only be loaded into an empty sheet"s);
+    }
+    if (log_)
+    {
+        // Загрузка не попадает в журнал, и он разошёлся бы с таблицей
+        throw std::logic_error("Cannot load a snapshot while the edit log is open"s);
+    }
+    // Формулы снимка указывают в отображённый файл и не дают его закрыть
+    const auto file = std::make_shared<const SnapshotFile>(path);
+    const char *data = file->GetData();
+    const size_t size = file->GetSize();
+
+    SnapshotHeader header;
+    if (size < sizeof(header))
+    {
+        Corrupt("the header is truncated"s);
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        Corrupt("not a sheet snapshot"s);
+    }
+    if (header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER ||
+        header.cell_size != sizeof(SnapshotCell) || header.instruction_size != sizeof(Instruction))
+    {
+        Corrupt("unsupported version or layout"s);
+    }
+    // Каждая ячейка занимает хотя бы запись, так что размер файла
+    // ограничивает число ячеек до выделения памяти под них
+    if (header.cell_count > (size - sizeof(header)) / sizeof(SnapshotCell))
+    {
+        Corrupt("too many cells"s);
+    }
+
+    std::vector<Position> loaded;
+    loaded.reserve(static_cast<size_t>(header.cell_count));
+    try
+    {
+        size_t offset = sizeof(header);
+        for (std::uint64_t i = 0; i < header.cell_count; ++i)
+        {
+            SnapshotCell record;
+            if (size - offset < sizeof(record))
+            {
+                Corrupt("a cell is truncated"s);
+            }
+            std::memcpy(&record, data + offset, sizeof(record));
+            const Position pos{record.row, record.col};
+            if (!pos.IsValid() || cells_.Find(pos))
+            {
+                Corrupt("invalid or repeated position "s + pos.ToString());
+            }
+            const size_t refs_offset = offset + sizeof(record);
+            const size_t ranges_offset = refs_offset + size_t{record.ref_count} * sizeof(Position);
+            const size_t program_offset = ranges_offset + size_t{record.range_count} * sizeof(CellRange);
+            const size_t text_offset = program_offset + size_t{record.program_size} * sizeof(Instruction);
+            const size_t end = text_offset + record.text_size;
+            if (end > size)
+            {
+                Corrupt("cell "s + pos.ToString() + " is truncated"s);
+            }
+            const auto *refs = reinterpret_cast<const Position *>(data + refs_offset);
+            const auto *ranges = reinterpret_cast<const CellRange *>(data + ranges_offset);
+            const FormulaProgram program{reinterpret_cast<const Instruction *>(data + program_offset),
+                                         record.program_size, record.stack_size, ranges, record.range_count};
+            const std::string_view text(data + text_offset, record.text_size);
+
+            const bool is_formula = record.kind == SnapshotCell::Kind::Formula;
+            if (!is_formula && (record.ref_count != 0 || record.range_count != 0 || record.program_size != 0))
+            {
+                Corrupt("cell "s + pos.ToString() + " is not a formula"s);
+            }
+            if (is_formula)
+            {
+                // Ссылки только на уже загруженные ячейки: так снимок не
+                // может задать цикл, а порядок файла остаётся топологическим
+                for (std::uint32_t j = 0; j < record.ref_count; ++j)
+                {
+                    if (!refs[j].IsValid() || !cells_.Find(refs[j]) || (j > 0 && !(refs[j - 1] < refs[j])))
+                    {
+                        Corrupt("invalid references of cell "s + pos.ToString());
+                    }
+                }
+                for (std::uint32_t j = 0; j < record.range_count; ++j)
+                {
+                    if (!ranges[j].IsValid() || ranges[j].Contains(pos) || (j > 0 && !(ranges[j - 1] < ranges[j])))
+                    {
+                        Corrupt("invalid ranges of cell "s + pos.ToString());
+                    }
+                }
+                if (!IsValidProgram(program, record.ref_count) ||
+                    (record.is_error && !IsValidError(record.error)))
+                {
+                    Corrupt("invalid formula in cell "s + pos.ToString());
+                }
+            }
+            else if ((record.kind == SnapshotCell::Kind::Empty) != text.empty() ||
+                     (record.kind != SnapshotCell::Kind::Empty && record.kind != SnapshotCell::Kind::Text) ||
+                     Cell::IsFormulaText(text))
+            {
+                Corrupt("invalid text in cell "s + pos.ToString());
+            }
+
+            // Ячейка диапазона записывается раньше его формулы
+            if (range_index_.Covers(pos))
+            {
+                Corrupt("cell "s + pos.ToString() + " follows a formula over its range"s);
+            }
+
+            Cell *cell = cells_.Emplace(*this, pos);
+            loaded.push_back(pos);
+            if (is_formula)
+            {
+                Cell::Content content(*cell, MakeCompiledFormula(text, refs, record.ref_count, program, file));
+                cell->Swap(content);
+                if (record.is_error)
+                {
+                    cell->value_ = FormulaError(static_cast<FormulaError::Category>(record.error));
+                }
+                else
+                {
+                    cell->value_ = record.value;
+                }
+            }
+            else if (!text.empty())
+            {
+                Cell::Content content(*cell, std::string(text));
+                cell->Swap(content);
+            }
+            UpdatePrintableArea(pos, true, cell->IsEmpty());
+            offset = AlignRecord(end);
+            if (offset > size)
+            {
+                Corrupt("cell "s + pos.ToString() + " is truncated"s);
+            }
+        }
+        if (offset != size)
+        {
+            Corrupt("unexpected data after the last cell"s);
+        }
+    }
+    catch (...)
+    {
+        // Сначала ячейки отвязываются от ссылок, начиная с последних, затем
+        // удаляются; таблица была пустой, и такой же и остаётся
+        for (auto it = loaded.rbegin(); it != loaded.rend(); ++it)
+        {
+            Cell::Content empty(*cells_.Find(*it), ""s);
+            cells_.Find(*it)->Swap(empty);
+        }
+        for (Position pos : loaded)
+        {
+            cells_.Erase(pos);
+        }
+        row_counts_.clear();
+        col_counts_.clear();
+        throw;
+    }
+    for (Position pos : loaded)
+    {
+        PublishCell(*cells_.Find(pos));
+    }
+}
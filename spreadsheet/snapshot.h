@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+#include "formula_program.h"
+
+#include <cstdint>
+#include <stdexcept>
+
+// Двоичный снимок таблицы: Sheet::SaveSnapshot и Sheet::LoadSnapshot.
+//
+// Файл начинается с заголовка SnapshotHeader, за которым идут записи ячеек
+// в топологическом порядке: ячейка записана после всех ячеек, на которые
+// ссылается её формула, в том числе через диапазон. Запись - это
+// SnapshotCell, за которой лежат ref_count позиций Position, range_count
+// диапазонов CellRange, program_size инструкций ASTImpl::Instruction и
+// text_size байт текста; каждая запись выровнена на 8 байт, поэтому
+// позиции, диапазоны и программы читаются прямо из отображённого в память
+// файла.
+// Текст формулы - её выражение без знака равенства. Пустые ячейки, на
+// которые ссылаются формулы, записываются без текста.
+//
+// Числа хранятся в порядке байтов записавшей машины. Снимок другой версии,
+// с другим порядком байтов или раскладкой структур не загружается
+
+// Бросается, если снимок не удаётся прочитать или записать либо он повреждён
+class SnapshotException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+inline constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+// Записывается как есть: на машине с другим порядком байтов читается иначе
+inline constexpr std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    // Размеры структур, с которыми записан снимок
+    std::uint32_t cell_size;
+    std::uint32_t instruction_size;
+    std::uint64_t cell_count;
+};
+
+struct SnapshotCell
+{
+    enum class Kind : std::uint8_t
+    {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    std::int32_t row;
+    std::int32_t col;
+    Kind kind;
+    // Значение формулы: число value или ошибка error (FormulaError::Category)
+    std::uint8_t is_error;
+    std::uint8_t error;
+    std::uint8_t reserved;
+    std::uint32_t text_size;
+    double value;
+    std::uint32_t ref_count;
+    std::uint32_t program_size;
+    // Размер стека программы формулы
+    std::uint32_t stack_size;
+    std::uint32_t range_count;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32 && sizeof(SnapshotCell) == 40,
+              "snapshot structures must not have padding");
+static_assert(sizeof(Position) == 8 && sizeof(CellRange) == 16 && alignof(ASTImpl::Instruction) <= 8 &&
+                  sizeof(ASTImpl::Instruction) % 8 == 0,
+              "positions, ranges and programs must stay 8-byte aligned in a snapshot");
@@ -73,6 +73,43 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool CellRange::operator==(const CellRange rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::operator<(const CellRange rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool CellRange::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool CellRange::Contains(const Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+std::string CellRange::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
+CellRange CellRange::FromString(std::string_view str) {
+    const auto colon = str.find(':');
+    if (colon == std::string_view::npos) {
+        return {Position::NONE, Position::NONE};
+    }
+    const Position lhs = Position::FromString(str.substr(0, colon));
+    const Position rhs = Position::FromString(str.substr(colon + 1));
+    if (!lhs.IsValid() || !rhs.IsValid()) {
+        return {Position::NONE, Position::NONE};
+    }
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
@@ -0,0 +1,147 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace
+{
+    // Пул и номер очереди текущего рабочего потока
+    thread_local const ThreadPool *current_pool = nullptr;
+    thread_local size_t current_queue = 0;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    threads = std::max<size_t>(threads, 1);
+    queues_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    threads_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        threads_.emplace_back([this, i]
+                              { Run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+    return threads_.size();
+}
+
+void ThreadPool::Submit(Task task)
+{
+    size_t queue = current_pool == this
+                       ? current_queue
+                       : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    Push(queue, std::move(task));
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock lock(mutex_);
+    done_cv_.wait(lock, [this]
+                  { return pending_ == 0; });
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &body)
+{
+    chunk = std::max<size_t>(chunk, 1);
+    // Отрезки раскладываются по очередям поровну, дальше потоки выравнивают
+    // нагрузку перехватом
+    size_t queue = 0;
+    for (size_t begin = 0; begin < count; begin += chunk)
+    {
+        size_t end = std::min(count, begin + chunk);
+        Push(queue, [&body, begin, end]
+             { body(begin, end); });
+        queue = (queue + 1) % queues_.size();
+    }
+    Wait();
+}
+
+void ThreadPool::Push(size_t queue, Task task)
+{
+    ++pending_;
+    {
+        std::lock_guard lock(queues_[queue]->mutex);
+        queues_[queue]->tasks.push_back(std::move(task));
+    }
+    ++queued_;
+    // Захват мьютекса гарантирует, что поток, проверивший queued_ перед
+    // засыпанием, получит уведомление
+    {
+        std::lock_guard lock(mutex_);
+    }
+    work_cv_.notify_one();
+}
+
+bool ThreadPool::TryPop(size_t queue, Task &task)
+{
+    {
+        Queue &own = *queues_[queue];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued_;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i)
+    {
+        Queue &other = *queues_[(queue + i) % queues_.size()];
+        std::lock_guard lock(other.mutex);
+        if (!other.tasks.empty())
+        {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            --queued_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::Run(size_t queue)
+{
+    current_pool = this;
+    current_queue = queue;
+    for (;;)
+    {
+        Task task;
+        if (TryPop(queue, task))
+        {
+            task();
+            if (--pending_ == 0)
+            {
+                std::lock_guard lock(mutex_);
+                done_cv_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock lock(mutex_);
+        work_cv_.wait(lock, [this]
+                      { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0)
+        {
+            return;
+        }
+    }
+}
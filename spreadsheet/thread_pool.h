@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы (work stealing). У каждого потока своя
+// очередь задач: поток берёт задачи с её конца, а освободившись, забирает
+// задачи из начала очередей соседей. Задачи не должны бросать исключений.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t GetThreadCount() const;
+
+    // Ставит задачу в очередь. Задача, поставленная из рабочего потока,
+    // попадает в его собственную очередь
+    void Submit(Task task);
+    // Ждёт выполнения всех поставленных задач, включая поставленные другими
+    // задачами. Нельзя вызывать из рабочего потока пула
+    void Wait();
+
+    // Разбивает [0, count) на отрезки длиной не больше chunk, выполняет
+    // body(begin, end) для каждого из них и ждёт завершения
+    void ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &body);
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void Push(size_t queue, Task task);
+    // Берёт задачу из своей очереди, а если она пуста, то из чужой
+    bool TryPop(size_t queue, Task &task);
+    void Run(size_t queue);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::atomic<size_t> queued_{0};  // задачи, лежащие в очередях
+    std::atomic<size_t> pending_{0}; // задачи, которые ещё не завершились
+    std::atomic<size_t> next_queue_{0};
+    bool stop_ = false;
+};
@@ -0,0 +1,132 @@
+#include "value_slots.h"
+
+#include <cassert>
+#include <cstring>
+
+ValueSlots::ValueSlots() = default;
+
+ValueSlots::~ValueSlots()
+{
+    for (auto &row : tiles_)
+    {
+        TileRow *tile_row = row.load(std::memory_order_relaxed);
+        if (!tile_row)
+        {
+            continue;
+        }
+        for (auto &tile : *tile_row)
+        {
+            delete tile.load(std::memory_order_relaxed);
+        }
+        delete tile_row;
+    }
+}
+
+void ValueSlots::StoreEmpty(Position pos)
+{
+    Store(pos, Kind::Empty, 0);
+}
+
+void ValueSlots::StoreNumber(Position pos, double number)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    Store(pos, Kind::Number, bits);
+}
+
+void ValueSlots::StoreError(Position pos, FormulaError::Category error)
+{
+    Store(pos, Kind::Error, static_cast<std::uint64_t>(error));
+}
+
+void ValueSlots::StoreText(Position pos)
+{
+    Store(pos, Kind::Text, 0);
+}
+
+void ValueSlots::Store(Position pos, Kind kind, std::uint64_t bits)
+{
+    Slot &slot = GetOrCreateSlot(pos);
+    const std::uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    // Нечётная версия становится видна раньше нового значения
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.kind.store(kind, std::memory_order_relaxed);
+    slot.bits.store(bits, std::memory_order_relaxed);
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+ValueSlots::Value ValueSlots::Load(Position pos) const
+{
+    assert(pos.IsValid());
+    const Slot *slot = FindSlot(pos);
+    if (!slot)
+    {
+        return {};
+    }
+    Value value;
+    std::uint64_t bits;
+    for (;;)
+    {
+        const std::uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        value.kind = slot->kind.load(std::memory_order_relaxed);
+        bits = slot->bits.load(std::memory_order_relaxed);
+        // Значение прочитано раньше, чем версия после него
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const std::uint64_t after = slot->sequence.load(std::memory_order_relaxed);
+        if (before == after && before % 2 == 0)
+        {
+            value.version = before / 2;
+            break;
+        }
+    }
+    if (value.kind == Kind::Number)
+    {
+        std::memcpy(&value.number, &bits, sizeof(bits));
+    }
+    else if (value.kind == Kind::Error)
+    {
+        value.error = static_cast<FormulaError::Category>(bits);
+    }
+    return value;
+}
+
+size_t ValueSlots::GetMemoryUsage() const
+{
+    return sizeof(*this) + tile_row_count_.load(std::memory_order_relaxed) * sizeof(TileRow) +
+           tile_count_.load(std::memory_order_relaxed) * sizeof(Tile);
+}
+
+ValueSlots::Slot &ValueSlots::GetOrCreateSlot(Position pos)
+{
+    assert(pos.IsValid());
+    // Новый блок становится виден читателям уже заполненным
+    auto &row = tiles_[pos.row / TILE_SIZE];
+    TileRow *tile_row = row.load(std::memory_order_relaxed);
+    if (!tile_row)
+    {
+        tile_row = new TileRow();
+        row.store(tile_row, std::memory_order_release);
+        ++tile_row_count_;
+    }
+    auto &entry = (*tile_row)[pos.col / TILE_SIZE];
+    Tile *tile = entry.load(std::memory_order_relaxed);
+    if (!tile)
+    {
+        tile = new Tile;
+        entry.store(tile, std::memory_order_release);
+        ++tile_count_;
+    }
+    return tile->slots[pos.row % TILE_SIZE * TILE_SIZE + pos.col % TILE_SIZE];
+}
+
+const ValueSlots::Slot *ValueSlots::FindSlot(Position pos) const
+{
+    const TileRow *tile_row = tiles_[pos.row / TILE_SIZE].load(std::memory_order_acquire);
+    if (!tile_row)
+    {
+        return nullptr;
+    }
+    const Tile *tile = (*tile_row)[pos.col / TILE_SIZE].load(std::memory_order_acquire);
+    return tile ? &tile->slots[pos.row % TILE_SIZE * TILE_SIZE + pos.col % TILE_SIZE] : nullptr;
+}
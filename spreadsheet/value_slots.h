@@ -0,0 +1,89 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Опубликованные значения ячеек для чтения из других потоков
+// (Sheet::EnableConcurrentReads). Значение каждой позиции лежит в своём
+// слоте из атомарных слов, защищённом счётчиком версий (seqlock): писатель
+// делает версию нечётной, меняет слово значения и снова делает её чётной, а
+// читатель повторяет чтение, пока не увидит одну и ту же чётную версию до и
+// после. Так читатель не берёт блокировок и не видит значения наполовину.
+//
+// Слоты разбиты на блоки TILE_SIZE x TILE_SIZE, как ячейки в CellStorage.
+// Блок создаётся при первой публикации в нём и живёт до уничтожения
+// таблицы, поэтому читатель может обращаться к нему без блокировок.
+// Публикует значения один поток за раз
+class ValueSlots
+{
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    enum class Kind : std::uint8_t
+    {
+        Empty,
+        Number,
+        Error,
+        // Сам текст в слот не помещается: его читают из ячейки
+        Text,
+    };
+
+    struct Value
+    {
+        Kind kind = Kind::Empty;
+        double number = 0;
+        FormulaError::Category error = FormulaError::Category::Ref;
+        // Растёт с каждой публикацией в слот; 0 - публикаций не было
+        std::uint64_t version = 0;
+    };
+
+    ValueSlots();
+    ~ValueSlots();
+
+    ValueSlots(const ValueSlots &) = delete;
+    ValueSlots &operator=(const ValueSlots &) = delete;
+
+    void StoreEmpty(Position pos);
+    void StoreNumber(Position pos, double number);
+    void StoreError(Position pos, FormulaError::Category error);
+    void StoreText(Position pos);
+
+    // Из любого потока, без блокировок
+    Value Load(Position pos) const;
+
+    // Память, занятая блоками и каталогом, в байтах
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Slot
+    {
+        // Нечётная, пока значение меняется
+        std::atomic<std::uint64_t> sequence{0};
+        std::atomic<std::uint64_t> bits{0};
+        std::atomic<Kind> kind{Kind::Empty};
+    };
+
+    struct Tile
+    {
+        std::array<Slot, TILE_SIZE * TILE_SIZE> slots;
+    };
+
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+    static_assert(TILE_ROWS * TILE_SIZE == Position::MAX_ROWS && TILE_COLS * TILE_SIZE == Position::MAX_COLS,
+                  "the sheet must consist of whole tiles");
+
+    using TileRow = std::array<std::atomic<Tile *>, TILE_COLS>;
+
+    void Store(Position pos, Kind kind, std::uint64_t bits);
+    Slot &GetOrCreateSlot(Position pos);
+    const Slot *FindSlot(Position pos) const;
+
+    std::array<std::atomic<TileRow *>, TILE_ROWS> tiles_{};
+    std::atomic<size_t> tile_count_{0};
+    std::atomic<size_t> tile_row_count_{0};
+};